@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../topsig-global.h"
+#include "../topsig-sigfile.h"
+
+// Converts a signature file between the record-oriented version 2 layout
+// and the columnar version 3 layout.
+
+#define CONVERT_BLOCK 4096
+
+int main(int argc, char **argv)
+{
+  if (argc < 4) {
+    fprintf(stderr, "usage: {input sigfile} {output sigfile} {output version (2 or 3)}\n");
+    return 0;
+  }
+  FILE *fi;
+  if ((fi = fopen(argv[1], "rb"))) {
+    SigFileHeader H = SigFileReadHeader(fi);
+    SigFileHeader H_out = H;
+    H_out.version = atoi(argv[3]);
+    SigFileWriter *W = SigFileCreate(argv[2], &H_out);
+
+    unsigned char *buffer = malloc(SigFileBlockSize(&H, CONVERT_BLOCK));
+    int header_fields[SIGFILE_HEADER_FIELDS];
+    SigBlock B;
+    int sigs_copied = 0;
+    while (SigFileReadBlock(&H, fi, sigs_copied, CONVERT_BLOCK, buffer, &B) > 0) {
+      for (int i = 0; i < B.count; i++) {
+        for (int j = 0; j < SIGFILE_HEADER_FIELDS; j++) {
+          header_fields[j] = SigBlockHeaderField(&B, i, j);
+        }
+        SigFileWrite(W, SigBlockDocid(&B, i), header_fields, SigBlockSignature(&B, i));
+      }
+      sigs_copied += B.count;
+    }
+    free(buffer);
+
+    SigFileClose(W);
+    fclose(fi);
+    fprintf(stderr, "%d signatures converted to version %d\n", sigs_copied, H_out.version);
+  } else {
+    fprintf(stderr, "Unable to open input file\n");
+  }
+
+  return 0;
+}
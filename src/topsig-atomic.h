@@ -17,6 +17,10 @@ static inline int atomic_cas(volatile int *i, int before, int after) {
   return __sync_bool_compare_and_swap(i, before, after);
 }
 
+static inline int atomic_cas64(volatile long long *i, long long before, long long after) {
+  return __sync_bool_compare_and_swap(i, before, after);
+}
+
 static inline int atomic_get(volatile int *i) {
   return __sync_bool_compare_and_swap(i, 123897213, 123897213);
 }
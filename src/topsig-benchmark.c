@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "topsig-benchmark.h"
+#include "topsig-config.h"
+#include "topsig-global.h"
+#include "topsig-hamming.h"
+#include "topsig-semaphore.h"
+#include "topsig-thread.h"
+#include "topsig-timer.h"
+
+// Microbenchmarks for the search kernels. These are not listed in usage().
+
+#define BENCHMARK_BATCH 256
+
+// benchmark-distance: compares one DocumentDistance call per record against
+// DocumentDistanceBatch over records laid out as in a signature file.
+// BENCHMARK-RECORDS - records per width (default 100000)
+// BENCHMARK-REPEAT - passes over the records per measurement (default 20)
+void RunDistanceBenchmark()
+{
+  static const int widths[] = {256, 512, 1024, 2048, 4096};
+  int records = 100000;
+  int repeat = 20;
+  int docnamelen = 255;
+  if (Config("BENCHMARK-RECORDS"))
+    records = atoi(Config("BENCHMARK-RECORDS"));
+  if (Config("BENCHMARK-REPEAT"))
+    repeat = atoi(Config("BENCHMARK-REPEAT"));
+  if (Config("MAX-DOCNAME-LENGTH"))
+    docnamelen = atoi(Config("MAX-DOCNAME-LENGTH"));
+  
+  printf("Hamming kernel: %s\n", HammingKernelName());
+  
+  for (unsigned int w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+    int sig_width = widths[w];
+    size_t sig_offset = docnamelen + 1 + 8 * 4;
+    size_t sig_record_size = sig_offset + sig_width / 8;
+    
+    unsigned char *buffer = malloc(sig_record_size * records);
+    unsigned char bsig[sig_width / 8];
+    unsigned char bmask[sig_width / 8];
+    if (!buffer) error_oom();
+    for (size_t i = 0; i < sig_record_size * records; i++) buffer[i] = rand();
+    for (int i = 0; i < sig_width / 8; i++) {
+      bsig[i] = rand();
+      bmask[i] = rand();
+    }
+    
+    long long sum_single = 0;
+    long long sum_batch = 0;
+    int dists[BENCHMARK_BATCH];
+    
+    timer T = timer_start();
+    for (int r = 0; r < repeat; r++) {
+      for (int i = 0; i < records; i++) {
+        sum_single += DocumentDistance(sig_width, bsig, bmask, buffer + sig_record_size * i + sig_offset);
+      }
+    }
+    double ms_single = timer_tick(&T);
+    for (int r = 0; r < repeat; r++) {
+      for (int i = 0; i < records; i += BENCHMARK_BATCH) {
+        int n = records - i < BENCHMARK_BATCH ? records - i : BENCHMARK_BATCH;
+        DocumentDistanceBatch(sig_width, bsig, bmask, buffer + sig_record_size * i + sig_offset, sig_record_size, n, dists);
+        for (int j = 0; j < n; j++) sum_batch += dists[j];
+      }
+    }
+    double ms_batch = timer_tick(&T);
+    
+    if (sum_single != sum_batch) {
+      fprintf(stderr, "Error: batched distances do not match (%lld vs %lld)\n", sum_batch, sum_single);
+      exit(1);
+    }
+    
+    double sigs = (double)records * repeat;
+    printf("width %4d: per-record %6.2f ns/sig, batched %6.2f ns/sig (%.2fx)\n", sig_width, ms_single * 1000000.0 / sigs, ms_batch * 1000000.0 / sigs, ms_single / ms_batch);
+    
+    free(buffer);
+  }
+}
+
+// User and system CPU time used so far by every thread, in seconds
+static double cpu_seconds()
+{
+  struct rusage u;
+  getrusage(RUSAGE_SELF, &u);
+  return u.ru_utime.tv_sec + u.ru_stime.tv_sec + (u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1000000.0;
+}
+
+typedef struct {
+  TSemaphore ping;
+  TSemaphore pong;
+  int rounds;
+} PingPong;
+
+static void *pingpong_partner(void *input)
+{
+  PingPong *P = input;
+  for (int i = 0; i < P->rounds; i++) {
+    tsem_wait(&P->ping);
+    tsem_post(&P->pong);
+  }
+  return NULL;
+}
+
+// A short job so that dispatching it costs about as much as running it
+static void *pool_job(void *thread_input, void *job_input)
+{
+  (void)job_input;
+  volatile unsigned int *x = thread_input;
+  for (int i = 0; i < 1000; i++) *x = *x * 1103515245 + 12345;
+  return NULL;
+}
+
+// benchmark-threading: measures the thread synchronisation with waiting
+// threads sleeping (as topsig now does) and with them yielding the processor
+// in a loop until they can continue (as topsig used to). Reports the
+// throughput and the CPU time used for:
+//   passing a semaphore back and forth between two threads
+//   giving short jobs to a broadcast pool (as the ISSL and topic searches do)
+//   leaving a broadcast pool idle for a second
+// BENCHMARK-THREADS - threads in the pool (default 4)
+// BENCHMARK-REPEAT - semaphore round trips and pool jobs (default 100000)
+void RunThreadingBenchmark()
+{
+  int threads = 4;
+  int repeat = 100000;
+  if (Config("BENCHMARK-THREADS"))
+    threads = atoi(Config("BENCHMARK-THREADS"));
+  if (Config("BENCHMARK-REPEAT"))
+    repeat = atoi(Config("BENCHMARK-REPEAT"));
+  
+  printf("%d processors, pool of %d threads\n", (int)sysconf(_SC_NPROCESSORS_ONLN), threads);
+  
+  for (int blocking = 0; blocking <= 1; blocking++) {
+    const char *name = blocking ? "sleeping" : "yielding";
+    tsem_set_blocking(blocking);
+    
+    PingPong P;
+    tsem_init(&P.ping, 0, 0);
+    tsem_init(&P.pong, 0, 0);
+    P.rounds = repeat;
+    timer T = timer_start();
+    double cpu = cpu_seconds();
+    pthread_t partner;
+    pthread_create(&partner, NULL, pingpong_partner, &P);
+    for (int i = 0; i < repeat; i++) {
+      tsem_post(&P.ping);
+      tsem_wait(&P.pong);
+    }
+    pthread_join(partner, NULL);
+    double ms = timer_tick(&T);
+    printf("%s: %-22s %9.0f/s, %5.2f CPU seconds\n", name, "semaphore round trips", repeat * 1000.0 / ms, cpu_seconds() - cpu);
+    tsem_destroy(&P.ping);
+    tsem_destroy(&P.pong);
+    
+    unsigned int seeds[threads];
+    void *threaddata[threads];
+    for (int i = 0; i < threads; i++) {
+      seeds[i] = i;
+      threaddata[i] = &seeds[i];
+    }
+    TBPHandle *pool = TBPInit(threads, threaddata);
+    cpu = cpu_seconds();
+    timer_tick(&T);
+    for (int i = 0; i < repeat; i++) {
+      TBPDivideWork(pool, NULL, pool_job);
+    }
+    ms = timer_tick(&T);
+    printf("%s: %-22s %9.0f/s, %5.2f CPU seconds\n", name, "pool jobs", repeat * 1000.0 / ms, cpu_seconds() - cpu);
+    
+    cpu = cpu_seconds();
+    sleep(1);
+    printf("%s: %-22s %11s %5.2f CPU seconds\n", name, "idle pool for 1s", "", cpu_seconds() - cpu);
+    TBPClose(pool);
+  }
+}
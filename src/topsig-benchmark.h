@@ -0,0 +1,7 @@
+#ifndef TOPSIG_BENCHMARK_H
+#define TOPSIG_BENCHMARK_H
+
+void RunDistanceBenchmark();
+void RunThreadingBenchmark();
+
+#endif /* TOPSIG_BENCHMARK_H */
@@ -14,6 +14,7 @@
 #include "topsig-stats.h"
 #include "topsig-signature.h"
 #include "topsig-progress.h"
+#include "topsig-hamming.h"
 
 void ConfigUpdate()
 {
@@ -23,6 +24,7 @@ void ConfigUpdate()
   Signature_InitCfg();
   Progress_InitCfg();
   Index_InitCfg();
+  Hamming_InitCfg();
 }
 
 typedef struct {
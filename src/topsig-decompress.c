@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if !(defined(WINDOWS) || defined(_WIN32) || defined(_WIN64))
+#include <sys/mman.h>
+#define DECOMPRESS_HAVE_MMAP
+#endif
+#include "topsig-decompress.h"
+#include "topsig-queue.h"
+
+#ifndef NO_GZ
+#include <zlib.h>
+#endif
+#ifndef NO_BZ2
+#include <bzlib.h>
+#endif
+
+// Decoded data is handed to the reader in chunks of this size, and each
+// piece of the file may be decoded this many chunks ahead of the reader
+#define DECOMPRESS_CHUNK (128 * 1024)
+#define DECOMPRESS_CHUNKS_AHEAD 8
+
+// gzip members are grouped into pieces of at least this much compressed
+// data, as WARC files have a member for every record
+#define DECOMPRESS_GZIP_PIECE (1024 * 1024)
+
+// Every bzip2 block starts with the first and the end of each stream with
+// the second of these 48-bit markers, at any bit position
+#define BZIP2_BLOCK_MAGIC 0x314159265359ULL
+#define BZIP2_END_MAGIC 0x177245385090ULL
+
+typedef struct DecodedChunk {
+  int length;
+  struct DecodedChunk *next;
+  char data[DECOMPRESS_CHUNK];
+} DecodedChunk;
+
+// A piece of the compressed file, in bytes for gzip and bits for bzip2.
+// failed is set before the chunk queue is closed.
+typedef struct {
+  size_t begin;
+  size_t end;
+  int last;
+  BlockingQueue *chunks;
+  int failed;
+  size_t delivered;
+} Piece;
+
+struct Decompressor {
+  int format;
+  char *path;
+  const unsigned char *data;
+  size_t size;
+  int threads;
+  volatile int closing;
+
+  pthread_t splitter;
+  pthread_t *workers;
+  BlockingQueue *pieces; // every piece in file order, for the reader
+  BlockingQueue *undecoded; // the same pieces, for the workers
+
+  // Reader state
+  Piece *piece;
+  DecodedChunk *chunk;
+  int chunk_pos;
+  DecodedChunk *recovered;
+};
+
+// Where decoded data goes: the piece's queue when a worker decodes it, or
+// a list when the reader decodes pieces again. The first skip bytes are
+// dropped.
+typedef struct {
+  BlockingQueue *queue;
+  DecodedChunk *head;
+  DecodedChunk *tail;
+  size_t skip;
+} Sink;
+
+static void sink_write(Sink *S, const char *data, int length)
+{
+  if (S->skip >= (size_t)length) {
+    S->skip -= length;
+    return;
+  }
+  data += S->skip;
+  length -= S->skip;
+  S->skip = 0;
+
+  DecodedChunk *c = malloc(sizeof(DecodedChunk));
+  if (!c) {
+    fprintf(stderr, "Unable to allocate decompression buffer\n");
+    exit(1);
+  }
+  c->length = length;
+  c->next = NULL;
+  memcpy(c->data, data, length);
+  if (S->queue) {
+    BQPush(S->queue, c);
+  } else {
+    if (S->tail) S->tail->next = c;
+    else S->head = c;
+    S->tail = c;
+  }
+}
+
+static void free_chunks(DecodedChunk *c)
+{
+  while (c) {
+    DecodedChunk *next = c->next;
+    free(c);
+    c = next;
+  }
+}
+
+#ifndef NO_GZ
+// Succeeds if the bytes are whole gzip members. Data after the last
+// member of the file that is not another member is ignored, as gzread does.
+static int decode_gzip(const unsigned char *in, size_t length, int last, Sink *S, char *out)
+{
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK) return 0;
+
+  size_t pos = 0;
+  int ok = 0;
+  for (;;) {
+    size_t avail = length - pos;
+    if (avail > (1 << 30)) avail = 1 << 30;
+    z.next_in = (Bytef *)in + pos;
+    z.avail_in = avail;
+    z.next_out = (Bytef *)out;
+    z.avail_out = DECOMPRESS_CHUNK;
+    int r = inflate(&z, Z_NO_FLUSH);
+    pos = z.next_in - in;
+    int n = DECOMPRESS_CHUNK - z.avail_out;
+    if (n > 0) sink_write(S, out, n);
+
+    if (r == Z_STREAM_END) {
+      if (pos == length) {
+        ok = 1;
+        break;
+      }
+      if (length - pos < 2 || in[pos] != 0x1f || in[pos + 1] != 0x8b) {
+        ok = last;
+        break;
+      }
+      inflateReset(&z);
+    } else if (r != Z_OK) {
+      break;
+    }
+  }
+  inflateEnd(&z);
+  return ok;
+}
+#endif
+
+#ifndef NO_BZ2
+static unsigned int get_bits(const unsigned char *data, size_t bit, int n)
+{
+  unsigned int v = 0;
+  for (int i = 0; i < n; i++, bit++) {
+    v = (v << 1) | ((data[bit >> 3] >> (7 - (bit & 7))) & 1);
+  }
+  return v;
+}
+
+static void put_bits(unsigned char *out, size_t *bit, unsigned long long v, int n)
+{
+  for (int i = n - 1; i >= 0; i--, (*bit)++) {
+    if ((v >> i) & 1) out[*bit >> 3] |= 0x80 >> (*bit & 7);
+  }
+}
+
+// The blocks are decoded as a stream of their own: a stream header, the
+// blocks shifted to a byte boundary, and an end marker carrying the first
+// block's checksum as the stream checksum. Each block's own checksum is
+// still checked. The stream checksum only matches when there is a single
+// block, so a mismatch there, found once all the input has been used, is
+// not an error.
+static int decode_bzip2(const unsigned char *data, size_t begin, size_t end, Sink *S, char *out)
+{
+  size_t bits = end - begin;
+  if (bits < 80) return 0;
+  size_t whole = bits / 8;
+  unsigned char *stream = calloc(4 + whole + 12, 1);
+  if (!stream) {
+    fprintf(stderr, "Unable to allocate decompression buffer\n");
+    exit(1);
+  }
+  memcpy(stream, "BZh9", 4);
+  const unsigned char *src = data + (begin >> 3);
+  int shift = begin & 7;
+  if (shift == 0) {
+    memcpy(stream + 4, src, whole);
+  } else {
+    for (size_t i = 0; i < whole; i++) {
+      stream[4 + i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+    }
+  }
+  size_t bit = (4 + whole) * 8;
+  put_bits(stream, &bit, get_bits(data, begin + whole * 8, bits % 8), bits % 8);
+  put_bits(stream, &bit, BZIP2_END_MAGIC, 48);
+  put_bits(stream, &bit, get_bits(data, begin + 48, 32), 32);
+
+  bz_stream z;
+  memset(&z, 0, sizeof(z));
+  int ok = 0;
+  if (BZ2_bzDecompressInit(&z, 0, 0) == BZ_OK) {
+    z.next_in = (char *)stream;
+    z.avail_in = (bit + 7) / 8;
+    for (;;) {
+      z.next_out = out;
+      z.avail_out = DECOMPRESS_CHUNK;
+      int r = BZ2_bzDecompress(&z);
+      int n = DECOMPRESS_CHUNK - z.avail_out;
+      if (n > 0) sink_write(S, out, n);
+      if (r == BZ_STREAM_END || (r == BZ_DATA_ERROR && z.avail_in == 0)) {
+        ok = 1;
+        break;
+      }
+      if (r != BZ_OK || (z.avail_in == 0 && n == 0)) break;
+    }
+    BZ2_bzDecompressEnd(&z);
+  }
+  free(stream);
+  return ok;
+}
+#endif
+
+static int decode_piece(const Decompressor *D, size_t begin, size_t end, int last, Sink *S)
+{
+  char *out = malloc(DECOMPRESS_CHUNK);
+  int ok = 0;
+#ifndef NO_GZ
+  if (D->format == DECOMPRESS_GZIP) ok = decode_gzip(D->data + begin, end - begin, last, S, out);
+#endif
+#ifndef NO_BZ2
+  if (D->format == DECOMPRESS_BZIP2) ok = decode_bzip2(D->data, begin, end, S, out);
+#endif
+  (void)last;
+  free(out);
+  return ok;
+}
+
+static void push_piece(Decompressor *D, size_t begin, size_t end, int last)
+{
+  Piece *P = malloc(sizeof(Piece));
+  P->begin = begin;
+  P->end = end;
+  P->last = last;
+  P->chunks = BQCreate(DECOMPRESS_CHUNKS_AHEAD, 1);
+  P->failed = 0;
+  P->delivered = 0;
+  BQPush(D->pieces, P);
+  BQPush(D->undecoded, P);
+}
+
+// Pieces start at member headers. A header can also appear by chance in
+// compressed data, in which case the reader merges the pieces either side.
+static int gzip_header_at(const unsigned char *p, size_t avail)
+{
+  return avail >= 10 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && (p[3] & 0xE0) == 0 && (p[8] == 0 || p[8] == 2 || p[8] == 4) && (p[9] <= 13 || p[9] == 255);
+}
+
+static void split_gzip(Decompressor *D)
+{
+  size_t begin = 0;
+  size_t i = DECOMPRESS_GZIP_PIECE;
+  while (i < D->size && !D->closing) {
+    const unsigned char *p = memchr(D->data + i, 0x1f, D->size - i);
+    if (!p) break;
+    i = p - D->data;
+    if (gzip_header_at(p, D->size - i)) {
+      push_piece(D, begin, i, 0);
+      begin = i;
+      i += DECOMPRESS_GZIP_PIECE;
+    } else {
+      i++;
+    }
+  }
+  if (D->size > 0) push_piece(D, begin, D->size, 1);
+}
+
+// Each block is a piece, running to the next block or end marker
+static void split_bzip2(Decompressor *D)
+{
+  unsigned long long window = 0;
+  int in_block = 0;
+  size_t block_begin = 0;
+  for (size_t i = 0; i < D->size && !D->closing; i++) {
+    window = (window << 8) | D->data[i];
+    if (i < 5) continue;
+    for (int shift = 7; shift >= 0; shift--) {
+      unsigned long long w = (window >> shift) & 0xFFFFFFFFFFFFULL;
+      if (w == BZIP2_BLOCK_MAGIC || w == BZIP2_END_MAGIC) {
+        size_t magic_begin = (i + 1) * 8 - shift - 48;
+        if (in_block) push_piece(D, block_begin, magic_begin, 0);
+        in_block = w == BZIP2_BLOCK_MAGIC;
+        block_begin = magic_begin;
+      }
+    }
+  }
+  if (in_block) push_piece(D, block_begin, D->size * 8, 1);
+}
+
+static void *Splitter(void *input)
+{
+  Decompressor *D = input;
+  if (D->format == DECOMPRESS_GZIP) split_gzip(D);
+  else split_bzip2(D);
+  BQClose(D->pieces);
+  BQClose(D->undecoded);
+  return NULL;
+}
+
+static void *Decode_Worker(void *input)
+{
+  Decompressor *D = input;
+  Piece *P;
+  while ((P = BQPop(D->undecoded)) != NULL) {
+    if (!D->closing) {
+      Sink S = {P->chunks, NULL, NULL, 0};
+      P->failed = !decode_piece(D, P->begin, P->end, P->last, &S);
+    }
+    BQClose(P->chunks);
+  }
+  return NULL;
+}
+
+static void discard_piece(Piece *P)
+{
+  DecodedChunk *c;
+  while ((c = BQPop(P->chunks)) != NULL) free(c);
+  BQDestroy(P->chunks);
+  free(P);
+}
+
+// A piece fails to decode if it did not really end where the splitter
+// thought, or if the file is damaged. It is decoded again joined to the
+// pieces after it until that succeeds, dropping what was already read.
+static void recover(Decompressor *D)
+{
+  Piece *P = D->piece;
+  size_t end = P->end;
+  int last = P->last;
+  for (;;) {
+    Piece *next = BQPop(D->pieces);
+    if (next) {
+      end = next->end;
+      last = next->last;
+      discard_piece(next);
+    }
+    Sink S = {NULL, NULL, NULL, P->delivered};
+    int ok = decode_piece(D, P->begin, end, last, &S);
+    if (ok || !next) {
+      if (!ok) fprintf(stderr, "Warning: %s is damaged or truncated\n", D->path);
+      D->recovered = S.head;
+      return;
+    }
+    free_chunks(S.head);
+  }
+}
+
+static DecodedChunk *next_chunk(Decompressor *D)
+{
+  for (;;) {
+    if (D->recovered) {
+      DecodedChunk *c = D->recovered;
+      D->recovered = c->next;
+      return c;
+    }
+    if (D->piece) {
+      DecodedChunk *c = BQPop(D->piece->chunks);
+      if (c) {
+        D->piece->delivered += c->length;
+        return c;
+      }
+      if (D->piece->failed) recover(D);
+      discard_piece(D->piece);
+      D->piece = NULL;
+      continue;
+    }
+    D->piece = BQPop(D->pieces);
+    if (!D->piece) return NULL;
+  }
+}
+
+Decompressor *DecompressOpen(const char *path, int format, int threads)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return NULL;
+  fseeko(fp, 0, SEEK_END);
+  size_t size = ftello(fp);
+  const unsigned char *data = NULL;
+  if (size > 0) {
+#ifdef DECOMPRESS_HAVE_MMAP
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+      fclose(fp);
+      return NULL;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    data = map;
+#else
+    unsigned char *buffer = malloc(size);
+    fseeko(fp, 0, SEEK_SET);
+    if (!buffer || fread(buffer, 1, size, fp) != size) {
+      free(buffer);
+      fclose(fp);
+      return NULL;
+    }
+    data = buffer;
+#endif
+  }
+  fclose(fp);
+
+  Decompressor *D = malloc(sizeof(Decompressor));
+  D->format = format;
+  D->path = malloc(strlen(path) + 1);
+  strcpy(D->path, path);
+  D->data = data;
+  D->size = size;
+  D->threads = threads;
+  D->closing = 0;
+  D->pieces = BQCreate(threads * 4, 1);
+  D->undecoded = BQCreate(threads * 4, 1);
+  D->piece = NULL;
+  D->chunk = NULL;
+  D->chunk_pos = 0;
+  D->recovered = NULL;
+
+  D->workers = malloc(sizeof(pthread_t) * threads);
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&D->workers[i], NULL, Decode_Worker, D);
+  }
+  pthread_create(&D->splitter, NULL, Splitter, D);
+  return D;
+}
+
+int DecompressRead(Decompressor *D, void *buffer, int length)
+{
+  char *out = buffer;
+  int done = 0;
+  while (done < length) {
+    if (!D->chunk) {
+      D->chunk = next_chunk(D);
+      D->chunk_pos = 0;
+      if (!D->chunk) break;
+    }
+    int n = D->chunk->length - D->chunk_pos;
+    if (n > length - done) n = length - done;
+    memcpy(out + done, D->chunk->data + D->chunk_pos, n);
+    D->chunk_pos += n;
+    done += n;
+    if (D->chunk_pos == D->chunk->length) {
+      free(D->chunk);
+      D->chunk = NULL;
+    }
+  }
+  return done;
+}
+
+// The file may be closed before all of it has been read, so the pieces
+// still queued are drained to let the splitter and workers finish
+void DecompressClose(Decompressor *D)
+{
+  D->closing = 1;
+  free(D->chunk);
+  free_chunks(D->recovered);
+  if (D->piece) discard_piece(D->piece);
+  Piece *P;
+  while ((P = BQPop(D->pieces)) != NULL) discard_piece(P);
+
+  pthread_join(D->splitter, NULL);
+  for (int i = 0; i < D->threads; i++) {
+    pthread_join(D->workers[i], NULL);
+  }
+  BQDestroy(D->pieces);
+  BQDestroy(D->undecoded);
+  if (D->data) {
+#ifdef DECOMPRESS_HAVE_MMAP
+    munmap((void *)D->data, D->size);
+#else
+    free((void *)D->data);
+#endif
+  }
+  free(D->workers);
+  free(D->path);
+  free(D);
+}
@@ -0,0 +1,33 @@
+#ifndef TOPSIG_DECOMPRESS_H
+#define TOPSIG_DECOMPRESS_H
+
+// Decompresses a gzip or bzip2 file on several threads, returning the data
+// in order. This module does not depend on the configuration system.
+//
+// A splitter thread finds the places in the compressed file where decoding
+// can start: the start of each bzip2 block, or of each gzip member. Pieces
+// of the file starting at these places are decoded by worker threads at
+// the same time, and the reader receives their output in file order.
+//
+// A gzip file with a single member (as written by gzip itself) can only be
+// decoded from the start, so its decoding just runs ahead of the reader on
+// one worker. Files written as many members (such as WARC files, or the
+// output of pigz -i or bgzip) and all bzip2 files are decoded in parallel.
+// Unlike the single-threaded bzip2 reader, every stream of a bzip2 file
+// with several streams (as written by pbzip2) is read.
+
+#define DECOMPRESS_GZIP 1
+#define DECOMPRESS_BZIP2 2
+
+struct Decompressor;
+typedef struct Decompressor Decompressor;
+
+// Returns NULL if the file cannot be opened
+Decompressor *DecompressOpen(const char *path, int format, int threads);
+
+// Reads up to length bytes, returning 0 at the end of the data
+int DecompressRead(Decompressor *D, void *buffer, int length);
+
+void DecompressClose(Decompressor *D);
+
+#endif
@@ -2,46 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 #include "topsig-global.h"
 #include "topsig-issl.h"
 #include "topsig-timer.h"
 #include "topsig-config.h"
 #include "topsig-search.h"
 #include "topsig-thread.h"
+#include "topsig-sigfile.h"
 
-typedef struct {
-  int header_size;
-  int max_name_len;
-  int sig_width;
-  int sig_offset;
-  int sig_record_size;
-  int num_signatures;
-} SignatureHeader;
+// Number of signatures whose distances are computed at once
+#define DOCSIM_DISTANCE_BATCH 256
 
-static SignatureHeader readSigHeader(FILE *fp)
-{
-  SignatureHeader cfg;
-  char sig_method[64];
-  cfg.header_size = file_read32(fp); // header_size
-  int version = file_read32(fp); // version
-  cfg.max_name_len = file_read32(fp); // max_name_len
-  cfg.sig_width = file_read32(fp); // sig_width
-  file_read32(fp); // sig_density
-  if (version >= 2) {
-    file_read32(fp); // sig_seed
-  }
-  fread(sig_method, 1, 64, fp); // sig_method
-    
-  cfg.sig_offset = cfg.max_name_len + 1;
-  cfg.sig_offset += 8 * 4; // 8 32-bit ints
-  cfg.sig_record_size = cfg.sig_offset + cfg.sig_width / 8;
-  
-  cfg.num_signatures = -1; // unknown thus far
-  
-  return cfg;
-}
+// Number of queries compared with each batch of signatures
+#define DOCSIM_QUERY_TILE 64
 
-static SignatureHeader Read_Signature_File(const char *path, unsigned char **buf)
+static SigFileHeader Read_Signature_File(const char *path, SigBlock *block, unsigned char **buf)
 {
   FILE *fp = fopen(path, "rb");
   if (!fp) {
@@ -49,28 +25,9 @@ static SignatureHeader Read_Signature_File(const char *path, unsigned char **buf
     exit(1);
   }
   
-  SignatureHeader cfg = readSigHeader(fp);
-
-  unsigned char *dummy_buffer = malloc((size_t)cfg.sig_record_size);
-  int sigs = 0;
-  for (;;) {
-    if (fread(dummy_buffer, cfg.sig_record_size, 1, fp) < 1) break;
-    sigs++;
-  }
-  free(dummy_buffer);
-  fseek(fp, cfg.header_size, SEEK_SET);
-  
-  cfg.num_signatures = sigs;
-  unsigned char *buffer = malloc((size_t)cfg.sig_record_size * sigs);
-  if (!buffer) {
-    double mb = (double)((size_t)cfg.sig_record_size * sigs) / 1048576.0;
-    fprintf(stderr, "Error: unable to allocate memory to store signature file (%.2f MB)\n", mb);
-    exit(1);
-  }
-  
-  fread(buffer, cfg.sig_record_size, sigs, fp);
+  SigFileHeader cfg = SigFileReadHeader(fp);
+  *buf = SigFileLoad(&cfg, fp, block);
   fclose(fp);
-  *buf = buffer;
   return cfg;
 }
 
@@ -108,136 +65,197 @@ static void Destroy_Result_List(ResultList *R)
 }
 
 
+static void Output_Results(int topic_id, const ResultList *list)
+{
+  for (int i = 0; i < list->results; i++) {
+    //printf("%d. %d (%d) - %s\n", i, list->docids[i], list->distances[i], list->docnames[i]);
+    //printf("%d Q0 %s %d %d Topsig-Exhaustive\n", topic_id, list->docnames[i], i + 1, 1000000 - i);
+    printf("%d Q0 %s %d %d Topsig-Exhaustive %d\n", topic_id, list->docnames[i], i + 1, 1000000 - i, list->distances[i]);
+  }
+}
+
+// The k nearest documents found so far for one query, kept as a max-heap
+// on distance and then docid. Of equally distant documents the lowest
+// docids are kept, whatever order they are found in.
 typedef struct {
-  ResultList *list;
-  int i;
-} ClarifyEntry;
+  int n;
+  int *dists;
+  int *docids;
+} NearestList;
 
-static int clarify_compar(const void *A, const void *B)
+static inline int nearer(int dist_a, int docid_a, int dist_b, int docid_b)
 {
-  const ClarifyEntry *a = A;
-  const ClarifyEntry *b = B;
-  
-  const ResultList *list = a->list;
-  
-  return list->distances[a->i] - list->distances[b->i];
+  return dist_a < dist_b || (dist_a == dist_b && docid_a < docid_b);
 }
 
-static void Clarify_Results(const SignatureHeader *cfg, ResultList *list, const unsigned char *sig_file)
+// Places an entry at the root of the first n of a list and moves it down
+// to where it belongs
+static inline void sift_down(NearestList *L, int n, int dist, int docid)
 {
-  static unsigned char *mask = NULL;
-  if (!mask) {
-    mask = malloc(cfg->sig_width / 8);
-    memset(mask, 0xFF, cfg->sig_width / 8);
-  }
-  
-  //list->docnames = malloc(sizeof(char *) * list->results);
-  
-  ClarifyEntry *clarify = malloc(sizeof(ClarifyEntry) * list->results);
-  
-  for (int i = 0; i < list->results; i++) {
-//    list->distances[i] = DocumentDistance(cfg->sig_width, sig, mask, cursig);
-    list->distances[i] = cfg->sig_width - list->issl_scores[i];
-    list->docnames[i] = (const char *)(sig_file + ((size_t)cfg->sig_record_size * list->docids[i]));
-    
-    clarify[i].list = list;
-    clarify[i].i = i;
-  }
-  qsort(clarify, list->results, sizeof(ClarifyEntry), clarify_compar);
-  
-  ResultList newlist = Create_Result_List(list->results);  
-  //newlist.docnames = malloc(sizeof(char *) * list->results);
-  for (int i = 0; i < list->results; i++) {
-    int j = clarify[i].i;
-    newlist.issl_scores[i] = list->issl_scores[j];
-    newlist.distances[i] = list->distances[j];
-    newlist.docids[i] = list->docids[j];
-    newlist.docnames[i] = list->docnames[j];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= n) break;
+    if (child + 1 < n && nearer(L->dists[child], L->docids[child], L->dists[child + 1], L->docids[child + 1])) child++;
+    if (!nearer(dist, docid, L->dists[child], L->docids[child])) break;
+    L->dists[i] = L->dists[child];
+    L->docids[i] = L->docids[child];
+    i = child;
   }
-  
-  Destroy_Result_List(list);
-  *list = newlist;
-  
-  free(clarify);
+  L->dists[i] = dist;
+  L->docids[i] = docid;
 }
 
+static inline void Nearest_Add(NearestList *L, int k, int dist, int docid)
+{
+  if (L->n < k) {
+    int i = L->n++;
+    while (i > 0) {
+      int parent = (i - 1) / 2;
+      if (!nearer(L->dists[parent], L->docids[parent], dist, docid)) break;
+      L->dists[i] = L->dists[parent];
+      L->docids[i] = L->docids[parent];
+      i = parent;
+    }
+    L->dists[i] = dist;
+    L->docids[i] = docid;
+  } else if (k > 0 && nearer(dist, docid, L->dists[0], L->docids[0])) {
+    // Replaces the furthest
+    sift_down(L, k, dist, docid);
+  }
+}
 
-static void Output_Results(int topic_id, const ResultList *list)
+// Empties a list into R, nearest first
+static void Nearest_Results(NearestList *L, ResultList *R, const SigBlock *sigs)
 {
-  for (int i = 0; i < list->results; i++) {
-    //printf("%d. %d (%d) - %s\n", i, list->docids[i], list->distances[i], list->docnames[i]);
-    //printf("%d Q0 %s %d %d Topsig-Exhaustive\n", topic_id, list->docnames[i], i + 1, 1000000 - i);
-    printf("%d Q0 %s %d %d Topsig-Exhaustive %d\n", topic_id, list->docnames[i], i + 1, 1000000 - i, list->distances[i]);
+  R->results = L->n;
+  for (int end = L->n - 1; end >= 0; end--) {
+    R->distances[end] = L->dists[0];
+    R->docids[end] = L->docids[0];
+    sift_down(L, end, L->dists[end], L->docids[end]);
+  }
+  L->n = 0;
+  for (int i = 0; i < R->results; i++) {
+    R->issl_scores[i] = 0;
+    R->docnames[i] = SigBlockDocid(sigs, R->docids[i]);
   }
 }
 
+// Queries are compared with documents one tile of each at a time. A tile
+// of DOCSIM_QUERY_TILE queries and one of DOCSIM_DISTANCE_BATCH documents
+// (40 KB of 1024-bit signatures) and the distances between them stay in
+// L2 while every pair is scored.
+//
+// When the search is symmetric, the distance between two queries is
+// computed only once, by the earlier of their tiles, and given to both.
+// Every tile's lists are then locked while they are added to, since other
+// tiles' threads add to them too.
+
 typedef struct {
-  const SignatureHeader *sig_cfg;
-  const unsigned char *sig_file;
-  int doc_begin;
-  int doc_end;
-  ResultList *output;
-} Worker_Throughput;
+  const SigFileHeader *sig_cfg;
+  const SigBlock *sigs;
+  int query_first;
+  int query_last;
+  int k;
+  int symmetric;
+  NearestList *lists; // [query - query_first]
+  pthread_mutex_t *tile_locks; // [(query - query_first) / DOCSIM_QUERY_TILE], symmetric only
+} AllPairs;
 
-static void *Throughput_Job(void *input)
+// A tile of queries being compared by a thread, and the thread's space for
+// their distances
+typedef struct {
+  const AllPairs *A;
+  int query_begin;
+  int query_end;
+  int *dists;
+} AllPairsJob;
+
+static void Lock_Tile(const AllPairs *A, int query)
 {
-  int topk = atoi(Config("SEARCH-DOC-TOPK"));
-  Worker_Throughput *T = input;
-  const SignatureHeader *sig_cfg = T->sig_cfg;
-  
-  unsigned char *mask = NULL;
-  mask = malloc(sig_cfg->sig_width / 8);
-  memset(mask, 0xFF, sig_cfg->sig_width / 8);
-  
-  int doc_count = T->doc_end - T->doc_begin;
-  
-  const unsigned char *sig_file = T->sig_file;
-  T->output = malloc(sizeof(ResultList) * doc_count);
-  
-  int doc_i = 0;
-  for (int doc_cmp = T->doc_begin; doc_cmp < T->doc_end; doc_cmp++) {
-    const unsigned char *sig = sig_file + (size_t)sig_cfg->sig_record_size * doc_cmp + sig_cfg->sig_offset;
+  if (A->tile_locks) pthread_mutex_lock(&A->tile_locks[(query - A->query_first) / DOCSIM_QUERY_TILE]);
+}
+
+static void Unlock_Tile(const AllPairs *A, int query)
+{
+  if (A->tile_locks) pthread_mutex_unlock(&A->tile_locks[(query - A->query_first) / DOCSIM_QUERY_TILE]);
+}
+
+// Compares the queries of a job with documents doc_begin up to doc_end.
+// If mirror is set, the documents are later queries: only pairs with the
+// document after the query are compared, and each is also added to the
+// document's list.
+static void Compare_Range(const AllPairsJob *J, int doc_begin, int doc_end, int mirror)
+{
+  int *dists = J->dists;
+  const AllPairs *A = J->A;
+  const SigBlock *sigs = A->sigs;
+  int sig_width = A->sig_cfg->sig_width;
+  for (int tile = doc_begin; tile < doc_end; tile += DOCSIM_DISTANCE_BATCH) {
+    int n = doc_end - tile;
+    if (n > DOCSIM_DISTANCE_BATCH) n = DOCSIM_DISTANCE_BATCH;
+    const unsigned char *doc_sigs = SigBlockSignature(sigs, tile);
+    for (int q = J->query_begin; q < J->query_end; q++) {
+      DocumentDistanceBatch(sig_width, SigBlockSignature(sigs, q), NULL, doc_sigs, sigs->sig_stride, n, dists + (size_t)(q - J->query_begin) * DOCSIM_DISTANCE_BATCH);
+    }
     
+    Lock_Tile(A, J->query_begin);
+    for (int q = J->query_begin; q < J->query_end; q++) {
+      NearestList *L = &A->lists[q - A->query_first];
+      const int *row = dists + (size_t)(q - J->query_begin) * DOCSIM_DISTANCE_BATCH;
+      int first = mirror && q > tile ? q - tile : 0;
+      for (int j = first; j < n; j++) {
+        Nearest_Add(L, A->k, row[j], tile + j);
+      }
+    }
+    Unlock_Tile(A, J->query_begin);
     
-    T->output[doc_i] = Create_Result_List(topk);
-    ResultList *R = T->output+doc_i;
-    int R_lowest_score = 0;
-    int R_lowest_score_i = 0;
-  
-    for (int cmp_to = 0; cmp_to < sig_cfg->num_signatures; cmp_to++) {
-      //Traverse_ISSL(issl_counts[slice], issl_table[slice], &scores, variants, n_variants_ceasenew, n_variants_stopearly, val, width);
-      int docid = cmp_to;
-      const unsigned char *cursig = sig_file + (size_t)sig_cfg->sig_record_size * cmp_to + sig_cfg->sig_offset;
-      int score = sig_cfg->sig_width - DocumentDistance(sig_cfg->sig_width, sig, mask, cursig);
-      
-      if (score > R_lowest_score) {
-        R->docids[R_lowest_score_i] = docid;
-        R->issl_scores[R_lowest_score_i] = score;
-        
-        R_lowest_score = INT_MAX;
-        for (int j = 0; j < R->results; j++) {
-          if (R->issl_scores[j] < R_lowest_score) {
-            R_lowest_score = R->issl_scores[j];
-            R_lowest_score_i = j;
-          }
+    if (!mirror) continue;
+    // The documents' lists, a tile of them at a time
+    int doc = tile;
+    while (doc < tile + n) {
+      int tile_end = A->query_first + ((doc - A->query_first) / DOCSIM_QUERY_TILE + 1) * DOCSIM_QUERY_TILE;
+      if (tile_end > tile + n) tile_end = tile + n;
+      Lock_Tile(A, doc);
+      for (; doc < tile_end; doc++) {
+        NearestList *L = &A->lists[doc - A->query_first];
+        for (int q = J->query_begin; q < J->query_end && q < doc; q++) {
+          Nearest_Add(L, A->k, dists[(size_t)(q - J->query_begin) * DOCSIM_DISTANCE_BATCH + doc - tile], q);
         }
       }
+      Unlock_Tile(A, doc - 1);
+    }
+  }
+}
+
+// Compares query tiles begin up to end. Tiles are spread over the threads
+// of a work-stealing pool, since in a symmetric search the earlier ones
+// have more to do.
+static void AllPairs_Job(int begin, int end, void *thread_data)
+{
+  AllPairsJob *J = thread_data;
+  const AllPairs *A = J->A;
+  int num_signatures = A->sig_cfg->num_signatures;
+  for (int tile = begin; tile < end; tile++) {
+    J->query_begin = A->query_first + tile * DOCSIM_QUERY_TILE;
+    J->query_end = J->query_begin + DOCSIM_QUERY_TILE;
+    if (J->query_end > A->query_last + 1) J->query_end = A->query_last + 1;
+    if (A->symmetric) {
+      // Earlier queries' tiles have compared them with this one's
+      Compare_Range(J, 0, A->query_first, 0);
+      Compare_Range(J, J->query_begin, A->query_last + 1, 1);
+      Compare_Range(J, A->query_last + 1, num_signatures, 0);
+    } else {
+      Compare_Range(J, 0, num_signatures, 0);
     }
-    
-    Clarify_Results(sig_cfg, R, sig_file);
-    
-    doc_i++;
   }
-  
-  free(mask);
-  
-  return NULL;
 }
 
 void RunExhaustiveDocsimSearch()
 {
   unsigned char *sig_file;
-  SignatureHeader sig_cfg = Read_Signature_File(Config("SIGNATURE-PATH"), &sig_file);
+  SigBlock sigs;
+  SigFileHeader sig_cfg = Read_Signature_File(Config("SIGNATURE-PATH"), &sigs, &sig_file);
   
   int thread_count = 1;
   int search_doc_first = 0;
@@ -249,34 +267,71 @@ void RunExhaustiveDocsimSearch()
     search_doc_first = atoi(Config("SEARCH-DOC-FIRST"));
   if (Config("SEARCH-DOC-LAST"))
     search_doc_last = atoi(Config("SEARCH-DOC-LAST"));
+  if (search_doc_last >= sig_cfg.num_signatures) search_doc_last = sig_cfg.num_signatures - 1;
   int total_docs = search_doc_last - search_doc_first + 1;
-  void **threads = malloc(sizeof(void *) * thread_count);
+  
+  AllPairs A;
+  A.sig_cfg = &sig_cfg;
+  A.sigs = &sigs;
+  A.query_first = search_doc_first;
+  A.query_last = search_doc_last;
+  A.k = atoi(Config("SEARCH-DOC-TOPK"));
+  A.symmetric = !Config("EXHAUSTIVE-SYMMETRIC") || lc_strcmp(Config("EXHAUSTIVE-SYMMETRIC"), "true") == 0;
+  A.lists = malloc(sizeof(NearestList) * total_docs);
+  int *list_dists = malloc(sizeof(int) * (size_t)total_docs * A.k);
+  int *list_docids = malloc(sizeof(int) * (size_t)total_docs * A.k);
+  if (!A.lists || !list_dists || !list_docids) {
+    fprintf(stderr, "Ran out of memory for the results of %d searches.\n", total_docs);
+    exit(1);
+  }
+  for (int i = 0; i < total_docs; i++) {
+    A.lists[i].n = 0;
+    A.lists[i].dists = list_dists + (size_t)i * A.k;
+    A.lists[i].docids = list_docids + (size_t)i * A.k;
+  }
+  
+  int tile_count = (total_docs + DOCSIM_QUERY_TILE - 1) / DOCSIM_QUERY_TILE;
+  A.tile_locks = NULL;
+  if (A.symmetric) {
+    A.tile_locks = malloc(sizeof(pthread_mutex_t) * tile_count);
+    for (int i = 0; i < tile_count; i++) {
+      pthread_mutex_init(&A.tile_locks[i], NULL);
+    }
+  }
+  AllPairsJob *jobs = malloc(sizeof(AllPairsJob) * thread_count);
+  void **thread_inputs = malloc(sizeof(void *) * thread_count);
   for (int i = 0; i < thread_count; i++) {
-    Worker_Throughput *thread_data = malloc(sizeof(Worker_Throughput));
-    thread_data->sig_cfg = &sig_cfg;
-    thread_data->sig_file = sig_file;
-    thread_data->doc_begin = total_docs * i / thread_count + search_doc_first;
-    thread_data->doc_end = total_docs * (i+1) / thread_count + search_doc_first;
-    threads[i] = thread_data;
+    jobs[i].A = &A;
+    jobs[i].dists = malloc(sizeof(int) * DOCSIM_QUERY_TILE * DOCSIM_DISTANCE_BATCH);
+    thread_inputs[i] = &jobs[i];
   }
   
   timer T = timer_start();
   
-  DivideWork(threads, Throughput_Job, thread_count);
+  DivideRangeWS(tile_count, 1, thread_inputs, AllPairs_Job, thread_count);
   
-  for (int i = 0; i < thread_count; i++) {
-    Worker_Throughput *thread_data = threads[i];
-    int doc_count = thread_data->doc_end - thread_data->doc_begin;
-    for (int j = 0; j < doc_count; j++) {
-      Output_Results(thread_data->doc_begin + j, &thread_data->output[j]);
-    }
+  ResultList R = Create_Result_List(A.k);
+  for (int i = 0; i < total_docs; i++) {
+    Nearest_Results(&A.lists[i], &R, &sigs);
+    Output_Results(search_doc_first + i, &R);
   }
+  Destroy_Result_List(&R);
   
   fprintf(stderr, "search time %.2fms\n", timer_tick(&T));
   
   for (int i = 0; i < thread_count; i++) {
-    free(threads[i]);
+    free(jobs[i].dists);
   }
-  free(threads);
+  if (A.tile_locks) {
+    for (int i = 0; i < tile_count; i++) {
+      pthread_mutex_destroy(&A.tile_locks[i]);
+    }
+    free(A.tile_locks);
+  }
+  free(thread_inputs);
+  free(jobs);
+  free(A.lists);
+  free(list_dists);
+  free(list_docids);
+  free(sig_file);
 }
-
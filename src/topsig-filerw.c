@@ -2,14 +2,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include "topsig-filerw.h"
+#include "topsig-decompress.h"
 #include "topsig-config.h"
 #include "topsig-global.h"
 
 // Abstracted file IO. Compressed formats can be disabled with NO_GZ
 // and NO_BZ2 to remove libgz and libbz2 dependencies respectively.
+// With TARGET-DECOMPRESS-THREADS above 1, compressed files are decompressed
+// on that many threads by topsig-decompress instead.
 
 typedef enum {
-  NONE, GZ, BZ2
+  NONE, GZ, BZ2, PARALLEL
 } file_compression;
 
 struct FileHandle_none {
@@ -121,11 +124,17 @@ int file_read_none(void *buffer, int length, struct FileHandle_none *fp)
   return fread(buffer, 1, length, fp->fp);
 }
 
+struct FileHandle_parallel {
+  file_compression mode;
+  Decompressor *D;
+};
+
 union FileHandle {
   file_compression mode;
   struct FileHandle_none none;
   struct FileHandle_gz gz;
   struct FileHandle_bz2 bz2;
+  struct FileHandle_parallel parallel;
 };
 
 FileHandle *file_open(const char *path) {
@@ -139,6 +148,23 @@ FileHandle *file_open(const char *path) {
   
   fp->mode = mode;
   
+  int threads = 1;
+  if (Config("TARGET-DECOMPRESS-THREADS")) {
+    threads = atoi(Config("TARGET-DECOMPRESS-THREADS"));
+  }
+  if (mode != NONE && threads > 1) {
+#ifdef NO_GZ
+    if (mode == GZ) file_open_gz((struct FileHandle_gz *)fp, path);
+#endif
+#ifdef NO_BZ2
+    if (mode == BZ2) file_open_bz2((struct FileHandle_bz2 *)fp, path);
+#endif
+    fp->parallel.D = DecompressOpen(path, mode == GZ ? DECOMPRESS_GZIP : DECOMPRESS_BZIP2, threads);
+    if (fp->parallel.D == NULL) fileopenerr(path);
+    fp->mode = PARALLEL;
+    return fp;
+  }
+  
   switch (mode) {
     case GZ:
       file_open_gz((struct FileHandle_gz *)fp, path);
@@ -158,6 +184,9 @@ FileHandle *file_open(const char *path) {
 int file_read(void *buffer, int length, FileHandle *fp)
 {
   switch (fp->mode) {
+    case PARALLEL:
+      return DecompressRead(fp->parallel.D, buffer, length);
+      break;
     case GZ:
       return file_read_gz(buffer, length, (struct FileHandle_gz *)fp);
       break;
@@ -174,6 +203,10 @@ int file_read(void *buffer, int length, FileHandle *fp)
 void file_close(FileHandle *fp)
 {
   switch (fp->mode) {
+    case PARALLEL:
+      DecompressClose(fp->parallel.D);
+      free(fp);
+      break;
     case GZ:
       file_close_gz((struct FileHandle_gz *)fp);
       break;
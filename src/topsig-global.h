@@ -65,6 +65,32 @@ inline static void mem_write32(int val, unsigned char *p)
   *(p+3) = (val >> 24) & 0xFF;
 }
 
+inline static void file_write64(long long val, FILE *fp)
+{
+  file_write32((int)(val & 0xFFFFFFFF), fp);
+  file_write32((int)((val >> 32) & 0xFFFFFFFF), fp);
+}
+
+inline static long long file_read64(FILE *fp)
+{
+  unsigned long long lo = (unsigned int)file_read32(fp);
+  unsigned long long hi = (unsigned int)file_read32(fp);
+  return (long long)(lo | (hi << 32));
+}
+
+inline static long long mem_read64(const unsigned char *p)
+{
+  unsigned long long lo = (unsigned int)mem_read32(p);
+  unsigned long long hi = (unsigned int)mem_read32(p + 4);
+  return (long long)(lo | (hi << 32));
+}
+
+inline static void mem_write64(long long val, unsigned char *p)
+{
+  mem_write32((int)(val & 0xFFFFFFFF), p);
+  mem_write32((int)((val >> 32) & 0xFFFFFFFF), p + 4);
+}
+
 inline static int mem_read16(const unsigned char *p)
 {
   unsigned int r = 0;
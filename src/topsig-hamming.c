@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "topsig-hamming.h"
+#include "topsig-config.h"
+#include "topsig-global.h"
+
+// Hamming distance kernels. The binary is built for the baseline
+// architecture; the SIMD kernels are compiled with per-function target
+// attributes and the fastest one the CPU supports is selected at startup
+// (or forced through HAMMING-KERNEL).
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAMMING_X86
+#include <immintrin.h>
+#endif
+
+typedef int (*distance_masked_fn)(int, const unsigned char *, const unsigned char *, const unsigned char *);
+typedef int (*distance_unmasked_fn)(int, const unsigned char *, const unsigned char *);
+typedef void (*distance_batch_fn)(int, const unsigned char *, const unsigned char *, const unsigned char *, size_t, int, int *);
+typedef long long (*distance_bounded_fn)(const unsigned char *, const unsigned char *, const unsigned char *, size_t, int, const int *, int, int, int *);
+
+// Batch kernels score four documents per pass over the query words, and
+// prefetch the documents this many records ahead of the current position.
+#define BATCH_PREFETCH 8
+
+static inline unsigned long long load64(const unsigned char *p)
+{
+  unsigned long long v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline int popcount64_swar(unsigned long long v)
+{
+  v = v - ((v >> 1) & 0x5555555555555555ULL);
+  v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+  return (((v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL) * 0x0101010101010101ULL) >> 56;
+}
+
+static inline void prefetch_records(const unsigned char *dsigs, size_t stride, int j, int n, int bytes)
+{
+  for (int k = j; k < j + 4 && k < n; k++) {
+    for (int b = 0; b < bytes; b += 64) {
+      __builtin_prefetch(dsigs + stride * k + b);
+    }
+  }
+}
+
+__attribute__((always_inline))
+static inline void batch_words(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out, const int masked, const int hw)
+{
+  const int words = sigwidth / 64;
+  int j = 0;
+  for (; j + 4 <= n; j += 4) {
+    const unsigned char *d = dsigs + stride * j;
+    prefetch_records(dsigs, stride, j + BATCH_PREFETCH, n, words * 8);
+    int c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    for (int i = 0; i < words * 8; i += 8) {
+      unsigned long long q = load64(bsig+i);
+      unsigned long long m = masked ? load64(bmask+i) : ~0ULL;
+      unsigned long long v0 = (load64(d+i) ^ q) & m;
+      unsigned long long v1 = (load64(d+stride+i) ^ q) & m;
+      unsigned long long v2 = (load64(d+stride*2+i) ^ q) & m;
+      unsigned long long v3 = (load64(d+stride*3+i) ^ q) & m;
+      if (hw) {
+        c0 += __builtin_popcountll(v0); c1 += __builtin_popcountll(v1);
+        c2 += __builtin_popcountll(v2); c3 += __builtin_popcountll(v3);
+      } else {
+        c0 += popcount64_swar(v0); c1 += popcount64_swar(v1);
+        c2 += popcount64_swar(v2); c3 += popcount64_swar(v3);
+      }
+    }
+    out[j] = c0; out[j+1] = c1; out[j+2] = c2; out[j+3] = c3;
+  }
+  for (; j < n; j++) {
+    const unsigned char *d = dsigs + stride * j;
+    int c = 0;
+    for (int i = 0; i < words * 8; i += 8) {
+      unsigned long long v = load64(d+i) ^ load64(bsig+i);
+      if (masked) v &= load64(bmask+i);
+      c += hw ? __builtin_popcountll(v) : popcount64_swar(v);
+    }
+    out[j] = c;
+  }
+}
+
+// The bounded distances compare the running total with the bound after
+// every group of this many words
+#define BOUNDED_CHECK_WORDS 4
+
+__attribute__((always_inline))
+static inline long long bounded_words(const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, const int *order, int n_order, int bound, int *out, const int hw)
+{
+  long long words_used = 0;
+  int j = 0;
+  // Four documents at a time, abandoned together once all of them are over
+  for (; j + 4 <= n; j += 4) {
+    const unsigned char *d = dsigs + stride * j;
+    prefetch_records(dsigs, stride, j + BATCH_PREFETCH, n, 64);
+    int c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    int w = 0;
+    while (w < n_order) {
+      int end = w + BOUNDED_CHECK_WORDS;
+      if (end > n_order) end = n_order;
+      for (; w < end; w++) {
+        int i = order[w] * 8;
+        unsigned long long q = load64(bsig+i);
+        unsigned long long m = load64(bmask+i);
+        unsigned long long v0 = (load64(d+i) ^ q) & m;
+        unsigned long long v1 = (load64(d+stride+i) ^ q) & m;
+        unsigned long long v2 = (load64(d+stride*2+i) ^ q) & m;
+        unsigned long long v3 = (load64(d+stride*3+i) ^ q) & m;
+        if (hw) {
+          c0 += __builtin_popcountll(v0); c1 += __builtin_popcountll(v1);
+          c2 += __builtin_popcountll(v2); c3 += __builtin_popcountll(v3);
+        } else {
+          c0 += popcount64_swar(v0); c1 += popcount64_swar(v1);
+          c2 += popcount64_swar(v2); c3 += popcount64_swar(v3);
+        }
+      }
+      if (c0 > bound && c1 > bound && c2 > bound && c3 > bound) break;
+    }
+    out[j] = c0; out[j+1] = c1; out[j+2] = c2; out[j+3] = c3;
+    words_used += w * 4;
+  }
+  for (; j < n; j++) {
+    const unsigned char *d = dsigs + stride * j;
+    int c = 0;
+    int w = 0;
+    while (w < n_order) {
+      int end = w + BOUNDED_CHECK_WORDS;
+      if (end > n_order) end = n_order;
+      for (; w < end; w++) {
+        int i = order[w] * 8;
+        unsigned long long v = (load64(d+i) ^ load64(bsig+i)) & load64(bmask+i);
+        c += hw ? __builtin_popcountll(v) : popcount64_swar(v);
+      }
+      if (c > bound) break;
+    }
+    out[j] = c;
+    words_used += w;
+  }
+  return words_used;
+}
+
+// Portable kernel, used when nothing better is available
+
+static int dist_scalar_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig)
+{
+  const int words = sigwidth / 64;
+  int c = 0;
+  for (int w = 0; w < words; w++) {
+    c += popcount64_swar((load64(dsig+w*8) ^ load64(bsig+w*8)) & load64(bmask+w*8));
+  }
+  return c;
+}
+
+static int dist_scalar_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig)
+{
+  const int words = sigwidth / 64;
+  int c = 0;
+  for (int w = 0; w < words; w++) {
+    c += popcount64_swar(load64(dsig+w*8) ^ load64(bsig+w*8));
+  }
+  return c;
+}
+
+static void batch_scalar_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_words(sigwidth, bsig, bmask, dsigs, stride, n, out, 1, 0);
+}
+
+static void batch_scalar_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_words(sigwidth, bsig, bmask, dsigs, stride, n, out, 0, 0);
+}
+
+static long long bounded_scalar(const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, const int *order, int n_order, int bound, int *out)
+{
+  return bounded_words(bsig, bmask, dsigs, stride, n, order, n_order, bound, out, 0);
+}
+
+#ifdef HAMMING_X86
+
+// Hardware popcnt, four independent accumulators to hide latency
+
+#define POPCNT_BODY(EXPR) \
+  const int words = sigwidth / 64; \
+  unsigned long long c0 = 0, c1 = 0, c2 = 0, c3 = 0; \
+  int w = 0; \
+  for (; w + 4 <= words; w += 4) { \
+    int i; \
+    i = (w+0)*8; c0 += __builtin_popcountll(EXPR); \
+    i = (w+1)*8; c1 += __builtin_popcountll(EXPR); \
+    i = (w+2)*8; c2 += __builtin_popcountll(EXPR); \
+    i = (w+3)*8; c3 += __builtin_popcountll(EXPR); \
+  } \
+  for (; w < words; w++) { \
+    int i = w*8; \
+    c0 += __builtin_popcountll(EXPR); \
+  } \
+  return c0 + c1 + c2 + c3;
+
+__attribute__((target("popcnt")))
+static int dist_popcnt_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig)
+{
+  POPCNT_BODY((load64(dsig+i) ^ load64(bsig+i)) & load64(bmask+i))
+}
+
+__attribute__((target("popcnt")))
+static int dist_popcnt_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig)
+{
+  POPCNT_BODY(load64(dsig+i) ^ load64(bsig+i))
+}
+
+__attribute__((target("popcnt")))
+static void batch_popcnt_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_words(sigwidth, bsig, bmask, dsigs, stride, n, out, 1, 1);
+}
+
+__attribute__((target("popcnt")))
+static void batch_popcnt_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_words(sigwidth, bsig, bmask, dsigs, stride, n, out, 0, 1);
+}
+
+// The bounded distances visit words in an arbitrary order and stop early,
+// so the wider kernels have nothing to add over hardware popcnt
+__attribute__((target("popcnt")))
+static long long bounded_popcnt(const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, const int *order, int n_order, int bound, int *out)
+{
+  return bounded_words(bsig, bmask, dsigs, stride, n, order, n_order, bound, out, 1);
+}
+
+// SSSE3: 4-bit lookup table through pshufb, byte counts summed with psadbw
+
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i popcount_epi8_ssse3(__m128i v)
+{
+  const __m128i lut = _mm_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m128i low = _mm_set1_epi8(0x0F);
+  __m128i lo = _mm_and_si128(v, low);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+  return _mm_add_epi8(_mm_shuffle_epi8(lut, lo), _mm_shuffle_epi8(lut, hi));
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline int dist_ssse3(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig, const int masked)
+{
+  const int bytes = sigwidth / 8 / 8 * 8;
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dsig+i)), _mm_loadu_si128((const __m128i *)(bsig+i)));
+    if (masked) v = _mm_and_si128(v, _mm_loadu_si128((const __m128i *)(bmask+i)));
+    // Each byte count is at most 8, so psadbw against zero cannot overflow
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(popcount_epi8_ssse3(v), _mm_setzero_si128()));
+  }
+  int c = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+  for (; i < bytes; i += 8) {
+    unsigned long long v = load64(dsig+i) ^ load64(bsig+i);
+    if (masked) v &= load64(bmask+i);
+    c += popcount64_swar(v);
+  }
+  return c;
+}
+
+__attribute__((target("ssse3")))
+static int dist_ssse3_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig)
+{
+  return dist_ssse3(sigwidth, bsig, bmask, dsig, 1);
+}
+
+__attribute__((target("ssse3")))
+static int dist_ssse3_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig)
+{
+  return dist_ssse3(sigwidth, bsig, NULL, dsig, 0);
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline void batch_ssse3(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out, const int masked)
+{
+  const int bytes = sigwidth / 8 / 8 * 8;
+  const int vbytes = bytes / 16 * 16;
+  int j = 0;
+  for (; j + 4 <= n; j += 4) {
+    const unsigned char *d = dsigs + stride * j;
+    prefetch_records(dsigs, stride, j + BATCH_PREFETCH, n, bytes);
+    __m128i a0 = _mm_setzero_si128(), a1 = _mm_setzero_si128(), a2 = _mm_setzero_si128(), a3 = _mm_setzero_si128();
+    for (int i = 0; i < vbytes; i += 16) {
+      __m128i q = _mm_loadu_si128((const __m128i *)(bsig+i));
+      __m128i m = masked ? _mm_loadu_si128((const __m128i *)(bmask+i)) : _mm_set1_epi8(-1);
+      #define ACC(a, o) a = _mm_add_epi64(a, _mm_sad_epu8(popcount_epi8_ssse3(_mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)(d+(o)+i)), q), m)), _mm_setzero_si128()))
+      ACC(a0, 0); ACC(a1, stride); ACC(a2, stride*2); ACC(a3, stride*3);
+      #undef ACC
+    }
+    __m128i a[4] = {a0, a1, a2, a3};
+    for (int k = 0; k < 4; k++) {
+      int c = _mm_cvtsi128_si32(a[k]) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(a[k], a[k]));
+      for (int i = vbytes; i < bytes; i += 8) {
+        unsigned long long v = load64(d+stride*k+i) ^ load64(bsig+i);
+        if (masked) v &= load64(bmask+i);
+        c += popcount64_swar(v);
+      }
+      out[j+k] = c;
+    }
+  }
+  for (; j < n; j++) {
+    out[j] = dist_ssse3(sigwidth, bsig, bmask, dsigs + stride * j, masked);
+  }
+}
+
+__attribute__((target("ssse3")))
+static void batch_ssse3_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_ssse3(sigwidth, bsig, bmask, dsigs, stride, n, out, 1);
+}
+
+__attribute__((target("ssse3")))
+static void batch_ssse3_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_ssse3(sigwidth, bsig, bmask, dsigs, stride, n, out, 0);
+}
+
+// AVX2: Harley-Seal carry-save adder tree over blocks of 16 vectors, with
+// the pshufb lookup popcount for the vectors that do not fill a block.
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i popcount_epi64_avx2(__m256i v)
+{
+  const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                       0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low = _mm256_set1_epi8(0x0F);
+  __m256i lo = _mm256_and_si256(v, low);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+  __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+  return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+#define CSA256(h, l, a, b, c) do { \
+    __m256i u_ = _mm256_xor_si256(a, b); \
+    h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u_, c)); \
+    l = _mm256_xor_si256(u_, c); \
+  } while (0)
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i load_xor_avx2(const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig, int i, const int masked)
+{
+  __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dsig+i)), _mm256_loadu_si256((const __m256i *)(bsig+i)));
+  if (masked) v = _mm256_and_si256(v, _mm256_loadu_si256((const __m256i *)(bmask+i)));
+  return v;
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline int dist_avx2(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig, const int masked)
+{
+  const int bytes = sigwidth / 8 / 8 * 8;
+  __m256i total = _mm256_setzero_si256();
+  __m256i ones = _mm256_setzero_si256();
+  __m256i twos = _mm256_setzero_si256();
+  __m256i fours = _mm256_setzero_si256();
+  __m256i eights = _mm256_setzero_si256();
+  __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+  int i = 0;
+
+  for (; i + 16 * 32 <= bytes; i += 16 * 32) {
+    #define V(n) load_xor_avx2(bsig, bmask, dsig, i + (n) * 32, masked)
+    CSA256(twosA, ones, ones, V(0), V(1));
+    CSA256(twosB, ones, ones, V(2), V(3));
+    CSA256(foursA, twos, twos, twosA, twosB);
+    CSA256(twosA, ones, ones, V(4), V(5));
+    CSA256(twosB, ones, ones, V(6), V(7));
+    CSA256(foursB, twos, twos, twosA, twosB);
+    CSA256(eightsA, fours, fours, foursA, foursB);
+    CSA256(twosA, ones, ones, V(8), V(9));
+    CSA256(twosB, ones, ones, V(10), V(11));
+    CSA256(foursA, twos, twos, twosA, twosB);
+    CSA256(twosA, ones, ones, V(12), V(13));
+    CSA256(twosB, ones, ones, V(14), V(15));
+    CSA256(foursB, twos, twos, twosA, twosB);
+    CSA256(eightsB, fours, fours, foursA, foursB);
+    CSA256(sixteens, eights, eights, eightsA, eightsB);
+    #undef V
+    total = _mm256_add_epi64(total, popcount_epi64_avx2(sixteens));
+  }
+
+  total = _mm256_slli_epi64(total, 4);
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_epi64_avx2(eights), 3));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_epi64_avx2(fours), 2));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_epi64_avx2(twos), 1));
+  total = _mm256_add_epi64(total, popcount_epi64_avx2(ones));
+
+  for (; i + 32 <= bytes; i += 32) {
+    total = _mm256_add_epi64(total, popcount_epi64_avx2(load_xor_avx2(bsig, bmask, dsig, i, masked)));
+  }
+
+  __m128i t = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+  int c = _mm_cvtsi128_si32(t) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(t, t));
+  for (; i < bytes; i += 8) {
+    unsigned long long v = load64(dsig+i) ^ load64(bsig+i);
+    if (masked) v &= load64(bmask+i);
+    c += popcount64_swar(v);
+  }
+  return c;
+}
+
+__attribute__((target("avx2")))
+static int dist_avx2_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig)
+{
+  return dist_avx2(sigwidth, bsig, bmask, dsig, 1);
+}
+
+__attribute__((target("avx2")))
+static int dist_avx2_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig)
+{
+  return dist_avx2(sigwidth, bsig, NULL, dsig, 0);
+}
+
+// The batch kernel uses the lookup popcount for every vector: a single
+// signature is too short for the Harley-Seal tree to pay off, and the four
+// documents share each query load instead.
+__attribute__((target("avx2"), always_inline))
+static inline void batch_avx2(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out, const int masked)
+{
+  const int bytes = sigwidth / 8 / 8 * 8;
+  const int vbytes = bytes / 32 * 32;
+  int j = 0;
+  for (; j + 4 <= n; j += 4) {
+    const unsigned char *d = dsigs + stride * j;
+    prefetch_records(dsigs, stride, j + BATCH_PREFETCH, n, bytes);
+    __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256(), a2 = _mm256_setzero_si256(), a3 = _mm256_setzero_si256();
+    for (int i = 0; i < vbytes; i += 32) {
+      __m256i q = _mm256_loadu_si256((const __m256i *)(bsig+i));
+      __m256i m = masked ? _mm256_loadu_si256((const __m256i *)(bmask+i)) : _mm256_set1_epi8(-1);
+      #define ACC(a, o) a = _mm256_add_epi64(a, popcount_epi64_avx2(_mm256_and_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(d+(o)+i)), q), m)))
+      ACC(a0, 0); ACC(a1, stride); ACC(a2, stride*2); ACC(a3, stride*3);
+      #undef ACC
+    }
+    __m256i a[4] = {a0, a1, a2, a3};
+    for (int k = 0; k < 4; k++) {
+      __m128i t = _mm_add_epi64(_mm256_castsi256_si128(a[k]), _mm256_extracti128_si256(a[k], 1));
+      int c = _mm_cvtsi128_si32(t) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(t, t));
+      for (int i = vbytes; i < bytes; i += 8) {
+        unsigned long long v = load64(d+stride*k+i) ^ load64(bsig+i);
+        if (masked) v &= load64(bmask+i);
+        c += popcount64_swar(v);
+      }
+      out[j+k] = c;
+    }
+  }
+  for (; j < n; j++) {
+    out[j] = dist_avx2(sigwidth, bsig, bmask, dsigs + stride * j, masked);
+  }
+}
+
+__attribute__((target("avx2")))
+static void batch_avx2_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_avx2(sigwidth, bsig, bmask, dsigs, stride, n, out, 1);
+}
+
+__attribute__((target("avx2")))
+static void batch_avx2_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_avx2(sigwidth, bsig, bmask, dsigs, stride, n, out, 0);
+}
+
+// AVX-512 VPOPCNTDQ: native 64-bit lane popcount, masked loads for the tail
+
+__attribute__((target("avx512f,avx512vpopcntdq"), always_inline))
+static inline int dist_avx512(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig, const int masked)
+{
+  const int words = sigwidth / 64;
+  __m512i acc = _mm512_setzero_si512();
+  for (int w = 0; w < words; w += 8) {
+    __mmask8 m = (words - w >= 8) ? 0xFF : (__mmask8)((1u << (words - w)) - 1);
+    __m512i v = _mm512_xor_si512(_mm512_maskz_loadu_epi64(m, dsig + w*8), _mm512_maskz_loadu_epi64(m, bsig + w*8));
+    if (masked) v = _mm512_and_si512(v, _mm512_maskz_loadu_epi64(m, bmask + w*8));
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
+  }
+  return _mm512_reduce_add_epi64(acc);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static int dist_avx512_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig)
+{
+  return dist_avx512(sigwidth, bsig, bmask, dsig, 1);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static int dist_avx512_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig)
+{
+  return dist_avx512(sigwidth, bsig, NULL, dsig, 0);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"), always_inline))
+static inline void batch_avx512(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out, const int masked)
+{
+  const int words = sigwidth / 64;
+  int j = 0;
+  for (; j + 4 <= n; j += 4) {
+    const unsigned char *d = dsigs + stride * j;
+    prefetch_records(dsigs, stride, j + BATCH_PREFETCH, n, words * 8);
+    __m512i a0 = _mm512_setzero_si512(), a1 = _mm512_setzero_si512(), a2 = _mm512_setzero_si512(), a3 = _mm512_setzero_si512();
+    for (int w = 0; w < words; w += 8) {
+      __mmask8 lanes = (words - w >= 8) ? 0xFF : (__mmask8)((1u << (words - w)) - 1);
+      __m512i q = _mm512_maskz_loadu_epi64(lanes, bsig + w*8);
+      __m512i m = masked ? _mm512_maskz_loadu_epi64(lanes, bmask + w*8) : _mm512_set1_epi64(-1);
+      #define ACC(a, o) a = _mm512_add_epi64(a, _mm512_popcnt_epi64(_mm512_and_si512(_mm512_xor_si512(_mm512_maskz_loadu_epi64(lanes, d + (o) + w*8), q), m)))
+      ACC(a0, 0); ACC(a1, stride); ACC(a2, stride*2); ACC(a3, stride*3);
+      #undef ACC
+    }
+    out[j] = _mm512_reduce_add_epi64(a0);
+    out[j+1] = _mm512_reduce_add_epi64(a1);
+    out[j+2] = _mm512_reduce_add_epi64(a2);
+    out[j+3] = _mm512_reduce_add_epi64(a3);
+  }
+  for (; j < n; j++) {
+    out[j] = dist_avx512(sigwidth, bsig, bmask, dsigs + stride * j, masked);
+  }
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void batch_avx512_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_avx512(sigwidth, bsig, bmask, dsigs, stride, n, out, 1);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void batch_avx512_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  batch_avx512(sigwidth, bsig, bmask, dsigs, stride, n, out, 0);
+}
+
+static int supported_popcnt() { __builtin_cpu_init(); return __builtin_cpu_supports("popcnt"); }
+static int supported_ssse3() { __builtin_cpu_init(); return __builtin_cpu_supports("ssse3"); }
+static int supported_avx2() { __builtin_cpu_init(); return __builtin_cpu_supports("avx2"); }
+static int supported_avx512() { __builtin_cpu_init(); return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"); }
+
+#endif /* HAMMING_X86 */
+
+static int supported_always() { return 1; }
+
+typedef struct {
+  const char *name;
+  int (*supported)();
+  distance_masked_fn masked;
+  distance_unmasked_fn unmasked;
+  distance_batch_fn batch_masked;
+  distance_batch_fn batch_unmasked;
+  distance_bounded_fn bounded;
+} HammingKernel;
+
+// In order of preference
+static const HammingKernel kernels[] = {
+#ifdef HAMMING_X86
+  {"avx512", supported_avx512, dist_avx512_masked, dist_avx512_unmasked,
+   batch_avx512_masked, batch_avx512_unmasked, bounded_popcnt},
+  {"avx2", supported_avx2, dist_avx2_masked, dist_avx2_unmasked,
+   batch_avx2_masked, batch_avx2_unmasked, bounded_popcnt},
+  {"ssse3", supported_ssse3, dist_ssse3_masked, dist_ssse3_unmasked,
+   batch_ssse3_masked, batch_ssse3_unmasked, bounded_scalar},
+  {"popcnt", supported_popcnt, dist_popcnt_masked, dist_popcnt_unmasked,
+   batch_popcnt_masked, batch_popcnt_unmasked, bounded_popcnt},
+#endif
+  {"scalar", supported_always, dist_scalar_masked, dist_scalar_unmasked,
+   batch_scalar_masked, batch_scalar_unmasked, bounded_scalar}
+};
+
+static int resolve_masked(int, const unsigned char *, const unsigned char *, const unsigned char *);
+static int resolve_unmasked(int, const unsigned char *, const unsigned char *);
+static void resolve_batch_masked(int, const unsigned char *, const unsigned char *, const unsigned char *, size_t, int, int *);
+static void resolve_batch_unmasked(int, const unsigned char *, const unsigned char *, const unsigned char *, size_t, int, int *);
+static long long resolve_bounded(const unsigned char *, const unsigned char *, const unsigned char *, size_t, int, const int *, int, int, int *);
+
+static const HammingKernel *kernel = NULL;
+static distance_masked_fn distance_masked = resolve_masked;
+static distance_unmasked_fn distance_unmasked = resolve_unmasked;
+static distance_batch_fn distance_batch_masked = resolve_batch_masked;
+static distance_batch_fn distance_batch_unmasked = resolve_batch_unmasked;
+static distance_bounded_fn distance_bounded = resolve_bounded;
+
+// HAMMING-KERNEL = auto (default), avx512, avx2, ssse3, popcnt or scalar
+void Hamming_InitCfg()
+{
+  // Every kernel works a 64-bit word at a time
+  const char *C = Config("SIGNATURE-WIDTH");
+  if (C && atoi(C) % 64 != 0) {
+    fprintf(stderr, "Error: SIGNATURE-WIDTH (%s) must be a multiple of 64\n", C);
+    exit(1);
+  }
+
+  C = Config("HAMMING-KERNEL");
+  int n_kernels = sizeof(kernels) / sizeof(kernels[0]);
+  const HammingKernel *selected = NULL;
+
+  for (int i = 0; i < n_kernels; i++) {
+    if (C == NULL || lc_strcmp(C, "auto") == 0) {
+      if (kernels[i].supported()) {
+        selected = &kernels[i];
+        break;
+      }
+    } else if (lc_strcmp(C, kernels[i].name) == 0) {
+      if (!kernels[i].supported()) {
+        fprintf(stderr, "Error: HAMMING-KERNEL %s is not supported by this CPU.\n", C);
+        exit(1);
+      }
+      selected = &kernels[i];
+      break;
+    }
+  }
+  if (selected == NULL) {
+    fprintf(stderr, "Error: invalid HAMMING-KERNEL value (%s)\n", C);
+    exit(1);
+  }
+
+  kernel = selected;
+  distance_masked = selected->masked;
+  distance_unmasked = selected->unmasked;
+  distance_batch_masked = selected->batch_masked;
+  distance_batch_unmasked = selected->batch_unmasked;
+  distance_bounded = selected->bounded;
+}
+
+const char *HammingKernelName()
+{
+  if (!kernel) Hamming_InitCfg();
+  return kernel->name;
+}
+
+// Only reached if a distance is needed before the configuration has been
+// processed.
+static int resolve_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig)
+{
+  Hamming_InitCfg();
+  return distance_masked(sigwidth, bsig, bmask, dsig);
+}
+
+static int resolve_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig)
+{
+  Hamming_InitCfg();
+  return distance_unmasked(sigwidth, bsig, dsig);
+}
+
+static void resolve_batch_masked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  Hamming_InitCfg();
+  distance_batch_masked(sigwidth, bsig, bmask, dsigs, stride, n, out);
+}
+
+static void resolve_batch_unmasked(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out)
+{
+  Hamming_InitCfg();
+  distance_batch_unmasked(sigwidth, bsig, bmask, dsigs, stride, n, out);
+}
+
+static long long resolve_bounded(const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, const int *order, int n_order, int bound, int *out)
+{
+  Hamming_InitCfg();
+  return distance_bounded(bsig, bmask, dsigs, stride, n, order, n_order, bound, out);
+}
+
+int DocumentDistance(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig)
+{
+  return distance_masked(sigwidth, bsig, bmask, dsig);
+}
+
+int DocumentDistanceUnmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig)
+{
+  return distance_unmasked(sigwidth, bsig, dsig);
+}
+
+void DocumentDistanceBatch(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out_dists)
+{
+  if (bmask) {
+    distance_batch_masked(sigwidth, bsig, bmask, dsigs, stride, n, out_dists);
+  } else {
+    distance_batch_unmasked(sigwidth, bsig, NULL, dsigs, stride, n, out_dists);
+  }
+}
+
+int DistanceWordOrder(int sigwidth, const unsigned char *bmask, int *order)
+{
+  const int words = sigwidth / 64;
+  int weight[words];
+  int n = 0;
+  for (int w = 0; w < words; w++) {
+    weight[w] = popcount64_swar(load64(bmask + w*8));
+    if (weight[w] == 0) continue;
+    // Insertion sort by descending weight, ties kept in signature order
+    int j = n++;
+    while (j > 0 && weight[order[j-1]] < weight[w]) {
+      order[j] = order[j-1];
+      j--;
+    }
+    order[j] = w;
+  }
+  return n;
+}
+
+long long DocumentDistanceBoundedBatch(const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, const int *order, int n_order, int bound, int *out_dists)
+{
+  return distance_bounded(bsig, bmask, dsigs, stride, n, order, n_order, bound, out_dists);
+}
@@ -0,0 +1,35 @@
+#ifndef TOPSIG_HAMMING_H
+#define TOPSIG_HAMMING_H
+
+#include <stddef.h>
+
+void Hamming_InitCfg();
+const char *HammingKernelName();
+
+// Hamming distance between a query signature (restricted to the bits set in
+// bmask) and a document signature. sigwidth is in bits and is a multiple
+// of 64, as Hamming_InitCfg requires.
+int DocumentDistance(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig);
+
+// As above, for when every bit of the query is significant (docsim modes)
+int DocumentDistanceUnmasked(int sigwidth, const unsigned char *bsig, const unsigned char *dsig);
+
+// Distances from one query to n document signatures spaced stride bytes
+// apart, written to out_dists. Equivalent to calling DocumentDistance on
+// each record, but the query stays in registers across documents. A NULL
+// bmask selects the unmasked distance.
+void DocumentDistanceBatch(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, int *out_dists);
+
+// Fills order with the indices of the 64-bit words of bmask that have any
+// bit set, most heavily masked first, and returns how many there are.
+// order must have room for sigwidth/64 entries.
+int DistanceWordOrder(int sigwidth, const unsigned char *bmask, int *order);
+
+// Masked distances from one query to n document signatures, as
+// DocumentDistanceBatch, but visiting the words in order (see
+// DistanceWordOrder) and giving up on a document once its running total
+// exceeds bound. Distances no greater than bound are exact; the others are
+// only known to be greater than bound. Returns the number of words examined.
+long long DocumentDistanceBoundedBatch(const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsigs, size_t stride, int n, const int *order, int n_order, int bound, int *out_dists);
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "topsig-index.h"
 #include "topsig-file.h"
 #include "topsig-filerw.h"
@@ -12,11 +13,14 @@
 #include "topsig-stats.h"
 #include "topsig-global.h"
 #include "topsig-document.h"
+#include "topsig-queue.h"
+#include "topsig-timer.h"
 #include "uthash.h"
 
 #define BUFFER_SIZE (512 * 1024)
 
-static char current_archive_path[2048];
+// Archives are read by several threads at once in multithreaded mode
+static __thread char current_archive_path[2048];
 
 typedef struct {
   char from[256];
@@ -142,25 +146,12 @@ static char *getnextfile(char *path)
 
 static void indexfile(Document *doc)
 {
-  static int thread_mode = -1;
   static SignatureCache *signaturecache = NULL;
   
-  if (thread_mode == -1) {
-    if (Config("INDEX-THREADING") && strcmp(Config("INDEX-THREADING"), "multi")==0) {
-      thread_mode = 1;
-    } else {
-      thread_mode = 0;
-    }
-  }
-  
-  if (thread_mode == 0) { // Single-threaded
-    if (signaturecache == NULL) {
-      signaturecache = NewSignatureCache(1, 1);
-    }
-    ProcessFile(signaturecache, doc);
-  } else {
-    ProcessFile_Threaded(doc);
+  if (signaturecache == NULL) {
+    signaturecache = NewSignatureCache(1, 1);
   }
+  ProcessFile(signaturecache, doc);
 }
 
 static void AR_file(FileHandle *fp, void (*processfile)(Document *))
@@ -767,6 +758,132 @@ static void (*getarchivereader(const char *targetformat))(FileHandle *, void (*)
   return archivereader;
 }
 
+// In multithreaded mode indexing is a pipeline of stages, each on its own
+// threads, with a bounded queue between each and the next:
+//   the main thread finds the files to index
+//   readers open (and decompress) the files and split them into documents
+//   workers turn the documents into signatures
+//   the writer writes out the signatures
+// The writer is fed through the signature cache rather than a queue. When
+// indexing finishes the state of each queue is reported: the stage after a
+// queue that was usually full, or before one that was usually empty, is
+// the one holding up the others.
+
+typedef struct {
+  void (*archivereader)(FileHandle *, void (*)(Document *));
+  BlockingQueue *files;
+  BlockingQueue *documents;
+} IndexPipeline;
+
+// Archive readers hand documents to a callback without any context
+static BlockingQueue *pipeline_documents;
+
+static void pipeline_emit(Document *doc)
+{
+  BQPush(pipeline_documents, doc);
+}
+
+static void *Pipeline_Reader(void *input)
+{
+  IndexPipeline *P = input;
+  char *path;
+  while ((path = BQPop(P->files)) != NULL) {
+    FileHandle *fp = file_open(path);
+    if (fp) {
+      strcpy(current_archive_path, path);
+      P->archivereader(fp, pipeline_emit);
+      file_close(fp);
+    }
+    free(path);
+  }
+  BQClose(P->documents);
+  return NULL;
+}
+
+static void *Pipeline_Worker(void *input)
+{
+  IndexPipeline *P = input;
+  SignatureCache *C = NewSignatureCache(0, 1);
+  Document *doc;
+  while ((doc = BQPop(P->documents)) != NULL) {
+    ProcessFile(C, doc);
+  }
+  DestroySignatureCache(C);
+  return NULL;
+}
+
+static void *Pipeline_Writer(void *input)
+{
+  (void)input;
+  SignatureWriterRun();
+  return NULL;
+}
+
+static int pipeline_config(const char *option, int default_value)
+{
+  if (!Config(option)) return default_value;
+  int value = atoi(Config(option));
+  if (value <= 0) {
+    fprintf(stderr, "Error: invalid %s value\n", option);
+    exit(1);
+  }
+  return value;
+}
+
+static void Run_Index_Pipeline(void (*archivereader)(FileHandle *, void (*)(Document *)))
+{
+  int readers = pipeline_config("INDEX-READER-THREADS", 1);
+  int workers = pipeline_config("INDEX-THREADS", 4);
+  int depth = pipeline_config("INDEX-QUEUE-DEPTH", 512);
+  
+  IndexPipeline P;
+  P.archivereader = archivereader;
+  P.files = BQCreate(depth, 1);
+  P.documents = BQCreate(depth, readers);
+  pipeline_documents = P.documents;
+  
+  timer T = timer_start();
+  // Creating the writer's cache creates the signature file
+  SignatureCache *writer_cache = NewSignatureCache(2, 0);
+  pthread_t writer_thread;
+  pthread_t worker_threads[workers];
+  pthread_t reader_threads[readers];
+  pthread_create(&writer_thread, NULL, Pipeline_Writer, &P);
+  for (int i = 0; i < workers; i++) {
+    pthread_create(&worker_threads[i], NULL, Pipeline_Worker, &P);
+  }
+  for (int i = 0; i < readers; i++) {
+    pthread_create(&reader_threads[i], NULL, Pipeline_Reader, &P);
+  }
+  
+  char path[2048];
+  while (getnextfile(path)) {
+    char *queued = malloc(strlen(path) + 1);
+    strcpy(queued, path);
+    BQPush(P.files, queued);
+  }
+  BQClose(P.files);
+  
+  for (int i = 0; i < readers; i++) {
+    pthread_join(reader_threads[i], NULL);
+  }
+  for (int i = 0; i < workers; i++) {
+    pthread_join(worker_threads[i], NULL);
+  }
+  SignatureWriterStop();
+  pthread_join(writer_thread, NULL);
+  DestroySignatureCache(writer_cache);
+  
+  int written, stalls;
+  SignatureCacheStats(&written, &stalls);
+  fprintf(stderr, "Index pipeline: %d reader, %d worker and 1 writer threads, %.0fms\n", readers, workers, timer_tick(&T));
+  BQReport(P.files, "  File");
+  BQReport(P.documents, "  Document");
+  fprintf(stderr, "  Writer: %d signatures, %d writes waited for the writer\n", written, stalls);
+  BQDestroy(P.files);
+  BQDestroy(P.documents);
+}
+
 void RunIndex()
 {
   char path[2048];
@@ -778,16 +895,21 @@ void RunIndex()
     exit(1);
   }
   
-  while (getnextfile(path)) {
-    //printf("%s\n", path);
-    FileHandle *fp = file_open(path);
-    if (fp) {
-      strcpy(current_archive_path, path);
-      archivereader(fp, indexfile);
-      file_close(fp);
+  if (Config("INDEX-THREADING") && strcmp(Config("INDEX-THREADING"), "multi")==0) {
+    Run_Index_Pipeline(archivereader);
+  } else {
+    while (getnextfile(path)) {
+      //printf("%s\n", path);
+      FileHandle *fp = file_open(path);
+      if (fp) {
+        strcpy(current_archive_path, path);
+        archivereader(fp, indexfile);
+        file_close(fp);
+      }
     }
+    SignatureFlush();
   }
-  Flush_Threaded();
+  SignatureClose();
 }
 
 static void addstats(Document *doc)
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "topsig-issl-codec.h"
+#include "topsig-global.h"
+
+// The stream VByte decoder has an SSSE3 version selected at runtime, in the
+// same way as the Hamming distance kernels
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ISSL_CODEC_X86
+#include <immintrin.h>
+#endif
+
+static const char *compression_names[] = {"none", "bitpack", "vbyte"};
+
+int ISSLCompressionFromName(const char *name)
+{
+  for (int i = 0; i < (int)(sizeof(compression_names) / sizeof(compression_names[0])); i++) {
+    if (lc_strcmp(name, compression_names[i]) == 0) return i;
+  }
+  return -1;
+}
+
+const char *ISSLCompressionName(int compression)
+{
+  if (compression < 0 || compression >= (int)(sizeof(compression_names) / sizeof(compression_names[0]))) return "unknown";
+  return compression_names[compression];
+}
+
+size_t ISSLEncodeBound(int compression, int n)
+{
+  size_t blocks = (n + ISSL_BLOCK - 1) / ISSL_BLOCK;
+  switch (compression) {
+    case ISSL_COMPRESSION_BITPACK:
+      return blocks + (size_t)n * 4;
+    case ISSL_COMPRESSION_VBYTE:
+      return blocks * (ISSL_BLOCK / 4) + (size_t)n * 4;
+    default:
+      return (size_t)n * 4;
+  }
+}
+
+static inline int bits_needed(unsigned int v)
+{
+  return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static inline int vbyte_code(unsigned int v)
+{
+  if (v < (1u << 8)) return 0;
+  if (v < (1u << 16)) return 1;
+  if (v < (1u << 24)) return 2;
+  return 3;
+}
+
+size_t ISSLEncode(int compression, const int *docids, int n, unsigned char *out)
+{
+  if (compression == ISSL_COMPRESSION_NONE) {
+    memcpy(out, docids, sizeof(int) * n);
+    return sizeof(int) * n;
+  }
+
+  unsigned char *p = out;
+  int last = -1;
+  for (int first = 0; first < n; first += ISSL_BLOCK) {
+    int count = n - first;
+    if (count > ISSL_BLOCK) count = ISSL_BLOCK;
+    unsigned int gaps[ISSL_BLOCK];
+    for (int i = 0; i < count; i++) {
+      gaps[i] = docids[first + i] - last - 1;
+      last = docids[first + i];
+    }
+
+    if (compression == ISSL_COMPRESSION_BITPACK) {
+      unsigned int all = 0;
+      for (int i = 0; i < count; i++) all |= gaps[i];
+      int b = bits_needed(all);
+      *p++ = b;
+      unsigned long long acc = 0;
+      int acc_bits = 0;
+      for (int i = 0; i < count; i++) {
+        acc |= (unsigned long long)gaps[i] << acc_bits;
+        acc_bits += b;
+        while (acc_bits >= 8) {
+          *p++ = acc & 0xFF;
+          acc >>= 8;
+          acc_bits -= 8;
+        }
+      }
+      if (acc_bits > 0) *p++ = acc & 0xFF;
+    } else {
+      unsigned char *ctrl = p;
+      unsigned char *data = p + (count + 3) / 4;
+      memset(ctrl, 0, (count + 3) / 4);
+      for (int i = 0; i < count; i++) {
+        int code = vbyte_code(gaps[i]);
+        ctrl[i / 4] |= code << (2 * (i % 4));
+        for (int j = 0; j <= code; j++) {
+          *data++ = (gaps[i] >> (8 * j)) & 0xFF;
+        }
+      }
+      p = data;
+    }
+  }
+  return p - out;
+}
+
+// Reads up to 8 bytes without going past end
+static inline unsigned long long load_bounded(const unsigned char *p, const unsigned char *end)
+{
+  unsigned long long v = 0;
+  if (end - p >= 8) {
+    memcpy(&v, p, 8);
+    return v;
+  }
+  for (int i = 0; p + i < end; i++) {
+    v |= (unsigned long long)p[i] << (8 * i);
+  }
+  return v;
+}
+
+// The decoders turn the gaps back into docids as they go, starting from
+// *last and leaving the final docid of the block there
+
+static const unsigned char *bitpack_decode(const unsigned char *p, const unsigned char *end, int n, int *out, int *last)
+{
+  int b = *p++;
+  int d = *last;
+  if (b == 0) {
+    for (int i = 0; i < n; i++) out[i] = ++d;
+    *last = d;
+    return p;
+  }
+  const unsigned long long mask = (1ULL << b) - 1;
+  size_t bitpos = 0;
+  int i = 0;
+  // Whole 8-byte loads while they stay within the list, then the tail
+  int safe = ((end - p - 8) * 8) / b;
+  if (safe > n) safe = n;
+  for (; i < safe; i++) {
+    unsigned long long v;
+    memcpy(&v, p + bitpos / 8, 8);
+    d += ((v >> (bitpos % 8)) & mask) + 1;
+    out[i] = d;
+    bitpos += b;
+  }
+  for (; i < n; i++) {
+    d += ((load_bounded(p + bitpos / 8, end) >> (bitpos % 8)) & mask) + 1;
+    out[i] = d;
+    bitpos += b;
+  }
+  *last = d;
+  return p + (bitpos + 7) / 8;
+}
+
+// Total data length of the four gaps described by a control byte, and the
+// shuffle that moves each gap's bytes into its own 32-bit lane
+#define VB_LEN(c, k) ((((c) >> (2 * (k))) & 3) + 1)
+#define VB_OFF0(c) 0
+#define VB_OFF1(c) VB_LEN(c, 0)
+#define VB_OFF2(c) (VB_OFF1(c) + VB_LEN(c, 1))
+#define VB_OFF3(c) (VB_OFF2(c) + VB_LEN(c, 2))
+#define VB_TOTAL(c) (VB_OFF3(c) + VB_LEN(c, 3))
+#define VB_BYTE(c, k, j) ((j) < VB_LEN(c, k) ? VB_OFF##k(c) + (j) : -1)
+#define VB_LANE(c, k) VB_BYTE(c, k, 0), VB_BYTE(c, k, 1), VB_BYTE(c, k, 2), VB_BYTE(c, k, 3)
+#define VB_SHUFFLE(c) {VB_LANE(c, 0), VB_LANE(c, 1), VB_LANE(c, 2), VB_LANE(c, 3)}
+#define VB_REPEAT4(M, c) M(c), M(c + 1), M(c + 2), M(c + 3)
+#define VB_REPEAT16(M, c) VB_REPEAT4(M, c), VB_REPEAT4(M, c + 4), VB_REPEAT4(M, c + 8), VB_REPEAT4(M, c + 12)
+#define VB_REPEAT64(M, c) VB_REPEAT16(M, c), VB_REPEAT16(M, c + 16), VB_REPEAT16(M, c + 32), VB_REPEAT16(M, c + 48)
+#define VB_REPEAT256(M) VB_REPEAT64(M, 0), VB_REPEAT64(M, 64), VB_REPEAT64(M, 128), VB_REPEAT64(M, 192)
+
+#ifdef ISSL_CODEC_X86
+static const unsigned char vbyte_length[256] = {VB_REPEAT256(VB_TOTAL)};
+static const signed char vbyte_shuffle[256][16] = {VB_REPEAT256(VB_SHUFFLE)};
+#endif
+
+static const unsigned char *vbyte_decode_scalar(const unsigned char *ctrl, const unsigned char *data, int i, int n, int *out, int *last)
+{
+  int d = *last;
+  for (; i < n; i++) {
+    int len = ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+    unsigned int v = 0;
+    for (int j = 0; j < len; j++) {
+      v |= (unsigned int)data[j] << (8 * j);
+    }
+    d += v + 1;
+    out[i] = d;
+    data += len;
+  }
+  *last = d;
+  return data;
+}
+
+#ifdef ISSL_CODEC_X86
+// Four gaps per control byte are moved into place with one shuffle and
+// summed in registers. The 16-byte loads only happen while they stay within
+// the list.
+__attribute__((target("ssse3")))
+static const unsigned char *vbyte_decode_ssse3(const unsigned char *ctrl, const unsigned char *data, const unsigned char *end, int n, int *out, int *last)
+{
+  int i = 0;
+  __m128i prev = _mm_set1_epi32(*last);
+  const __m128i one = _mm_set1_epi32(1);
+  for (; i + 4 <= n && end - data >= 16; i += 4) {
+    int c = ctrl[i / 4];
+    __m128i v = _mm_loadu_si128((const __m128i *)data);
+    v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i *)vbyte_shuffle[c]));
+    v = _mm_add_epi32(v, one);
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+    v = _mm_add_epi32(v, prev);
+    _mm_storeu_si128((__m128i *)(out + i), v);
+    prev = _mm_shuffle_epi32(v, 0xFF);
+    data += vbyte_length[c];
+  }
+  *last = _mm_cvtsi128_si32(prev);
+  return vbyte_decode_scalar(ctrl, data, i, n, out, last);
+}
+#endif
+
+static const unsigned char *vbyte_decode(const unsigned char *p, const unsigned char *end, int n, int *out, int *last)
+{
+  const unsigned char *ctrl = p;
+  const unsigned char *data = p + (n + 3) / 4;
+#ifdef ISSL_CODEC_X86
+  if (__builtin_cpu_supports("ssse3")) return vbyte_decode_ssse3(ctrl, data, end, n, out, last);
+#else
+  (void)end;
+#endif
+  return vbyte_decode_scalar(ctrl, data, 0, n, out, last);
+}
+
+int ISSLListNext(ISSLListReader *R, int *out)
+{
+  int n = R->remaining;
+  if (n > ISSL_BLOCK) n = ISSL_BLOCK;
+  if (n == 0) return 0;
+  R->remaining -= n;
+
+  if (R->compression == ISSL_COMPRESSION_NONE) {
+    memcpy(out, R->p, sizeof(int) * n);
+    R->p += sizeof(int) * n;
+    return n;
+  }
+
+  if (R->compression == ISSL_COMPRESSION_BITPACK) {
+    R->p = bitpack_decode(R->p, R->end, n, out, &R->last);
+  } else {
+    R->p = vbyte_decode(R->p, R->end, n, out, &R->last);
+  }
+  return n;
+}
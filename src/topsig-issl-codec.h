@@ -0,0 +1,57 @@
+#ifndef TOPSIG_ISSL_CODEC_H
+#define TOPSIG_ISSL_CODEC_H
+
+#include <stddef.h>
+
+// Encodings of ISSL posting lists. This module does not depend on the
+// configuration system.
+//
+// A posting list is a sorted list of docids. The compressed encodings store
+// the gaps between consecutive docids (less one, with the first docid as its
+// own gap) in blocks of ISSL_BLOCK postings, so that a list can be decoded
+// one block at a time into a small buffer:
+//   bitpack - one byte holding the bit width b of the largest gap in the
+//             block, followed by every gap of the block packed into b bits
+//   vbyte   - stream VByte: a control byte for every 4 gaps giving the
+//             length of each (1-4 bytes), followed by the gaps' bytes
+
+#define ISSL_COMPRESSION_NONE 0
+#define ISSL_COMPRESSION_BITPACK 1
+#define ISSL_COMPRESSION_VBYTE 2
+
+#define ISSL_BLOCK 128
+
+// Returns the compression mode with the given name (none, bitpack or
+// vbyte), or -1 if there is none
+int ISSLCompressionFromName(const char *name);
+const char *ISSLCompressionName(int compression);
+
+// Upper bound on the encoded size of n postings
+size_t ISSLEncodeBound(int compression, int n);
+
+// Encodes docids[0..n-1] into out, returning the number of bytes written
+size_t ISSLEncode(int compression, const int *docids, int n, unsigned char *out);
+
+typedef struct {
+  int compression;
+  const unsigned char *p;
+  const unsigned char *end;
+  int remaining;
+  int last;
+} ISSLListReader;
+
+// Prepares to decode a list of count postings held in the given bytes
+static inline void ISSLListOpen(ISSLListReader *R, int compression, const unsigned char *data, size_t bytes, int count)
+{
+  R->compression = compression;
+  R->p = data;
+  R->end = data + bytes;
+  R->remaining = count;
+  R->last = -1;
+}
+
+// Decodes the next block of up to ISSL_BLOCK docids into out and returns
+// how many there were, or 0 at the end of the list
+int ISSLListNext(ISSLListReader *R, int *out);
+
+#endif
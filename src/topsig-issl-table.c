@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#if !(defined(WINDOWS) || defined(_WIN32) || defined(_WIN64))
+#include <sys/mman.h>
+#define ISSL_HAVE_MMAP
+#endif
+#include "topsig-issl-table.h"
+#include "topsig-global.h"
+
+// Size of the fixed fields, section offsets, partition count and stopped
+// list count at the start of a storage mode 3 table
+#define ISSL_HEADER_SIZE (6 * 4 + 4 * 8 + 4 + 4)
+
+static size_t align_up(size_t n)
+{
+  return (n + ISSL_ALIGNMENT - 1) / ISSL_ALIGNMENT * ISSL_ALIGNMENT;
+}
+
+static void pad_to_alignment(FILE *fp)
+{
+  while (ftello(fp) % ISSL_ALIGNMENT != 0) {
+    fputc(0, fp);
+  }
+}
+
+static size_t total_lists(const ISSLHeader *H)
+{
+  size_t n = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    n += (size_t)1 << ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+  }
+  return n;
+}
+
+static size_t total_segments(const ISSLHeader *H)
+{
+  return total_lists(H) * H->partitions;
+}
+
+static void *alloc_or_die(size_t sz, const char *what)
+{
+  void *p = malloc(sz);
+  if (!p) {
+    double mb = (double)sz / 1048576.0;
+    fprintf(stderr, "Error: unable to allocate memory for ISSL %s (%.2f MB)\n", what, mb);
+    exit(1);
+  }
+  return p;
+}
+
+static void read_or_die(void *buf, size_t sz, FILE *fp)
+{
+  if (fread(buf, 1, sz, fp) != sz) {
+    fprintf(stderr, "Error: ISSL table is truncated.\n");
+    exit(1);
+  }
+}
+
+// Points the per-slice arrays at the list-ordered counts and offsets
+static void describe_slices(ISSLTable *T, const int *counts, const unsigned long long *offsets)
+{
+  const ISSLHeader *H = &T->cfg;
+  T->counts = malloc(sizeof(int *) * H->num_slices);
+  T->offsets = malloc(sizeof(unsigned long long *) * H->num_slices);
+  size_t list = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    T->counts[slice] = counts ? counts + list : NULL;
+    T->offsets[slice] = offsets + list;
+    list += ((size_t)1 << ISSLSliceWidth(H->sig_width, H->num_slices, slice)) * H->partitions;
+  }
+}
+
+static void open_storage_mode_2(ISSLTable *T, FILE *fp)
+{
+  const ISSLHeader *H = &T->cfg;
+  size_t lists = total_lists(H);
+
+  int *counts = alloc_or_die(sizeof(int) * lists, "counts array");
+  read_or_die(counts, sizeof(int) * lists, fp);
+
+  // Uncompressed lists take 4 bytes per posting; the encoded size of each
+  // compressed list follows the counts
+  unsigned long long *offsets = alloc_or_die(sizeof(unsigned long long) * (lists + 1), "offsets array");
+  offsets[0] = 0;
+  for (size_t i = 0; i < lists; i++) {
+    if (H->compression == ISSL_COMPRESSION_NONE) {
+      offsets[i + 1] = offsets[i] + sizeof(int) * counts[i];
+    } else {
+      offsets[i + 1] = offsets[i] + (unsigned int)file_read32(fp);
+    }
+  }
+
+  unsigned char *postings = alloc_or_die(offsets[lists], "table");
+  read_or_die(postings, offsets[lists], fp);
+
+  T->buffers[0] = counts;
+  T->buffers[1] = offsets;
+  T->buffers[2] = postings;
+  T->postings = postings;
+  describe_slices(T, counts, offsets);
+}
+
+static void open_storage_mode_3(ISSLTable *T, FILE *fp)
+{
+  ISSLHeader *H = &T->cfg;
+  long long counts_offset = file_read64(fp);
+  long long offsets_offset = file_read64(fp);
+  long long postings_offset = file_read64(fp);
+  long long postings_size = file_read64(fp);
+  H->partitions = file_read32(fp);
+  if (H->partitions == 0) H->partitions = 1;
+  H->stopped_lists = file_read32(fp);
+  size_t lists = total_segments(H);
+  size_t stopped_offset = align_up(postings_offset + postings_size);
+
+  fseeko(fp, 0, SEEK_END);
+  size_t sz = ftello(fp);
+  if ((size_t)(postings_offset + postings_size) > sz || (size_t)offsets_offset + sizeof(unsigned long long) * (lists + 1) > sz || (H->stopped_lists > 0 && stopped_offset + sizeof(int) * 3 * H->stopped_lists > sz)) {
+    fprintf(stderr, "Error: ISSL table is truncated.\n");
+    exit(1);
+  }
+
+  unsigned char *base = NULL;
+#ifdef ISSL_HAVE_MMAP
+  base = mmap(NULL, sz, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  if (base == MAP_FAILED) {
+    base = NULL;
+  } else {
+    T->map = base;
+    T->map_size = sz;
+  }
+#endif
+  if (!base) {
+    fprintf(stderr, "Unable to memory-map ISSL table, reading it instead\n");
+    base = alloc_or_die(sz, "table");
+    rewind(fp);
+    read_or_die(base, sz, fp);
+    T->buffers[0] = base;
+  }
+
+  T->postings = base + postings_offset;
+  if (H->stopped_lists > 0) T->stopped = (const int *)(base + stopped_offset);
+  describe_slices(T, counts_offset ? (const int *)(base + counts_offset) : NULL, (const unsigned long long *)(base + offsets_offset));
+}
+
+ISSLTable *ISSLTableOpen(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open ISSL table for reading.\n");
+    exit(1);
+  }
+
+  ISSLTable *T = malloc(sizeof(ISSLTable));
+  memset(T, 0, sizeof(ISSLTable));
+  ISSLHeader *H = &T->cfg;
+  H->num_slices = file_read32(fp);
+  H->compression = file_read32(fp);
+  if (H->compression != ISSL_COMPRESSION_NONE && H->compression != ISSL_COMPRESSION_BITPACK && H->compression != ISSL_COMPRESSION_VBYTE) {
+    fprintf(stderr, "Error: compression of ISSL table not supported.\n");
+    exit(1);
+  }
+  H->storage_mode = file_read32(fp);
+  if (H->storage_mode != 2 && H->storage_mode != 3) {
+    fprintf(stderr, "Error: storage modes other than 2 and 3 not supported.\n");
+    exit(1);
+  }
+  H->signature_count = file_read32(fp);
+  H->avg_slice_width = file_read32(fp);
+  H->sig_width = file_read32(fp);
+  H->partitions = 1;
+  H->stopped_lists = 0;
+
+  if (H->storage_mode == 2) {
+    open_storage_mode_2(T, fp);
+  } else {
+    open_storage_mode_3(T, fp);
+  }
+  fclose(fp);
+  return T;
+}
+
+void ISSLTableClose(ISSLTable *T)
+{
+#ifdef ISSL_HAVE_MMAP
+  if (T->map) munmap(T->map, T->map_size);
+#endif
+  for (int i = 0; i < 3; i++) {
+    free(T->buffers[i]);
+  }
+  free(T->counts);
+  free(T->offsets);
+  free(T);
+}
+
+// Finds where each partition of a sorted list begins
+static void split_list(const ISSLHeader *H, const int *list, int count, int *bounds)
+{
+  int i = 0;
+  for (int part = 0; part < H->partitions; part++) {
+    int start = ISSLPartitionStart(H, part);
+    while (i < count && list[i] < start) i++;
+    bounds[part] = i;
+  }
+  bounds[H->partitions] = count;
+}
+
+// Whether list val of a slice is among the sorted stopped lists from *next
+// on, advancing *next past it
+static int take_stopped(const ISSLHeader *H, const int *stopped, int *next, int slice, int val)
+{
+  if (*next < H->stopped_lists && stopped[*next * 3] == slice && stopped[*next * 3 + 1] == val) {
+    (*next)++;
+    return 1;
+  }
+  return 0;
+}
+
+size_t ISSLTableWrite(const char *path, const ISSLHeader *H, int **counts, int ***lists, const int *stopped)
+{
+  if (H->partitions > 1 && H->storage_mode != 3) {
+    fprintf(stderr, "Error: only storage mode 3 ISSL tables can be partitioned.\n");
+    exit(1);
+  }
+  if (H->stopped_lists > 0 && H->storage_mode != 3) {
+    fprintf(stderr, "Error: only storage mode 3 ISSL tables can have stopped lists.\n");
+    exit(1);
+  }
+  int P = H->partitions;
+  size_t n_segs = total_segments(H);
+  int compressed = H->compression != ISSL_COMPRESSION_NONE;
+
+  // The offset of every segment is needed before the segments are written,
+  // so compressed segments are encoded once to find their sizes and again
+  // to write them out
+  unsigned long long *offsets = alloc_or_die(sizeof(unsigned long long) * (n_segs + 1), "offsets array");
+  int *seg_counts = alloc_or_die(sizeof(int) * n_segs, "counts array");
+  int max_count = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    int num_issl_lists = 1 << ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+    for (int val = 0; val < num_issl_lists; val++) {
+      if (counts[slice][val] > max_count) max_count = counts[slice][val];
+    }
+  }
+  unsigned char *encoded = compressed ? malloc(ISSLEncodeBound(H->compression, max_count)) : NULL;
+  int bounds[P + 1];
+  size_t seg = 0;
+  int next_stopped = 0;
+  offsets[0] = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    int num_issl_lists = 1 << ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+    for (int val = 0; val < num_issl_lists; val++) {
+      int count = take_stopped(H, stopped, &next_stopped, slice, val) ? 0 : counts[slice][val];
+      split_list(H, lists[slice][val], count, bounds);
+      for (int part = 0; part < P; part++) {
+        int n = bounds[part + 1] - bounds[part];
+        size_t bytes = sizeof(int) * n;
+        if (compressed) bytes = ISSLEncode(H->compression, lists[slice][val] + bounds[part], n, encoded);
+        seg_counts[seg] = n;
+        offsets[seg + 1] = offsets[seg] + bytes;
+        seg++;
+      }
+    }
+  }
+
+  FILE *fo = fopen(path, "wb");
+  if (!fo) {
+    fprintf(stderr, "Failed to write out ISSL table\n");
+    exit(1);
+  }
+  file_write32(H->num_slices, fo);
+  file_write32(H->compression, fo);
+  file_write32(H->storage_mode, fo);
+  file_write32(H->signature_count, fo);
+  file_write32(H->avg_slice_width, fo);
+  file_write32(H->sig_width, fo);
+
+  if (H->storage_mode == 3) {
+    long long counts_offset = compressed ? align_up(ISSL_HEADER_SIZE) : 0;
+    long long offsets_offset = align_up(compressed ? counts_offset + sizeof(int) * n_segs : ISSL_HEADER_SIZE);
+    long long postings_offset = align_up(offsets_offset + sizeof(unsigned long long) * (n_segs + 1));
+    file_write64(counts_offset, fo);
+    file_write64(offsets_offset, fo);
+    file_write64(postings_offset, fo);
+    file_write64(offsets[n_segs], fo);
+    file_write32(P, fo);
+    file_write32(H->stopped_lists, fo);
+    pad_to_alignment(fo);
+    if (compressed) {
+      fwrite(seg_counts, sizeof(int), n_segs, fo);
+      pad_to_alignment(fo);
+    }
+    fwrite(offsets, sizeof(unsigned long long), n_segs + 1, fo);
+    pad_to_alignment(fo);
+  } else {
+    fwrite(seg_counts, sizeof(int), n_segs, fo);
+    if (compressed) {
+      for (size_t i = 0; i < n_segs; i++) {
+        file_write32(offsets[i + 1] - offsets[i], fo);
+      }
+    }
+  }
+
+  next_stopped = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    int num_issl_lists = 1 << ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+    for (int val = 0; val < num_issl_lists; val++) {
+      int count = take_stopped(H, stopped, &next_stopped, slice, val) ? 0 : counts[slice][val];
+      split_list(H, lists[slice][val], count, bounds);
+      for (int part = 0; part < P; part++) {
+        const int *docids = lists[slice][val] + bounds[part];
+        int n = bounds[part + 1] - bounds[part];
+        if (compressed) {
+          size_t bytes = ISSLEncode(H->compression, docids, n, encoded);
+          fwrite(encoded, 1, bytes, fo);
+        } else {
+          fwrite(docids, sizeof(int), n, fo);
+        }
+      }
+    }
+  }
+  if (H->stopped_lists > 0) {
+    pad_to_alignment(fo);
+    fwrite(stopped, sizeof(int) * 3, H->stopped_lists, fo);
+  }
+  fclose(fo);
+
+  size_t postings_size = offsets[n_segs];
+  free(encoded);
+  free(seg_counts);
+  free(offsets);
+  return postings_size;
+}
+
+// Signatures whose slice values are gathered before each write
+#define SLICE_MATRIX_BLOCK 4096
+
+void ISSLSliceMatrixWrite(const char *path, const ISSLHeader *H, const unsigned char *sigs, size_t sig_stride, int count)
+{
+  int value_bytes = 2;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    if (ISSLSliceWidth(H->sig_width, H->num_slices, slice) > 16) value_bytes = 4;
+  }
+
+  FILE *fo = fopen(path, "wb");
+  if (!fo) {
+    fprintf(stderr, "Failed to write out ISSL slice matrix\n");
+    exit(1);
+  }
+  file_write32(H->num_slices, fo);
+  file_write32(H->sig_width, fo);
+  file_write32(count, fo);
+  file_write32(value_bytes, fo);
+  pad_to_alignment(fo);
+
+  int sig_bytes = H->sig_width / 8;
+  unsigned char *buf = alloc_or_die((size_t)SLICE_MATRIX_BLOCK * H->num_slices * value_bytes, "slice matrix");
+  for (int first = 0; first < count; first += SLICE_MATRIX_BLOCK) {
+    int n = count - first;
+    if (n > SLICE_MATRIX_BLOCK) n = SLICE_MATRIX_BLOCK;
+    size_t v = 0;
+    for (int doc = first; doc < first + n; doc++) {
+      const unsigned char *sig = sigs + sig_stride * doc;
+      int slice_pos = 0;
+      for (int slice = 0; slice < H->num_slices; slice++) {
+        int width = ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+        unsigned int val = ISSLSliceAt(sig, sig_bytes, slice_pos, width);
+        if (value_bytes == 2) {
+          ((unsigned short *)buf)[v++] = val;
+        } else {
+          ((unsigned int *)buf)[v++] = val;
+        }
+        slice_pos += width;
+      }
+    }
+    fwrite(buf, value_bytes, v, fo);
+  }
+  free(buf);
+  fclose(fo);
+}
+
+ISSLSliceMatrix *ISSLSliceMatrixOpen(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open ISSL slice matrix for reading.\n");
+    exit(1);
+  }
+
+  ISSLSliceMatrix *M = malloc(sizeof(ISSLSliceMatrix));
+  memset(M, 0, sizeof(ISSLSliceMatrix));
+  M->num_slices = file_read32(fp);
+  M->sig_width = file_read32(fp);
+  M->signature_count = file_read32(fp);
+  M->value_bytes = file_read32(fp);
+  if (M->value_bytes != 2 && M->value_bytes != 4) {
+    fprintf(stderr, "Error: ISSL slice matrix is invalid.\n");
+    exit(1);
+  }
+
+  size_t values_size = (size_t)M->signature_count * M->num_slices * M->value_bytes;
+  fseeko(fp, 0, SEEK_END);
+  size_t sz = ftello(fp);
+  if (ISSL_ALIGNMENT + values_size > sz) {
+    fprintf(stderr, "Error: ISSL slice matrix is truncated.\n");
+    exit(1);
+  }
+
+#ifdef ISSL_HAVE_MMAP
+  unsigned char *base = mmap(NULL, sz, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  if (base != MAP_FAILED) {
+    M->map = base;
+    M->map_size = sz;
+    M->values = base + ISSL_ALIGNMENT;
+  }
+#endif
+  if (!M->values) {
+    M->buffer = alloc_or_die(values_size, "slice matrix");
+    fseeko(fp, ISSL_ALIGNMENT, SEEK_SET);
+    read_or_die(M->buffer, values_size, fp);
+    M->values = M->buffer;
+  }
+  fclose(fp);
+  return M;
+}
+
+void ISSLSliceMatrixClose(ISSLSliceMatrix *M)
+{
+#ifdef ISSL_HAVE_MMAP
+  if (M->map) munmap(M->map, M->map_size);
+#endif
+  free(M->buffer);
+  free(M);
+}
@@ -0,0 +1,172 @@
+#ifndef TOPSIG_ISSL_TABLE_H
+#define TOPSIG_ISSL_TABLE_H
+
+#include <stddef.h>
+#include <string.h>
+#include "topsig-issl-codec.h"
+
+// Reading and writing of ISSL tables. This module does not depend on the
+// configuration system.
+//
+// A table has one posting list for every value of every slice of the
+// signatures. Every table starts with 6 32-bit fields: the number of
+// slices, the compression mode (see topsig-issl-codec.h), the storage mode,
+// the signature count, the average slice width and the signature width.
+//
+// Storage mode 2 follows them with the posting count of every list, then
+// (for compressed tables) the encoded size of every list, then the lists.
+//
+// Storage mode 3 is laid out to be mapped into memory and used in place.
+// The fields are followed by 64-bit offsets of the sections below, then
+// a 32-bit partition count (0 in tables written before partitions, which
+// have 1) and a 32-bit count of stopped lists. Each section starts on a
+// 64-byte boundary:
+//   the posting count of every segment (compressed tables only)
+//   segment-count+1 64-bit byte offsets into the postings section, so
+//     that segment i occupies offsets[i] up to offsets[i+1]
+//   the postings
+//   the slice, value and original length of every stopped list, as 32-bit
+//     fields sorted by slice and value
+// Lists are numbered by slice, then by value. Every list is split into one
+// segment per partition, a range of docids (see ISSLPartitionStart), and
+// the segments are numbered by list, then by partition. Each segment is
+// encoded on its own, so that it can be traversed without the others.
+//
+// Lists too long to be worth traversing can be stopped: they are written
+// out empty, and recorded so that searches know which documents they
+// cannot find (see ISSLStoppedList).
+//
+// A slice matrix is an optional companion file holding the value of every
+// slice of every signature, so that they need not be extracted again when
+// the signatures are used as queries. It has 4 32-bit fields: the number of
+// slices, the signature width, the signature count and the size of each
+// value (2 or 4 bytes). The values follow from byte 64, signature by
+// signature.
+
+#define ISSL_ALIGNMENT 64
+
+typedef struct {
+  int num_slices;
+  int compression;
+  int storage_mode;
+  int signature_count;
+  int avg_slice_width;
+  int sig_width;
+  int partitions;
+  int stopped_lists;
+} ISSLHeader;
+
+typedef struct {
+  ISSLHeader cfg;
+  const int **counts; // [slice][val * partitions + part], compressed tables only
+  const unsigned long long **offsets; // as counts, [slice][(1 << width) * partitions] is the end
+  const unsigned char *postings;
+  const int *stopped; // [stopped_lists][3], as in the file
+
+  void *map;
+  size_t map_size;
+  void *buffers[3];
+} ISSLTable;
+
+static inline int ISSLSliceWidth(int sig_width, int slices, int slice_n)
+{
+  int pos_start = sig_width * slice_n / slices;
+  int pos_end = sig_width * (slice_n+1) / slices;
+  return pos_end - pos_start;
+}
+
+// The value of the width-bit slice starting at bit pos of a signature of
+// sig_bytes bytes. Bit i of a signature is bit i%8 of byte i/8, so on a
+// little-endian machine a slice is a shifted and masked load of the bytes
+// holding it. Slices of 8, 16 and 32 bits that start on a byte are plain
+// loads.
+static inline unsigned int ISSLSliceAt(const unsigned char *sig, int sig_bytes, int pos, int width)
+{
+  const unsigned char *p = sig + pos / 8;
+  int shift = pos % 8;
+  if (shift == 0) {
+    if (width == 8) return p[0];
+    if (width == 16) {
+      unsigned short v;
+      memcpy(&v, p, 2);
+      return v;
+    }
+    if (width == 32) {
+      unsigned int v;
+      memcpy(&v, p, 4);
+      return v;
+    }
+  }
+  unsigned long long v = 0;
+  int avail = sig_bytes - pos / 8;
+  memcpy(&v, p, avail < 8 ? avail : 8);
+  v >>= shift;
+  return width >= 32 ? (unsigned int)v : (unsigned int)(v & ((1ULL << width) - 1));
+}
+
+// The first docid of a partition. Partition 'partitions' is the end of
+// the collection.
+static inline int ISSLPartitionStart(const ISSLHeader *H, int part)
+{
+  return (long long)H->signature_count * part / H->partitions;
+}
+
+// The encoded postings of one partition of list val of a slice, and how
+// many there are
+static inline const unsigned char *ISSLList(const ISSLTable *T, int slice, int val, int part, int *count, size_t *bytes)
+{
+  size_t seg = (size_t)val * T->cfg.partitions + part;
+  const unsigned long long *offsets = T->offsets[slice];
+  *bytes = offsets[seg + 1] - offsets[seg];
+  *count = T->cfg.compression == ISSL_COMPRESSION_NONE ? (int)(*bytes / sizeof(int)) : T->counts[slice][seg];
+  return T->postings + offsets[seg];
+}
+
+// The slice, value and original length of stopped list i
+static inline void ISSLStoppedList(const ISSLTable *T, int i, int *slice, int *val, int *count)
+{
+  *slice = T->stopped[i * 3];
+  *val = T->stopped[i * 3 + 1];
+  *count = T->stopped[i * 3 + 2];
+}
+
+// Loads a table. Storage mode 3 tables are mapped where possible, so that
+// loading takes constant time and the pages are shared between processes.
+ISSLTable *ISSLTableOpen(const char *path);
+void ISSLTableClose(ISSLTable *T);
+
+// Writes out a table in the compression, storage mode and partitions given
+// in H. Only storage mode 3 tables can have more than one partition or
+// stopped lists. lists[slice][val] holds counts[slice][val] sorted docids.
+// stopped holds H->stopped_lists entries laid out as in the file, whose
+// lists are written out empty. Returns the size of the postings.
+size_t ISSLTableWrite(const char *path, const ISSLHeader *H, int **counts, int ***lists, const int *stopped);
+
+typedef struct {
+  int num_slices;
+  int sig_width;
+  int signature_count;
+  int value_bytes;
+  const void *values;
+
+  void *map;
+  size_t map_size;
+  void *buffer;
+} ISSLSliceMatrix;
+
+static inline unsigned int ISSLSliceMatrixValue(const ISSLSliceMatrix *M, int doc, int slice)
+{
+  size_t i = (size_t)doc * M->num_slices + slice;
+  if (M->value_bytes == 2) return ((const unsigned short *)M->values)[i];
+  return ((const unsigned int *)M->values)[i];
+}
+
+// Writes the slice matrix of count signatures, sig_stride bytes apart, for
+// the slices described in H
+void ISSLSliceMatrixWrite(const char *path, const ISSLHeader *H, const unsigned char *sigs, size_t sig_stride, int count);
+
+// Loads a slice matrix, mapping it where possible
+ISSLSliceMatrix *ISSLSliceMatrixOpen(const char *path);
+void ISSLSliceMatrixClose(ISSLSliceMatrix *M);
+
+#endif
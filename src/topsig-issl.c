@@ -9,6 +9,9 @@
 #include "topsig-config.h"
 #include "topsig-search.h"
 #include "topsig-thread.h"
+#include "topsig-sigfile.h"
+#include "topsig-issl-table.h"
+#include "topsig-scoretopk.h"
 
 // Important configuration options:
 // ISL-PATH
@@ -20,149 +23,207 @@
 // SEARCH-DOC-LAST
 // SEARCH-DOC-TOPK
 // SEARCH-DOC-RERANK
+// SEARCH-DOC-GRAIN
+// ISL-COMPRESSION
+// ISL-STORAGE-MODE
+// ISL-BUILD-THREADS
+// ISL-SLICE-MATRIX-PATH
+// ISL-SCORE-TILE
+// ISL-PARTITIONS
+// ISSL-PARALLELISM
+// ISL-ADAPTIVE-RADIUS
+// ISL-MIN-DIST
+// ISL-EXACT
+// ISL-MAX-LIST-LENGTH
 
 #define DEFAULT_HOTLIST_BUFFERSIZE 2048
 
+// Docids scored at a time by each ISSL search thread. The scores of a tile
+// take 2 bytes per docid, so the default (512 KB) stays within L2.
+#define DEFAULT_SCORE_TILE 262144
+
+// The table is built by several threads, each taking an equal range of
+// docids. Each first counts the postings its range adds to every list.
+// The counts are then turned into the position in each list at which each
+// thread starts writing, so that the threads can fill the lists in
+// parallel and the postings still end up in docid order.
+
 typedef struct {
-  int header_size;
-  int max_name_len;
+  const SigBlock *sigs;
+  int num_slices;
   int sig_width;
-  int sig_offset;
-  int sig_record_size;
-} SignatureHeader;
-
-static SignatureHeader readSigHeader(FILE *fp)
-{
-  SignatureHeader cfg;
-  char sig_method[64];
-  cfg.header_size = file_read32(fp); // header_size
-  int version = file_read32(fp); // version
-  cfg.max_name_len = file_read32(fp); // max_name_len
-  cfg.sig_width = file_read32(fp); // sig_width
-  file_read32(fp); // sig_density
-  if (version >= 2) {
-    file_read32(fp); // sig_seed
-  }
-  fread(sig_method, 1, 64, fp); // sig_method
-    
-  cfg.sig_offset = cfg.max_name_len + 1;
-  cfg.sig_offset += 8 * 4; // 8 32-bit ints
-  cfg.sig_record_size = cfg.sig_offset + cfg.sig_width / 8;
-  
-  return cfg;
-}
-
-static inline int slice_width(int sig_width, int slices, int slice_n)
-{
-  int pos_start = sig_width * slice_n / slices;
-  int pos_end = sig_width * (slice_n+1) / slices;
-  return pos_end - pos_start;
-}
+  int doc_begin;
+  int doc_end;
+  const size_t *slice_first_list;
+  int *list_pos; // this thread's count, then its write position, for each list
+  const size_t *list_start;
+  int *postings;
+  int pass;
+} ISSLBuildJob;
 
-static inline int get_slice_at(const unsigned char *sig, int pos, int sw)
+static void *ISSL_Build_Job(void *input)
 {
-  int r = 0;
-  for (int bit_n = 0; bit_n < sw; bit_n++) {
-    int i = pos + bit_n;
-    r = r | ( ((sig[i / 8] & (1 << (i % 8))) > 0) << bit_n );
+  ISSLBuildJob *J = input;
+  for (int doc = J->doc_begin; doc < J->doc_end; doc++) {
+    const unsigned char *sig = SigBlockSignature(J->sigs, doc);
+    int slice_pos = 0;
+    for (int i = 0; i < J->num_slices; i++) {
+      int width = ISSLSliceWidth(J->sig_width, J->num_slices, i);
+      size_t list = J->slice_first_list[i] + ISSLSliceAt(sig, J->sig_width / 8, slice_pos, width);
+      if (J->pass == 0) {
+        J->list_pos[list]++;
+      } else {
+        J->postings[J->list_start[list] + J->list_pos[list]++] = doc;
+      }
+      slice_pos += width;
+    }
   }
-  return r;
+  return NULL;
 }
 
-static int **Count_ISSL_List_Lengths(const SignatureHeader *cfg, FILE *fp, int num_slices, int *signature_count)
+static int ***Build_ISSL_Table(const SigBlock *sigs, int sig_width, int num_slices, int threads, int ***issl_counts_out, timer *T)
 {
-  // Allocate memory for the list lengths
-  int **issl_counts = malloc(sizeof(int *) * num_slices);
-  
+  size_t slice_first_list[num_slices];
+  size_t total_lists = 0;
   for (int i = 0; i < num_slices; i++) {
-    int width = slice_width(cfg->sig_width, num_slices, i);
-    int num_issl_lists = 1 << width;
-    issl_counts[i] = malloc(sizeof(int) * num_issl_lists);
-    memset(issl_counts[i], 0, sizeof(int) * num_issl_lists);
+    slice_first_list[i] = total_lists;
+    total_lists += (size_t)1 << ISSLSliceWidth(sig_width, num_slices, i);
   }
   
-  // Rewind to just after the header
-  fseek(fp, cfg->header_size, SEEK_SET);
-  
-  unsigned char *sig_buf = malloc(cfg->sig_record_size);
-  int sig_num = 0;
-  
-  unsigned char *sig = sig_buf + cfg->sig_offset;
-  while (fread(sig_buf, cfg->sig_record_size, 1, fp) > 0) {
-    int slice_pos = 0;
-    for (int i = 0; i < num_slices; i++) {
-      int width = slice_width(cfg->sig_width, num_slices, i);
-      int val = get_slice_at(sig, slice_pos, width);
-            
-      issl_counts[i][val]++;
-      
-      slice_pos += width;
+  ISSLBuildJob jobs[threads];
+  void *job_inputs[threads];
+  for (int t = 0; t < threads; t++) {
+    jobs[t].sigs = sigs;
+    jobs[t].num_slices = num_slices;
+    jobs[t].sig_width = sig_width;
+    jobs[t].doc_begin = (long long)sigs->count * t / threads;
+    jobs[t].doc_end = (long long)sigs->count * (t + 1) / threads;
+    jobs[t].slice_first_list = slice_first_list;
+    jobs[t].list_pos = calloc(total_lists, sizeof(int));
+    jobs[t].pass = 0;
+    if (!jobs[t].list_pos) {
+      fprintf(stderr, "Ran out of memory generating ISSL table.\n");
+      exit(1);
     }
-    sig_num++;
+    job_inputs[t] = &jobs[t];
   }
-  free(sig_buf);
-    
-  *signature_count = sig_num;
   
-  return issl_counts;
-}
-
-static int ***Build_ISSL_Table(const SignatureHeader *cfg, FILE *fp, int num_slices, int **issl_counts)
-{
-  int ***issl_table = malloc(sizeof(int *) * num_slices);
+  if (threads > 1) {
+    DivideWork(job_inputs, ISSL_Build_Job, threads);
+  } else {
+    ISSL_Build_Job(&jobs[0]);
+  }
+  fprintf(stderr, "ISSL table generation: first pass - %.2fms\n", timer_tick(T));
   
+  // Prefix sums over the lists, and over the threads within each list
+  int *counts = malloc(sizeof(int) * total_lists);
+  size_t *list_start = malloc(sizeof(size_t) * total_lists);
   size_t mem_required = 0;
-  for (int i = 0; i < num_slices; i++) {
-    int width = slice_width(cfg->sig_width, num_slices, i);
-    int num_issl_lists = 1 << width;
-    issl_table[i] = malloc(sizeof(int *) * num_issl_lists);
-    
-    for (int j = 0; j < num_issl_lists; j++) {
-      mem_required += sizeof(int) * issl_counts[i][j];
+  for (size_t list = 0; list < total_lists; list++) {
+    int n = 0;
+    for (int t = 0; t < threads; t++) {
+      int c = jobs[t].list_pos[list];
+      jobs[t].list_pos[list] = n;
+      n += c;
     }
+    counts[list] = n;
+    list_start[list] = mem_required;
+    mem_required += n;
   }
   
-  int *linear_buffer = malloc(mem_required);
-
+  int *linear_buffer = malloc(sizeof(int) * mem_required);
   if (!linear_buffer) {
     fprintf(stderr, "Ran out of memory generating ISSL table.\n");
-    double mb = (double)mem_required / 1048576.0;
+    double mb = (double)(sizeof(int) * mem_required) / 1048576.0;
     fprintf(stderr, "Memory required for table: %.2f MB\n", mb);
     exit(1);
   }
-  size_t linear_buffer_pos = 0;
   
+  for (int t = 0; t < threads; t++) {
+    jobs[t].list_start = list_start;
+    jobs[t].postings = linear_buffer;
+    jobs[t].pass = 1;
+  }
+  if (threads > 1) {
+    DivideWork(job_inputs, ISSL_Build_Job, threads);
+  } else {
+    ISSL_Build_Job(&jobs[0]);
+  }
+  fprintf(stderr, "ISSL table generation: second pass - %.2fms\n", timer_tick(T));
+  
+  for (int t = 0; t < threads; t++) {
+    free(jobs[t].list_pos);
+  }
+  
+  int **issl_counts = malloc(sizeof(int *) * num_slices);
+  int ***issl_table = malloc(sizeof(int **) * num_slices);
   for (int i = 0; i < num_slices; i++) {
-    int width = slice_width(cfg->sig_width, num_slices, i);
-    int num_issl_lists = 1 << width;
+    int num_issl_lists = 1 << ISSLSliceWidth(sig_width, num_slices, i);
+    issl_counts[i] = counts + slice_first_list[i];
+    issl_table[i] = malloc(sizeof(int *) * num_issl_lists);
     for (int j = 0; j < num_issl_lists; j++) {
-      issl_table[i][j] = linear_buffer + linear_buffer_pos;
-      linear_buffer_pos += issl_counts[i][j];
+      issl_table[i][j] = linear_buffer + list_start[slice_first_list[i] + j];
     }
-    memset(issl_counts[i], 0, sizeof(int) * num_issl_lists);
   }
+  free(list_start);
   
-  // Rewind to just after the header
-  fseek(fp, cfg->header_size, SEEK_SET);
-  
-  unsigned char *sig_buf = malloc(cfg->sig_record_size);
-  unsigned char *sig = sig_buf + cfg->sig_offset;
-  int sig_num = 0;
-  while (fread(sig_buf, cfg->sig_record_size, 1, fp) > 0) {
-    int slice_pos = 0;
-    for (int i = 0; i < num_slices; i++) {
-      int width = slice_width(cfg->sig_width, num_slices, i);
-      int val = get_slice_at(sig, slice_pos, width);
-      issl_table[i][val][issl_counts[i][val]] = sig_num;
-      issl_counts[i][val]++;
-      
-      slice_pos += width;
+  *issl_counts_out = issl_counts;
+  return issl_table;
+}
+
+// Reports how the postings are spread over the lists, grouped by the
+// power of two each list's length falls under, and picks out the lists
+// longer than max_length (if it is not 0) to be stopped. Returns the
+// number of stopped lists, whose slice, value and length are written to
+// *stopped_out in the order of the table.
+static int Report_List_Skew(int num_slices, int sig_width, int **counts, int max_length, int **stopped_out)
+{
+  long long lists_at[33] = {0};
+  long long postings_at[33] = {0};
+  long long total_lists = 0, total_postings = 0, stopped_postings = 0;
+  int largest = 0, largest_slice = 0, largest_val = 0;
+  int n_stopped = 0, stopped_sz = 16;
+  int *stopped = malloc(sizeof(int) * 3 * stopped_sz);
+  for (int slice = 0; slice < num_slices; slice++) {
+    int num_issl_lists = 1 << ISSLSliceWidth(sig_width, num_slices, slice);
+    for (int val = 0; val < num_issl_lists; val++) {
+      int n = counts[slice][val];
+      int bucket = n ? 32 - __builtin_clz(n) : 0;
+      lists_at[bucket]++;
+      postings_at[bucket] += n;
+      total_lists++;
+      total_postings += n;
+      if (n > largest) {
+        largest = n;
+        largest_slice = slice;
+        largest_val = val;
+      }
+      if (max_length > 0 && n > max_length) {
+        if (n_stopped == stopped_sz) {
+          stopped_sz *= 2;
+          stopped = realloc(stopped, sizeof(int) * 3 * stopped_sz);
+        }
+        stopped[n_stopped * 3] = slice;
+        stopped[n_stopped * 3 + 1] = val;
+        stopped[n_stopped * 3 + 2] = n;
+        n_stopped++;
+        stopped_postings += n;
+      }
     }
-    sig_num++;
   }
-  free(sig_buf);
   
-  return issl_table;
+  double mean = (double)total_postings / total_lists;
+  fprintf(stderr, "ISSL list lengths: %lld lists, mean %.1f, largest %d (%.1fx mean, slice %d value %d)\n", total_lists, mean, largest, largest / mean, largest_slice, largest_val);
+  for (int bucket = 0; bucket <= 32; bucket++) {
+    if (lists_at[bucket] == 0) continue;
+    long long upper = bucket ? (1LL << bucket) - 1 : 0;
+    fprintf(stderr, "  up to %lld postings: %lld lists, %.2f%% of postings\n", upper, lists_at[bucket], 100.0 * postings_at[bucket] / total_postings);
+  }
+  if (max_length > 0) {
+    fprintf(stderr, "ISSL stopped lists: %d longer than %d, holding %.2f%% of postings\n", n_stopped, max_length, 100.0 * stopped_postings / total_postings);
+  }
+  *stopped_out = stopped;
+  return n_stopped;
 }
 
 void RunCreateISL()
@@ -181,159 +242,127 @@ void RunCreateISL()
     fprintf(stderr, "Failed to open signature file.\n");
     exit(1);
   }
-  SignatureHeader sig_cfg = readSigHeader(fp);
+  SigFileHeader sig_cfg = SigFileReadHeader(fp);
+  
+  int threads = 1;
+  if (Config("ISL-BUILD-THREADS")) {
+    threads = atoi(Config("ISL-BUILD-THREADS"));
+    if (threads <= 0) {
+      fprintf(stderr, "Error: invalid ISL-BUILD-THREADS value\n");
+      exit(1);
+    }
+  }
   
   // Number of slices is calculated as ceil(signature width / ideal slice width)
   int num_slices = (sig_cfg.sig_width + avg_slice_width - 1) / avg_slice_width;
   
-  int signature_count;
-    
   timer T = timer_start();
-  int **issl_counts = Count_ISSL_List_Lengths(&sig_cfg, fp, num_slices, &signature_count);
-    
-  fprintf(stderr, "ISSL table generation: first pass - %.2fms\n", timer_tick(&T));
-  int ***issl_table = Build_ISSL_Table(&sig_cfg, fp, num_slices, issl_counts);
-  fprintf(stderr, "ISSL table generation: second pass - %.2fms\n", timer_tick(&T));
-  fclose(fp);
   
-  // Write out ISSL table
-
-  FILE *fo = fopen(Config("ISL-PATH"), "wb");
-  if (!fo) {
-    fprintf(stderr, "Failed to write out ISSL table\n");
-    exit(1);
+  // The signatures are read through a mapping of the file where possible
+  SigBlock sigs;
+  size_t map_size;
+  unsigned char *sig_buf = NULL;
+  void *map = SigFileMap(&sig_cfg, fp, &sigs, &map_size);
+  if (!map) {
+    fseeko(fp, sig_cfg.header_size, SEEK_SET);
+    sig_buf = SigFileLoad(&sig_cfg, fp, &sigs);
   }
-  fprintf(stderr, "Writing %d signatures\n", signature_count);
+  int signature_count = sigs.count;
   
-  file_write32(num_slices, fo);
-  file_write32(0, fo); // compression
-  file_write32(2, fo); // storage mode
-  file_write32(signature_count, fo); // signatures
-  file_write32(avg_slice_width, fo); // average slice width
-  file_write32(sig_cfg.sig_width, fo); // signature width
+  int **issl_counts;
+  int ***issl_table = Build_ISSL_Table(&sigs, sig_cfg.sig_width, num_slices, threads, &issl_counts, &T);
   
-  for (int slice = 0; slice < num_slices; slice++) {
-    int width = slice_width(sig_cfg.sig_width, num_slices, slice);
-    int num_issl_lists = 1 << width;
-    
-    fwrite(issl_counts[slice], sizeof(int), num_issl_lists, fo);
-  }
-  for (int slice = 0; slice < num_slices; slice++) {
-    int width = slice_width(sig_cfg.sig_width, num_slices, slice);
-    int num_issl_lists = 1 << width;
-    
-    for (int val = 0; val < num_issl_lists; val++) {
-      fwrite(issl_table[slice][val], sizeof(int), issl_counts[slice][val], fo);
+  // Write out ISSL table
+
+  int compression = ISSL_COMPRESSION_NONE;
+  if (Config("ISL-COMPRESSION")) {
+    compression = ISSLCompressionFromName(Config("ISL-COMPRESSION"));
+    if (compression == -1) {
+      fprintf(stderr, "Error: invalid ISL-COMPRESSION value (%s)\n", Config("ISL-COMPRESSION"));
+      exit(1);
     }
   }
 
-  fclose(fo);
+  int storage_mode = 2;
+  if (Config("ISL-STORAGE-MODE")) {
+    storage_mode = atoi(Config("ISL-STORAGE-MODE"));
+    if (storage_mode != 2 && storage_mode != 3) {
+      fprintf(stderr, "Error: invalid ISL-STORAGE-MODE value (%s)\n", Config("ISL-STORAGE-MODE"));
+      exit(1);
+    }
+  }
   
-  fprintf(stderr, "ISSL table generation: writing - %.2fms\n", timer_tick(&T));
-  fprintf(stderr, "ISSL table generation: total time - %.2fms\n", get_total_time(&T));
+  int partitions = 1;
+  if (Config("ISL-PARTITIONS")) {
+    partitions = atoi(Config("ISL-PARTITIONS"));
+    if (partitions <= 0) {
+      fprintf(stderr, "Error: invalid ISL-PARTITIONS value\n");
+      exit(1);
+    }
+    if (partitions > 1 && storage_mode != 3) {
+      fprintf(stderr, "Error: ISL-PARTITIONS requires ISL-STORAGE-MODE 3\n");
+      exit(1);
+    }
+  }
   
-  free(issl_counts);
-  free(issl_table);
-}
-
-typedef struct {
-  int num_slices;
-  int compression;
-  int storage_mode;
-  int signature_count;
-  int avg_slice_width;
-  int sig_width;
-} ISSLHeader;
-
-static ISSLHeader Read_ISSL_Table(const char *path, int ***issl_counts_out, int ****issl_table_out)
-{
-  FILE *fp = fopen(path, "rb");
-  if (!fp) {
-    fprintf(stderr, "Unable to open ISSL table for reading.\n");
-    exit(1);
+  // Lists longer than this are stopped
+  int max_list_length = 0;
+  if (Config("ISL-MAX-LIST-LENGTH")) {
+    max_list_length = atoi(Config("ISL-MAX-LIST-LENGTH"));
+    if (max_list_length < 0) {
+      fprintf(stderr, "Error: invalid ISL-MAX-LIST-LENGTH value\n");
+      exit(1);
+    }
+    if (max_list_length > 0 && storage_mode != 3) {
+      fprintf(stderr, "Error: ISL-MAX-LIST-LENGTH requires ISL-STORAGE-MODE 3\n");
+      exit(1);
+    }
   }
+  int *stopped;
+  int stopped_lists = Report_List_Skew(num_slices, sig_cfg.sig_width, issl_counts, max_list_length, &stopped);
   
-  ISSLHeader cfg;
-  cfg.num_slices = file_read32(fp);
-  cfg.compression = file_read32(fp);
+  fprintf(stderr, "Writing %d signatures\n", signature_count);
   
-  if (cfg.compression != 0) {
-    fprintf(stderr, "Error: compression of ISSL table not supported.\n");
-    exit(1);
-  }
-  cfg.storage_mode = file_read32(fp);
-  if (cfg.storage_mode != 2) {
-    fprintf(stderr, "Error: storage modes other than 2 not supported.\n");
-    exit(1);
-  }
-  cfg.signature_count = file_read32(fp);
-  cfg.avg_slice_width = file_read32(fp);
-  cfg.sig_width = file_read32(fp);
+  ISSLHeader issl_cfg;
+  issl_cfg.num_slices = num_slices;
+  issl_cfg.compression = compression;
+  issl_cfg.storage_mode = storage_mode;
+  issl_cfg.signature_count = signature_count;
+  issl_cfg.avg_slice_width = avg_slice_width;
+  issl_cfg.sig_width = sig_cfg.sig_width;
+  issl_cfg.partitions = partitions;
+  issl_cfg.stopped_lists = stopped_lists;
+  size_t encoded_bytes = ISSLTableWrite(Config("ISL-PATH"), &issl_cfg, issl_counts, issl_table, stopped);
+  free(stopped);
+  size_t raw_bytes = sizeof(int) * (size_t)signature_count * num_slices;
+  
+  fprintf(stderr, "ISSL postings: %.2f MB (%s), %.2f MB uncompressed\n", (double)encoded_bytes / 1048576.0, ISSLCompressionName(compression), (double)raw_bytes / 1048576.0);
+  fprintf(stderr, "ISSL table generation: writing - %.2fms\n", timer_tick(&T));
   
-  // Allocate initial structure
-  int **issl_counts = malloc(sizeof(int *) * cfg.num_slices);
-  int ***issl_table = malloc(sizeof(int *) * cfg.num_slices);
-    
-  // Load table
-  size_t issl_counts_sz = 0;
-  for (int slice = 0; slice < cfg.num_slices; slice++) {
-    int width = slice_width(cfg.sig_width, cfg.num_slices, slice);
-    int num_issl_lists = 1 << width;
-    issl_table[slice] = malloc(sizeof(int *) * num_issl_lists);
-    
-    issl_counts_sz += sizeof(int) * num_issl_lists;
-  }
-  int *issl_counts_buffer = malloc(issl_counts_sz);
-  if (!issl_counts_buffer) {
-    double mb = (double)issl_counts_sz / 1048576.0;
-    fprintf(stderr, "Error: unable to allocate memory for ISSL counts array (%.2f MB)\n", mb);
-    exit(1);
-  }
-  size_t issl_counts_pos = 0;
-    
-  size_t issl_table_sz = 0;
-  for (int slice = 0; slice < cfg.num_slices; slice++) {
-    int width = slice_width(cfg.sig_width, cfg.num_slices, slice);
-    int num_issl_lists = 1 << width;
-    
-    issl_counts[slice] = issl_counts_buffer + issl_counts_pos;
-
-    fread(issl_counts[slice], sizeof(int), num_issl_lists, fp);
-    
-    for (int val = 0; val < num_issl_lists; val++) {
-      //fprintf(stderr, "--- %d %d\n", (int)sizeof(int), issl_counts[slice][val]);
-      issl_table_sz += sizeof(int) * issl_counts[slice][val];
-    }
-    
-    issl_counts_pos += num_issl_lists;
+  if (Config("ISL-SLICE-MATRIX-PATH")) {
+    ISSLSliceMatrixWrite(Config("ISL-SLICE-MATRIX-PATH"), &issl_cfg, sigs.sigs, sigs.sig_stride, signature_count);
+    fprintf(stderr, "ISSL table generation: slice matrix - %.2fms\n", timer_tick(&T));
   }
-    
-  int *issl_table_buffer = malloc(issl_table_sz);
-  if (!issl_table_buffer) {
-    double mb = (double)issl_table_sz / 1048576.0;
-    fprintf(stderr, "Error: unable to allocate memory for ISSL table (%.2f MB)\n", mb);
-    exit(1);
+  fprintf(stderr, "ISSL table generation: total time - %.2fms\n", get_total_time(&T));
+  
+  if (map) {
+    SigFileUnmap(map, map_size);
   }
-  size_t issl_table_pos = 0;
-  for (int slice = 0; slice < cfg.num_slices; slice++) {
-    int width = slice_width(cfg.sig_width, cfg.num_slices, slice);
-    int num_issl_lists = 1 << width;
-
-    for (int val = 0; val < num_issl_lists; val++) {
-      issl_table[slice][val] = issl_table_buffer + issl_table_pos;
-      fread(issl_table[slice][val], sizeof(int), issl_counts[slice][val], fp);
-      issl_table_pos += issl_counts[slice][val];
-    }
-  }  
+  free(sig_buf);
   fclose(fp);
   
-  *issl_counts_out = issl_counts;
-  *issl_table_out = issl_table;
-  
-  return cfg;
+  free(issl_table[0][0]);
+  free(issl_counts[0]);
+  for (int i = 0; i < num_slices; i++) {
+    free(issl_table[i]);
+  }
+  free(issl_counts);
+  free(issl_table);
 }
 
-static SignatureHeader Read_Signature_File(const char *path, unsigned char **buf, int sigs)
+// The signatures are mapped where possible, as with the ISSL table, and
+// read into buf otherwise
+static SigFileHeader Read_Signature_File(const char *path, SigBlock *block, unsigned char **buf, void **map, size_t *map_size)
 {
   FILE *fp = fopen(path, "rb");
   if (!fp) {
@@ -341,17 +370,14 @@ static SignatureHeader Read_Signature_File(const char *path, unsigned char **buf
     exit(1);
   }
   
-  SignatureHeader cfg = readSigHeader(fp);
-  unsigned char *buffer = malloc((size_t)cfg.sig_record_size * sigs);
-  if (!buffer) {
-    double mb = (double)((size_t)cfg.sig_record_size * sigs) / 1048576.0;
-    fprintf(stderr, "Error: unable to allocate memory to store signature file (%.2f MB)\n", mb);
-    exit(1);
+  SigFileHeader cfg = SigFileReadHeader(fp);
+  *buf = NULL;
+  *map = SigFileMap(&cfg, fp, block, map_size);
+  if (!*map) {
+    fseeko(fp, cfg.header_size, SEEK_SET);
+    *buf = SigFileLoad(&cfg, fp, block);
   }
-  
-  fread(buffer, cfg.sig_record_size, sigs, fp);
   fclose(fp);
-  *buf = buffer;
   return cfg;
 }
 
@@ -423,44 +449,21 @@ static void Output_Results(int topic_id, const ResultList *list, int top_k)
   }
 }
 
-ResultList Summarise(ScoreTable **scts, int scts_n, int top_k, int threadid)
+// Passes the scores of a tile to the top-k selection and clears them for
+// the next tile. If a query signature is given, the docids are instead
+// scored by sig_width less their Hamming distance from it.
+static void Summarise_Tile(ScoreTopK *top, ScoreTable *sct, int tile_begin, const SigBlock *sigs, const unsigned char *query_sig, int sig_width)
 {
-  int R_lowest_score = 0;
-  int R_lowest_score_i = 0;
-  
-  if (scts[0]->score_hotlist_n < top_k) {
-    //fprintf(stderr, "%d Error: not enough entries in hotlist (%d) to make up topk (%d). Reduce topk and try again.\n", threadid, scts[0]->score_hotlist_n, top_k);
-    //exit(1);
-    top_k = scts[0]->score_hotlist_n;
-  }
-  
-  ResultList R = Create_Result_List(top_k);
-  for (int sct_i = 0; sct_i < scts_n; sct_i++) {
-    ScoreTable *sct = scts[sct_i];
-  
-    for (int i = 0; i < sct->score_hotlist_n; i++) {
-      int docid = sct->score_hotlist[i];
-      int score = sct->score[docid];
-      
-      if (score > R_lowest_score) {
-        R.docids[R_lowest_score_i] = docid;
-        R.issl_scores[R_lowest_score_i] = score;
-        
-        R_lowest_score = INT_MAX;
-        for (int j = 0; j < R.results; j++) {
-          if (R.issl_scores[j] < R_lowest_score) {
-            R_lowest_score = R.issl_scores[j];
-            R_lowest_score_i = j;
-          }
-        }
-      }
-      
-      sct->score[docid] = 0;
+  for (int i = 0; i < sct->score_hotlist_n; i++) {
+    int doc = sct->score_hotlist[i];
+    int score = sct->score[doc];
+    if (query_sig) {
+      score = sig_width - DocumentDistanceUnmasked(sig_width, query_sig, SigBlockSignature(sigs, tile_begin + doc));
     }
-    sct->score_hotlist_n = 0;
+    ScoreTopKAdd(top, tile_begin + doc, score);
+    sct->score[doc] = 0;
   }
-  
-  return R;
+  sct->score_hotlist_n = 0;
 }
 
 typedef struct {
@@ -475,11 +478,12 @@ static int clarify_compar(const void *A, const void *B)
   
   const ResultList *list = a->list;
   
-  return list->distances[a->i] - list->distances[b->i];
+  if (list->distances[a->i] != list->distances[b->i]) return list->distances[a->i] - list->distances[b->i];
+  return list->docids[a->i] - list->docids[b->i];
 }
 
 
-static void ISSLPseudo(const SignatureHeader *cfg, ResultList *list, const unsigned char *sig_file, unsigned char *sig_out, int sample)
+static void ISSLPseudo(const SigFileHeader *cfg, ResultList *list, const SigBlock *sigs, unsigned char *sig_out, int sample)
 {
     double dsig[cfg->sig_width];
     memset(&dsig, 0, cfg->sig_width * sizeof(double));
@@ -487,7 +491,7 @@ static void ISSLPseudo(const SignatureHeader *cfg, ResultList *list, const unsig
     
     for (int i = 0; i < sample; i++) {
         double di = i;
-        const unsigned char *cursig = sig_file + (size_t)cfg->sig_record_size * list->docids[i] + cfg->sig_offset;
+        const unsigned char *cursig = SigBlockSignature(sigs, list->docids[i]);
         for (int j = 0; j < cfg->sig_width; j++) {
             dsig[j] += exp(-di*di/sample_2) * ((cursig[j/8] & (1 << (7 - (j%8))))>0?1.0:-1.0); 
         }
@@ -504,24 +508,19 @@ static void ISSLPseudo(const SignatureHeader *cfg, ResultList *list, const unsig
     SignatureDestroy(sig);    
 }
 
-static void Clarify_Results(const SignatureHeader *cfg, ResultList *list, const unsigned char *sig_file, const unsigned char *sig, int top_k)
+static void Clarify_Results(const SigFileHeader *cfg, ResultList *list, const SigBlock *sigs, const unsigned char *sig, int top_k)
 {
   if (top_k == -1) top_k = list->results;
   if (top_k > list->results) top_k = list->results;
-  static unsigned char *mask = NULL;
-  if (!mask) {
-    mask = malloc(cfg->sig_width / 8);
-    memset(mask, 0xFF, cfg->sig_width / 8);
-  }
   
   //list->docnames = malloc(sizeof(char *) * list->results);
   
   ClarifyEntry *clarify = malloc(sizeof(ClarifyEntry) * top_k);
   
   for (int i = 0; i < top_k; i++) {
-    const unsigned char *cursig = sig_file + ((size_t)cfg->sig_record_size * list->docids[i] + cfg->sig_offset);
-    list->distances[i] = DocumentDistance(cfg->sig_width, sig, mask, cursig);
-    list->docnames[i] = (const char *)(sig_file + ((size_t)cfg->sig_record_size * list->docids[i]));
+    const unsigned char *cursig = SigBlockSignature(sigs, list->docids[i]);
+    list->distances[i] = DocumentDistanceUnmasked(cfg->sig_width, sig, cursig);
+    list->docnames[i] = SigBlockDocid(sigs, list->docids[i]);
     
     clarify[i].list = list;
     clarify[i].i = i;
@@ -555,26 +554,268 @@ static inline int count_bits(unsigned int v) {
   return (((v + (v >> 4)) & 0xF0F0F0F) * 0x1010101) >> 24;
 }
 
-static void Traverse_ISSL(const int *count, int * const *issl, ScoreTable *scores, const int *variants, int n_variants_ceasenew, int n_variants, int val, int slice_width)
+static inline void add_score(ScoreTable *scores, int docid, int score)
 {
+  if (scores->score[docid] == 0) {
+    if (scores->score_hotlist_n == scores->score_hotlist_sz) {
+      scores->score_hotlist_sz *= 2;
+      scores->score_hotlist = realloc(scores->score_hotlist, sizeof(scores->score_hotlist[0]) * scores->score_hotlist_sz);
+    }
+    scores->score_hotlist[scores->score_hotlist_n++] = docid;
+  }
+  scores->score[docid] += score;
+}
+
+// A posting list being traversed, and the score it adds to each docid
+typedef struct {
+  int score;
+  int count;
+  int pos;
+  const int *docids;
+  // Compressed lists are decoded a block at a time into block
+  ISSLListReader reader;
+  int *block;
+} ListCursor;
+
+// Starts cursors on one partition of the lists of the first n_variants
+// variants of a slice value, returning the number started
+static int Open_ISSL_Cursors(const ISSLTable *table, int slice, int part, ListCursor *cursors, const int *variants, int n_variants, int val, int slice_width)
+{
+  int compression = table->cfg.compression;
   int limit = 1 << slice_width;
+  int n = 0;
   for (int variant = 0; variant < n_variants; variant++) {
-    if (variant >= n_variants_ceasenew) break;
-    int score = slice_width - count_bits(variants[variant]);
     int value = val ^ variants[variant];
     if (value >= limit) continue;
-    for (int i = 0; i < count[value]; i++) {
-      int docid = issl[value][i];
-      if (scores->score[docid] == 0) {
-        if (scores->score_hotlist_n == scores->score_hotlist_sz) {
-          scores->score_hotlist_sz *= 2;
-          scores->score_hotlist = realloc(scores->score_hotlist, sizeof(scores->score_hotlist[0]) * scores->score_hotlist_sz);
-        }
-        scores->score_hotlist[scores->score_hotlist_n++] = docid;
+    ListCursor *C = &cursors[n];
+    size_t bytes;
+    const unsigned char *list = ISSLList(table, slice, value, part, &C->count, &bytes);
+    if (C->count == 0) continue;
+    C->score = slice_width - count_bits(variants[variant]);
+    C->pos = 0;
+    if (compression == ISSL_COMPRESSION_NONE) {
+      C->docids = (const int *)list;
+    } else {
+      ISSLListOpen(&C->reader, compression, list, bytes, C->count);
+      C->count = ISSLListNext(&C->reader, C->block);
+      C->docids = C->block;
+    }
+    n++;
+  }
+  return n;
+}
+
+// Scores the postings of every list that fall within the tile beginning
+// at tile_begin and ending before tile_end. The cursors are left at the
+// first posting of the next tile.
+static void Traverse_ISSL_Tile(ListCursor *cursors, int n_cursors, ScoreTable *scores, int tile_begin, int tile_end)
+{
+  for (int c = 0; c < n_cursors; c++) {
+    ListCursor *C = &cursors[c];
+    for (;;) {
+      int i = C->pos;
+      while (i < C->count && C->docids[i] < tile_end) {
+        add_score(scores, C->docids[i] - tile_begin, C->score);
+        i++;
+      }
+      C->pos = i;
+      if (i < C->count || C->docids != C->block) break;
+      // The decoded block is exhausted; decode the next one
+      C->count = ISSLListNext(&C->reader, C->block);
+      C->pos = 0;
+      if (C->count == 0) break;
+    }
+  }
+}
+
+// Largest probe radius that statistics are kept for
+#define MAX_PROBE_RADIUS 32
+
+// What a search visits and how it is scored. Variants of each slice value
+// are probed up to a radius (the number of bits they differ by), starting
+// from min_radius and widening until the search has top_k candidates or
+// max_radius is reached.
+//
+// Exact searches score every candidate by its Hamming distance instead,
+// and widen until the exact_k-th best is provably among the nearest (see
+// Unseen_Distance_Bound).
+typedef struct {
+  const ISSLTable *table;
+  const int *variants; // sorted by the number of bits set
+  const int *radius_variants; // [r], variants within radius r
+  int min_radius;
+  int max_radius;
+  int top_k;
+  int score_tile;
+  int exact_k; // 0 unless searches are exact
+  const SigBlock *sigs;
+} ISSLSearchParams;
+
+typedef struct {
+  long long searches_at_radius[MAX_PROBE_RADIUS + 1];
+  long long passes;
+  long long lists_scored;
+  long long short_results;
+  long long proven_exact;
+} ProbeStats;
+
+// The working space of a thread scoring searches
+typedef struct {
+  ScoreTable scores;
+  ListCursor *cursors;
+  ScoreTopK top;
+} ISSLScorer;
+
+static void Create_Scorer(ISSLScorer *S, const ISSLSearchParams *P, int top_k)
+{
+  const ISSLHeader *H = &P->table->cfg;
+  S->scores = Create_Score_Table(P->score_tile);
+  // A cursor on every list a search can visit in a partition
+  int max_cursors = H->num_slices * P->radius_variants[P->max_radius];
+  S->cursors = malloc(sizeof(ListCursor) * max_cursors);
+  for (int c = 0; c < max_cursors; c++) {
+    S->cursors[c].block = H->compression == ISSL_COMPRESSION_NONE ? NULL : malloc(sizeof(int) * ISSL_BLOCK);
+  }
+  ScoreTopKInit(&S->top, top_k, H->sig_width);
+}
+
+static void Destroy_Scorer(ISSLScorer *S, const ISSLSearchParams *P)
+{
+  const ISSLHeader *H = &P->table->cfg;
+  int max_cursors = H->num_slices * P->radius_variants[P->max_radius];
+  Destroy_Score_Table(&S->scores);
+  for (int c = 0; c < max_cursors; c++) {
+    free(S->cursors[c].block);
+  }
+  free(S->cursors);
+  ScoreTopKFree(&S->top);
+}
+
+// Scores the docids of partitions part_begin up to part_end against the
+// slice values of a query, probing to the given radius, and passes them to
+// S->top. The partitions are scored one tile of docids at a time so that
+// the scores being added to stay in cache. Returns the number of docids
+// scored.
+static int Score_ISSL_Partitions(const ISSLSearchParams *P, const unsigned char *sig, const int *slice_vals, int radius, int part_begin, int part_end, ISSLScorer *S)
+{
+  const unsigned char *query_sig = P->exact_k > 0 ? sig : NULL;
+  const ISSLHeader *H = &P->table->cfg;
+  int candidates = 0;
+  for (int part = part_begin; part < part_end; part++) {
+    int n_cursors = 0;
+    for (int slice = 0; slice < H->num_slices; slice++) {
+      int width = ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+      n_cursors += Open_ISSL_Cursors(P->table, slice, part, S->cursors + n_cursors, P->variants, P->radius_variants[radius], slice_vals[slice], width);
+    }
+    int doc_end = ISSLPartitionStart(H, part + 1);
+    for (int tile_begin = ISSLPartitionStart(H, part); tile_begin < doc_end; tile_begin += P->score_tile) {
+      int tile_end = tile_begin + P->score_tile;
+      if (tile_end > doc_end) tile_end = doc_end;
+      Traverse_ISSL_Tile(S->cursors, n_cursors, &S->scores, tile_begin, tile_end);
+      candidates += S->scores.score_hotlist_n;
+      Summarise_Tile(&S->top, &S->scores, tile_begin, P->sigs, query_sig, H->sig_width);
+    }
+  }
+  return candidates;
+}
+
+// An upper bound on the number of candidates a search probing to the given
+// radius finds: the total length of the lists it visits
+static long long Candidate_Bound(const ISSLSearchParams *P, const int *slice_vals, int radius)
+{
+  const ISSLHeader *H = &P->table->cfg;
+  long long bound = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    int width = ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+    for (int variant = 0; variant < P->radius_variants[radius]; variant++) {
+      int value = slice_vals[slice] ^ P->variants[variant];
+      if (value >= (1 << width)) continue;
+      for (int part = 0; part < H->partitions; part++) {
+        int count;
+        size_t bytes;
+        ISSLList(P->table, slice, value, part, &count, &bytes);
+        bound += count;
       }
-      scores->score[docid] += score;
     }
   }
+  return bound;
+}
+
+// The radius a search starts scoring at: the first at which it could find
+// top_k candidates
+static int First_Radius(const ISSLSearchParams *P, const int *slice_vals)
+{
+  int radius = P->min_radius;
+  while (radius < P->max_radius && Candidate_Bound(P, slice_vals, radius) < P->top_k) {
+    radius++;
+  }
+  return radius;
+}
+
+// By pigeonhole, a docid that has not been seen after probing to the given
+// radius differs from the query by more than radius bits in every slice,
+// so its distance is at least this. The exception is a docid in a stopped
+// list within the radius, which differs by only as many bits as that
+// list's value does.
+static int Unseen_Distance_Bound(const ISSLTable *table, const int *slice_vals, int radius)
+{
+  const ISSLHeader *H = &table->cfg;
+  int slice_bound[H->num_slices];
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    int width = ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+    slice_bound[slice] = width < radius + 1 ? width : radius + 1;
+  }
+  for (int i = 0; i < H->stopped_lists; i++) {
+    int slice, val, count;
+    ISSLStoppedList(table, i, &slice, &val, &count);
+    int bits = count_bits(val ^ slice_vals[slice]);
+    if (bits < slice_bound[slice]) slice_bound[slice] = bits;
+  }
+  int bound = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    bound += slice_bound[slice];
+  }
+  return bound;
+}
+
+// Whether a search probed to the given radius can stop widening. An exact
+// search can once its exact_k-th best candidate is no further away than
+// any unseen docid can be, which is stored in *proven.
+static int Search_Complete(const ISSLSearchParams *P, const int *slice_vals, const ScoreTopK *top, int radius, int candidates, int *proven)
+{
+  *proven = 0;
+  if (P->exact_k > 0) {
+    const ISSLHeader *H = &P->table->cfg;
+    int kth = ScoreTopKKth(top, P->exact_k);
+    *proven = kth > 0 && H->sig_width - kth <= Unseen_Distance_Bound(P->table, slice_vals, radius);
+    return *proven || radius == P->max_radius;
+  }
+  return candidates >= P->top_k || radius == P->max_radius;
+}
+
+static void Record_Search(ProbeStats *stats, const ISSLSearchParams *P, int radius, int candidates, int proven)
+{
+  const ISSLHeader *H = &P->table->cfg;
+  stats->searches_at_radius[radius < MAX_PROBE_RADIUS ? radius : MAX_PROBE_RADIUS]++;
+  stats->passes++;
+  stats->lists_scored += (long long)H->num_slices * P->radius_variants[radius];
+  if (candidates < P->top_k) stats->short_results++;
+  stats->proven_exact += proven;
+}
+
+// The slice values of signature doc, from the slice matrix if there is one
+static void Query_Slice_Values(const ISSLHeader *H, const ISSLSliceMatrix *slice_matrix, const unsigned char *sig, int doc, int *slice_vals)
+{
+  int slice_pos = 0;
+  for (int slice = 0; slice < H->num_slices; slice++) {
+    int width = ISSLSliceWidth(H->sig_width, H->num_slices, slice);
+    if (slice_matrix) {
+      slice_vals[slice] = ISSLSliceMatrixValue(slice_matrix, doc, slice);
+    } else {
+      slice_vals[slice] = ISSLSliceAt(sig, H->sig_width / 8, slice_pos, width);
+    }
+    slice_pos += width;
+  }
 }
 
 static int bitcount_compar(const void *A, const void *B)
@@ -595,86 +836,252 @@ static inline int variants_threshold(const int *variants, int n_variants, int th
   return n_variants;
 }
 
+// In query mode the searches are spread over the threads of a
+// work-stealing pool, a few at a time, and each result list is kept until
+// all are done so that they can be written out in order
 typedef struct {
-  const SignatureHeader *sig_cfg;
+  const SigFileHeader *sig_cfg;
   const ISSLHeader *issl_cfg;
 
-  const unsigned char *sig_file;
-  int doc_begin;
-  int doc_end;
-  int * const *issl_counts;
-  int ** const *issl_table;
-  //ScoreTable scores;
-  struct {
-    int *variants;
-    int n_variants_stopearly;
-    int n_variants_ceasenew;
-  } v;
+  const SigBlock *sigs;
+  int doc_first;
+  const ISSLSearchParams *params;
+  const ISSLSliceMatrix *slice_matrix;
   int top_k;
-  ResultList *output;
+  ResultList *output; // [doc - doc_first]
 } Worker_Throughput;
 
 typedef struct {
   int threadid;
-  ScoreTable scores;
+  const Worker_Throughput *search;
+  ISSLScorer scorer;
+  ProbeStats stats;
+  unsigned char *pseudo_sig;
 } Worker_Throughput_perthread;
 
-static void *Throughput_Job(void *input, void *thread_data)
+static void Throughput_Job(int begin, int end, void *thread_data)
 {
-  Worker_Throughput *T = input;
   Worker_Throughput_perthread *TP = thread_data;
+  const Worker_Throughput *T = TP->search;
   
-  int doc_count = T->doc_end - T->doc_begin;
-  
-  const SignatureHeader *sig_cfg = T->sig_cfg;
+  const SigFileHeader *sig_cfg = T->sig_cfg;
   const ISSLHeader *issl_cfg = T->issl_cfg;
-  const unsigned char *sig_file = T->sig_file;
-  int * const *issl_counts = T->issl_counts;
-  int ** const *issl_table = T->issl_table;
-  int *variants = T->v.variants;
-  int n_variants_stopearly = T->v.n_variants_stopearly;
-  int n_variants_ceasenew = T->v.n_variants_ceasenew;
-  T->output = malloc(sizeof(ResultList) * doc_count);
+  const SigBlock *sigs = T->sigs;
   int top_k = T->top_k;
-  unsigned char *pseudo_sig = malloc(sig_cfg->sig_record_size);
   
-  ScoreTable *scores = &TP->scores;
-  
-  int doc_i = 0;
-  for (int doc_cmp = T->doc_begin; doc_cmp < T->doc_end; doc_cmp++) {
-    const unsigned char *sig = sig_file + (size_t)sig_cfg->sig_record_size * doc_cmp + sig_cfg->sig_offset;
-    int slice_pos = 0;
-    for (int slice = 0; slice < issl_cfg->num_slices; slice++) {
-      int width = slice_width(issl_cfg->sig_width, issl_cfg->num_slices, slice);
-      int val = get_slice_at(sig, slice_pos, width);
-      //fprintf(stderr, "Slice %d val %d (@%d,%d)\n", slice, val, slice_pos, width);
-      Traverse_ISSL(issl_counts[slice], issl_table[slice], scores, variants, n_variants_ceasenew, n_variants_stopearly, val, width);
-      slice_pos += width;
-      //fprintf(stderr, "Score of cmp: %d\n", scores.score[doc_cmp]);
-
+  ISSLScorer *S = &TP->scorer;
+  int slice_vals[issl_cfg->num_slices];
+  
+  for (int doc_i = begin; doc_i < end; doc_i++) {
+    int doc_cmp = T->doc_first + doc_i;
+    const unsigned char *sig = SigBlockSignature(sigs, doc_cmp);
+    Query_Slice_Values(issl_cfg, T->slice_matrix, sig, doc_cmp, slice_vals);
+    // Widen the search until it has enough candidates
+    int radius = First_Radius(T->params, slice_vals);
+    int candidates, proven;
+    for (;;) {
+      candidates = Score_ISSL_Partitions(T->params, sig, slice_vals, radius, 0, issl_cfg->partitions, S);
+      if (Search_Complete(T->params, slice_vals, &S->top, radius, candidates, &proven)) break;
+      ScoreTopKClear(&S->top);
+      TP->stats.passes++;
+      radius++;
     }
-    
-    ScoreTable *sct[1] = {scores};
-    T->output[doc_i] = Summarise(sct, 1, top_k, TP->threadid);
-    Clarify_Results(sig_cfg, &T->output[doc_i], sig_file, sig, -1);
+    Record_Search(&TP->stats, T->params, radius, candidates, proven);
+    ResultList R = Create_Result_List(top_k);
+    R.results = ScoreTopKFinish(&S->top, R.docids, R.issl_scores);
+    T->output[doc_i] = R;
+    Clarify_Results(sig_cfg, &T->output[doc_i], sigs, sig, -1);
     if (0) {
-      ISSLPseudo(sig_cfg, &T->output[doc_i], sig_file, pseudo_sig, 3);
-      Clarify_Results(sig_cfg, &T->output[doc_i], sig_file, pseudo_sig, 10);
+      ISSLPseudo(sig_cfg, &T->output[doc_i], sigs, TP->pseudo_sig, 3);
+      Clarify_Results(sig_cfg, &T->output[doc_i], sigs, TP->pseudo_sig, 10);
     }
-    doc_i++;
   }
+}
+
+static void Add_Probe_Stats(ProbeStats *total, const ProbeStats *stats)
+{
+  for (int r = 0; r <= MAX_PROBE_RADIUS; r++) {
+    total->searches_at_radius[r] += stats->searches_at_radius[r];
+  }
+  total->passes += stats->passes;
+  total->lists_scored += stats->lists_scored;
+  total->short_results += stats->short_results;
+  total->proven_exact += stats->proven_exact;
+}
+
+// Searches for documents first to last, several at once on the threads of
+// a pool, each thread taking up to grain searches at a time
+static void Search_Throughput(const ISSLSearchParams *params, const SigFileHeader *sig_cfg, const SigBlock *sigs, const ISSLSliceMatrix *slice_matrix, int search_doc_first, int search_doc_last, int thread_count, int grain, int top_k_rerank, int top_k_present, ProbeStats *stats)
+{
+  int total_docs = search_doc_last - search_doc_first + 1;
+  Worker_Throughput search;
+  search.sig_cfg = sig_cfg;
+  search.issl_cfg = &params->table->cfg;
+  search.sigs = sigs;
+  search.doc_first = search_doc_first;
+  search.params = params;
+  search.slice_matrix = slice_matrix;
+  search.top_k = top_k_rerank;
+  search.output = malloc(sizeof(ResultList) * total_docs);
+  void **threaddata = malloc(sizeof(void *) * thread_count);
+  for (int i = 0; i < thread_count; i++) {
+    Worker_Throughput_perthread *per_thread_data = malloc(sizeof(Worker_Throughput_perthread));
+    per_thread_data->threadid = i;
+    per_thread_data->search = &search;
+    Create_Scorer(&per_thread_data->scorer, params, top_k_rerank);
+    memset(&per_thread_data->stats, 0, sizeof(ProbeStats));
+    per_thread_data->pseudo_sig = malloc(sig_cfg->sig_bytes);
+    threaddata[i] = per_thread_data;
+  }
+  
+  DivideRangeWS(total_docs, grain, threaddata, Throughput_Job, thread_count);
   
+  for (int i = 0; i < total_docs; i++) {
+    Output_Results(search_doc_first + i, &search.output[i], top_k_present);
+    Destroy_Result_List(&search.output[i]);
+  }
+  
+  for (int i = 0; i < thread_count; i++) {
+    Worker_Throughput_perthread *per_thread_data = threaddata[i];
+    Add_Probe_Stats(stats, &per_thread_data->stats);
+    Destroy_Scorer(&per_thread_data->scorer, params);
+    free(per_thread_data->pseudo_sig);
+    free(threaddata[i]);
+  }
+  free(search.output);
+  free(threaddata);
+}
+
+// In intra-query mode each thread of a pool takes a share of the
+// partitions of the table and finds its own top-k for every search, which
+// are then merged
+typedef struct {
+  int part_begin;
+  int part_end;
+  ISSLScorer scorer;
+  int candidates;
+  int n;
+  int *docids;
+  int *scores;
+} Worker_Intra;
+
+typedef struct {
+  const ISSLSearchParams *params;
+  const unsigned char *sig;
+  const int *slice_vals;
+  int radius;
+} Intra_Search;
+
+static void *Intra_Job(void *thread_data, void *task_data)
+{
+  Worker_Intra *W = thread_data;
+  Intra_Search *Q = task_data;
+  W->candidates = Score_ISSL_Partitions(Q->params, Q->sig, Q->slice_vals, Q->radius, W->part_begin, W->part_end, &W->scorer);
+  W->n = ScoreTopKFinish(&W->scorer.top, W->docids, W->scores);
   return NULL;
 }
 
-void RunSearchISLTurbo()
+// Searches for documents first to last one at a time, each spread over
+// the threads of a pool, writing out the results of each as it finishes
+static void Search_Intra(const ISSLSearchParams *params, const SigFileHeader *sig_cfg, const SigBlock *sigs, const ISSLSliceMatrix *slice_matrix, int search_doc_first, int search_doc_last, int thread_count, int top_k_rerank, int top_k_present, ProbeStats *stats)
 {
-  int **issl_counts;
-  int ***issl_table;
+  const ISSLHeader *issl_cfg = &params->table->cfg;
+  if (thread_count > issl_cfg->partitions) {
+    fprintf(stderr, "ISSL table has %d partitions, so only %d threads can search it. Create it with a larger ISL-PARTITIONS to use more.\n", issl_cfg->partitions, issl_cfg->partitions);
+    thread_count = issl_cfg->partitions;
+  }
   
-  ISSLHeader issl_cfg = Read_ISSL_Table(Config("ISL-PATH"), &issl_counts, &issl_table);
+  void **threaddata = malloc(sizeof(void *) * thread_count);
+  for (int i = 0; i < thread_count; i++) {
+    Worker_Intra *W = malloc(sizeof(Worker_Intra));
+    W->part_begin = issl_cfg->partitions * i / thread_count;
+    W->part_end = issl_cfg->partitions * (i + 1) / thread_count;
+    Create_Scorer(&W->scorer, params, top_k_rerank);
+    W->docids = malloc(sizeof(int) * top_k_rerank);
+    W->scores = malloc(sizeof(int) * top_k_rerank);
+    threaddata[i] = W;
+  }
+  TBPHandle *pool = TBPInit(thread_count, threaddata);
+  
+  // Each thread keeps the lowest of equally scored docids, as the merge
+  // does, so the results are the same as in query mode
+  ScoreTopK merged;
+  ScoreTopKInit(&merged, top_k_rerank, issl_cfg->sig_width);
+  int slice_vals[issl_cfg->num_slices];
+  Intra_Search Q;
+  Q.params = params;
+  Q.slice_vals = slice_vals;
+  for (int doc = search_doc_first; doc <= search_doc_last; doc++) {
+    const unsigned char *sig = SigBlockSignature(sigs, doc);
+    Query_Slice_Values(issl_cfg, slice_matrix, sig, doc, slice_vals);
+    Q.sig = sig;
+    // Widen the search until it has enough candidates
+    Q.radius = First_Radius(params, slice_vals);
+    int candidates, proven;
+    for (;;) {
+      TBPDivideWork(pool, &Q, Intra_Job);
+      candidates = 0;
+      for (int i = 0; i < thread_count; i++) {
+        Worker_Intra *W = threaddata[i];
+        candidates += W->candidates;
+        for (int j = 0; j < W->n; j++) {
+          ScoreTopKAdd(&merged, W->docids[j], W->scores[j]);
+        }
+      }
+      if (Search_Complete(params, slice_vals, &merged, Q.radius, candidates, &proven)) break;
+      ScoreTopKClear(&merged);
+      stats->passes++;
+      Q.radius++;
+    }
+    Record_Search(stats, params, Q.radius, candidates, proven);
+    ResultList R = Create_Result_List(top_k_rerank);
+    R.results = ScoreTopKFinish(&merged, R.docids, R.issl_scores);
+    Clarify_Results(sig_cfg, &R, sigs, sig, -1);
+    Output_Results(doc, &R, top_k_present);
+    Destroy_Result_List(&R);
+  }
+  
+  TBPClose(pool);
+  ScoreTopKFree(&merged);
+  for (int i = 0; i < thread_count; i++) {
+    Worker_Intra *W = threaddata[i];
+    Destroy_Scorer(&W->scorer, params);
+    free(W->docids);
+    free(W->scores);
+    free(W);
+  }
+  free(threaddata);
+}
+
+void RunSearchISLTurbo()
+{
+  timer T = timer_start();
+  ISSLTable *table = ISSLTableOpen(Config("ISL-PATH"));
+  ISSLHeader issl_cfg = table->cfg;
   unsigned char *sig_file;
-  SignatureHeader sig_cfg = Read_Signature_File(Config("SIGNATURE-PATH"), &sig_file, issl_cfg.signature_count);
+  void *sig_map;
+  size_t sig_map_size;
+  SigBlock sigs;
+  SigFileHeader sig_cfg = Read_Signature_File(Config("SIGNATURE-PATH"), &sigs, &sig_file, &sig_map, &sig_map_size);
+  fprintf(stderr, "load time %.2fms\n", timer_tick(&T));
+  if (issl_cfg.stopped_lists > 0) {
+    fprintf(stderr, "ISSL table has %d stopped lists\n", issl_cfg.stopped_lists);
+  }
+  if (sig_cfg.num_signatures < issl_cfg.signature_count) {
+    fprintf(stderr, "Error: signature file contains fewer signatures than the ISSL table.\n");
+    exit(1);
+  }
+  
+  // Slice values of the query signatures can be taken from a slice matrix
+  // instead of being extracted from each signature
+  ISSLSliceMatrix *slice_matrix = NULL;
+  if (Config("ISL-SLICE-MATRIX-PATH")) {
+    slice_matrix = ISSLSliceMatrixOpen(Config("ISL-SLICE-MATRIX-PATH"));
+    if (slice_matrix->num_slices != issl_cfg.num_slices || slice_matrix->sig_width != issl_cfg.sig_width || slice_matrix->signature_count < issl_cfg.signature_count) {
+      fprintf(stderr, "Error: ISSL slice matrix does not match the ISSL table.\n");
+      exit(1);
+    }
+  }
   
   int n_variants = 1 << issl_cfg.avg_slice_width;
   int *variants = malloc(sizeof(int) * n_variants);
@@ -691,11 +1098,6 @@ void RunSearchISLTurbo()
   if (Config("ISL-MAX-DIST-NONEW"))
     cease_new = atoi(Config("ISL-MAX-DIST-NONEW"));
 
-  int n_variants_stopearly = variants_threshold(variants, n_variants, stop_early);
-  int n_variants_ceasenew = variants_threshold(variants, n_variants, cease_new);
-  
-  //fprintf(stderr, "n_variants_stopearly %d\n", n_variants_stopearly);
-  //fprintf(stderr, "n_variants_ceasenew %d\n", n_variants_ceasenew);
   
   int thread_count = 1;
   
@@ -703,14 +1105,14 @@ void RunSearchISLTurbo()
     thread_count = atoi(Config("SEARCH-DOC-THREADS"));
   }
   
-  int job_count;
-  if (thread_count > 1)
-    job_count = thread_count * 10;
-  else
-    job_count = 1;
-    
-  if (Config("SEARCH-DOC-JOBS")) {
-    job_count = atoi(Config("SEARCH-DOC-JOBS"));
+  // Searches taken by a thread at a time
+  int grain = 4;
+  if (Config("SEARCH-DOC-GRAIN")) {
+    grain = atoi(Config("SEARCH-DOC-GRAIN"));
+    if (grain <= 0) {
+      fprintf(stderr, "Error: invalid SEARCH-DOC-GRAIN value\n");
+      exit(1);
+    }
   }
   int search_doc_first = 0;
   int search_doc_last = issl_cfg.signature_count - 1;
@@ -745,56 +1147,91 @@ void RunSearchISLTurbo()
   
   if (top_k_rerank < top_k_present) top_k_rerank = top_k_present;
   
-  int total_docs = search_doc_last - search_doc_first + 1;
+  int score_tile = DEFAULT_SCORE_TILE;
+  if (Config("ISL-SCORE-TILE")) {
+    score_tile = atoi(Config("ISL-SCORE-TILE"));
+    if (score_tile <= 0) {
+      fprintf(stderr, "Error: invalid ISL-SCORE-TILE value\n");
+      exit(1);
+    }
+  }
+  if (score_tile > issl_cfg.signature_count) score_tile = issl_cfg.signature_count;
   
-  void **jobdata = malloc(sizeof(void *) * job_count);
-  void **threaddata = malloc(sizeof(void *) * thread_count);
-  for (int i = 0; i < job_count; i++) {
-    Worker_Throughput *per_job_data = malloc(sizeof(Worker_Throughput));
-    per_job_data->sig_cfg = &sig_cfg;
-    per_job_data->issl_cfg = &issl_cfg;
-    per_job_data->sig_file = sig_file;
-    per_job_data->doc_begin = total_docs * i / job_count + search_doc_first;
-    per_job_data->doc_end = total_docs * (i+1) / job_count + search_doc_first;
-    per_job_data->issl_counts = issl_counts;
-    per_job_data->issl_table = issl_table;
-    per_job_data->v.variants = variants;
-    per_job_data->v.n_variants_stopearly = n_variants_stopearly;
-    per_job_data->v.n_variants_ceasenew = n_variants_ceasenew;
-    //per_job_data->scores = Create_Score_Table(issl_cfg.signature_count);
-    per_job_data->top_k = top_k_rerank;
-    jobdata[i] = per_job_data;
+  // Without adaptive probing every search probes to the same radius
+  int radius_variants[issl_cfg.avg_slice_width + 1];
+  for (int r = 0; r <= issl_cfg.avg_slice_width; r++) {
+    radius_variants[r] = variants_threshold(variants, n_variants, r);
   }
-  for (int i = 0; i < thread_count; i++) {
-    Worker_Throughput_perthread *per_thread_data = malloc(sizeof(Worker_Throughput));
-    per_thread_data->scores = Create_Score_Table(issl_cfg.signature_count);
-    per_thread_data->threadid = i;
-    threaddata[i] = per_thread_data;
+  ISSLSearchParams params;
+  params.table = table;
+  params.variants = variants;
+  params.radius_variants = radius_variants;
+  params.max_radius = stop_early < cease_new ? stop_early : cease_new;
+  params.min_radius = params.max_radius;
+  params.top_k = top_k_rerank;
+  params.score_tile = score_tile;
+  params.exact_k = 0;
+  params.sigs = &sigs;
+  
+  int adaptive = Config("ISL-ADAPTIVE-RADIUS") && lc_strcmp(Config("ISL-ADAPTIVE-RADIUS"), "true") == 0;
+  // Exact searches widen in the same way as adaptive ones, but stop only
+  // once the results shown are known to be the nearest
+  int exact = Config("ISL-EXACT") && lc_strcmp(Config("ISL-EXACT"), "true") == 0;
+  if (exact) {
+    adaptive = 1;
+    params.exact_k = top_k_present;
+  }
+  if (adaptive) {
+    params.min_radius = 0;
+    if (Config("ISL-MIN-DIST"))
+      params.min_radius = atoi(Config("ISL-MIN-DIST"));
+    params.max_radius = stop_early;
+  }
+  if (params.max_radius > issl_cfg.avg_slice_width) params.max_radius = issl_cfg.avg_slice_width;
+  if (params.min_radius < 0 || params.min_radius > params.max_radius) {
+    fprintf(stderr, "Error: ISL-MIN-DIST (%d) must be between 0 and ISL-MAX-DIST (%d)\n", params.min_radius, params.max_radius);
+    exit(1);
   }
   
-  timer T = timer_start();
-  
-  //DivideWork(threads, Throughput_Job, thread_count);
-  DivideWorkTP(jobdata, threaddata, Throughput_Job, job_count, thread_count);
-  
-  for (int i = 0; i < job_count; i++) {
-    Worker_Throughput *thread_data = jobdata[i];
-    int doc_count = thread_data->doc_end - thread_data->doc_begin;
-    for (int j = 0; j < doc_count; j++) {
-      Output_Results(thread_data->doc_begin + j, &thread_data->output[j], top_k_present);
+  int intra = 0;
+  if (Config("ISSL-PARALLELISM")) {
+    if (lc_strcmp(Config("ISSL-PARALLELISM"), "intra") == 0) {
+      intra = 1;
+    } else if (lc_strcmp(Config("ISSL-PARALLELISM"), "query") != 0) {
+      fprintf(stderr, "Error: invalid ISSL-PARALLELISM value (%s)\n", Config("ISSL-PARALLELISM"));
+      exit(1);
     }
   }
   
+  ProbeStats stats;
+  memset(&stats, 0, sizeof(ProbeStats));
+  timer_tick(&T);
+  if (intra) {
+    Search_Intra(&params, &sig_cfg, &sigs, slice_matrix, search_doc_first, search_doc_last, thread_count, top_k_rerank, top_k_present, &stats);
+  } else {
+    Search_Throughput(&params, &sig_cfg, &sigs, slice_matrix, search_doc_first, search_doc_last, thread_count, grain, top_k_rerank, top_k_present, &stats);
+  }
   fprintf(stderr, "search time %.2fms\n", timer_tick(&T));
   
-  for (int i = 0; i < job_count; i++) {
-    free(jobdata[i]);
+  long long searches = search_doc_last - search_doc_first + 1;
+  fprintf(stderr, "Probe radius:");
+  for (int r = params.min_radius; r <= params.max_radius && r <= MAX_PROBE_RADIUS; r++) {
+    fprintf(stderr, " %d: %lld", r, stats.searches_at_radius[r]);
   }
-  for (int i = 0; i < thread_count; i++) {
-    free(threaddata[i]);
+  fprintf(stderr, " searches\n");
+  fprintf(stderr, "Probing: %.2f passes, %.1f lists per search, %lld searches with fewer than %d candidates\n", (double)stats.passes / searches, (double)stats.lists_scored / searches, stats.short_results, top_k_rerank);
+  if (exact) {
+    fprintf(stderr, "Exact: %lld of %lld searches proven exact\n", stats.proven_exact, searches);
   }
-  free(jobdata);
-  free(threaddata);
+  
+  ISSLTableClose(table);
+  if (slice_matrix) {
+    ISSLSliceMatrixClose(slice_matrix);
+  }
+  if (sig_map) {
+    SigFileUnmap(sig_map, sig_map_size);
+  }
+  free(sig_file);
 }
 
 void ExperimentalRerankTopFile()
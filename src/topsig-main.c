@@ -7,6 +7,7 @@
 #include "topsig-issl.h"
 #include "topsig-stats.h"
 #include "topsig-exhaustive-docsim.h"
+#include "topsig-benchmark.h"
 
 #include "topsig-experimental-rf.h"
 
@@ -40,6 +41,8 @@ int main(int argc, const char **argv)
   else if (strcmp(argv[1], "docsim")==0) RunSearchISLTurbo();
   else if (strcmp(argv[1], "exhaustive-docsim")==0) RunExhaustiveDocsimSearch();
   else if (strcmp(argv[1], "experimental-reranktop")==0) ExperimentalRerankTopFile();
+  else if (strcmp(argv[1], "benchmark-distance")==0) RunDistanceBenchmark();
+  else if (strcmp(argv[1], "benchmark-threading")==0) RunThreadingBenchmark();
 
   else usage();
   return 0;
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "topsig-queue.h"
+#include "topsig-timer.h"
+
+struct BlockingQueue {
+  void **items;
+  int capacity;
+  // Items are pushed and popped in order. pushed - popped are waiting.
+  long long pushed;
+  long long popped;
+  int open_producers;
+
+  long long depth_sum; // the number waiting as each item was pushed
+  int max_depth;
+  long long full_pushes;
+  long long pops; // calls to BQPop, including those that find it closed
+  long long empty_pops;
+  double push_wait_ms;
+  double pop_wait_ms;
+
+  pthread_mutex_t lock;
+  pthread_cond_t item_ready;
+  pthread_cond_t slot_free;
+};
+
+BlockingQueue *BQCreate(int capacity, int producers)
+{
+  BlockingQueue *Q = malloc(sizeof(BlockingQueue));
+  Q->items = malloc(sizeof(void *) * capacity);
+  if (!Q->items) {
+    fprintf(stderr, "Unable to allocate queue of %d items\n", capacity);
+    exit(1);
+  }
+  Q->capacity = capacity;
+  Q->pushed = 0;
+  Q->popped = 0;
+  Q->open_producers = producers;
+  Q->depth_sum = 0;
+  Q->max_depth = 0;
+  Q->full_pushes = 0;
+  Q->pops = 0;
+  Q->empty_pops = 0;
+  Q->push_wait_ms = 0;
+  Q->pop_wait_ms = 0;
+  pthread_mutex_init(&Q->lock, NULL);
+  pthread_cond_init(&Q->item_ready, NULL);
+  pthread_cond_init(&Q->slot_free, NULL);
+  return Q;
+}
+
+void BQDestroy(BlockingQueue *Q)
+{
+  pthread_mutex_destroy(&Q->lock);
+  pthread_cond_destroy(&Q->item_ready);
+  pthread_cond_destroy(&Q->slot_free);
+  free(Q->items);
+  free(Q);
+}
+
+void BQPush(BlockingQueue *Q, void *item)
+{
+  pthread_mutex_lock(&Q->lock);
+  if (Q->pushed - Q->popped == Q->capacity) {
+    Q->full_pushes++;
+    timer T = timer_start();
+    while (Q->pushed - Q->popped == Q->capacity) {
+      pthread_cond_wait(&Q->slot_free, &Q->lock);
+    }
+    Q->push_wait_ms += timer_tick(&T);
+  }
+  int depth = Q->pushed - Q->popped;
+  Q->depth_sum += depth;
+  if (depth + 1 > Q->max_depth) Q->max_depth = depth + 1;
+  Q->items[Q->pushed % Q->capacity] = item;
+  Q->pushed++;
+  pthread_cond_signal(&Q->item_ready);
+  pthread_mutex_unlock(&Q->lock);
+}
+
+void *BQPop(BlockingQueue *Q)
+{
+  pthread_mutex_lock(&Q->lock);
+  Q->pops++;
+  if (Q->pushed == Q->popped && Q->open_producers > 0) {
+    Q->empty_pops++;
+    timer T = timer_start();
+    while (Q->pushed == Q->popped && Q->open_producers > 0) {
+      pthread_cond_wait(&Q->item_ready, &Q->lock);
+    }
+    Q->pop_wait_ms += timer_tick(&T);
+  }
+  void *item = NULL;
+  if (Q->pushed != Q->popped) {
+    item = Q->items[Q->popped % Q->capacity];
+    Q->popped++;
+    pthread_cond_signal(&Q->slot_free);
+  }
+  pthread_mutex_unlock(&Q->lock);
+  return item;
+}
+
+void BQClose(BlockingQueue *Q)
+{
+  pthread_mutex_lock(&Q->lock);
+  Q->open_producers--;
+  if (Q->open_producers == 0) {
+    pthread_cond_broadcast(&Q->item_ready);
+  }
+  pthread_mutex_unlock(&Q->lock);
+}
+
+void BQReport(const BlockingQueue *Q, const char *name)
+{
+  double pushes = Q->pushed > 0 ? (double)Q->pushed : 1.0;
+  double pops = Q->pops > 0 ? (double)Q->pops : 1.0;
+  fprintf(stderr, "%s queue: %lld items, depth mean %.1f max %d of %d, full for %.1f%% of pushes (%.0fms waiting), empty for %.1f%% of pops (%.0fms waiting)\n", name, Q->pushed, Q->depth_sum / pushes, Q->max_depth, Q->capacity, 100.0 * Q->full_pushes / pushes, Q->push_wait_ms, 100.0 * Q->empty_pops / pops, Q->pop_wait_ms);
+}
@@ -0,0 +1,30 @@
+#ifndef TOPSIG_QUEUE_H
+#define TOPSIG_QUEUE_H
+
+// A bounded first-in first-out queue of pointers between threads. Pushing
+// to a full queue and popping from an empty one block. This module does
+// not depend on the configuration system.
+//
+// The queue keeps statistics on how full it was and how long its
+// producers and consumers spent blocked, so that the stage before or
+// after it that holds up the other can be found.
+
+struct BlockingQueue;
+typedef struct BlockingQueue BlockingQueue;
+
+// producers is the number of threads that will call BQClose
+BlockingQueue *BQCreate(int capacity, int producers);
+void BQDestroy(BlockingQueue *Q);
+
+void BQPush(BlockingQueue *Q, void *item);
+
+// Returns NULL once every producer has closed the queue and it is empty
+void *BQPop(BlockingQueue *Q);
+
+// Called by each producer when it has nothing more to push
+void BQClose(BlockingQueue *Q);
+
+// Writes a line of statistics to stderr
+void BQReport(const BlockingQueue *Q, const char *name);
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "topsig-readahead.h"
+
+#if !(defined(WINDOWS) || defined(_WIN32) || defined(_WIN64))
+#include <fcntl.h>
+#endif
+
+typedef struct {
+  unsigned char *buffer;
+  SigBlock block;
+} SigReaderSlot;
+
+struct SigReader {
+  const SigFileHeader *H;
+  FILE *fp;
+  int block_capacity;
+
+  int n_slots;
+  SigReaderSlot *slots;
+
+  // Slots are filled and consumed in order. filled - consumed is the
+  // number of blocks ready to be taken.
+  int filled;
+  int consumed;
+  int stop;
+
+  pthread_mutex_t lock;
+  pthread_cond_t slot_ready;
+  pthread_cond_t slot_free;
+  pthread_t thread;
+};
+
+static void *reader_thread(void *input)
+{
+  SigReader *R = input;
+  const SigFileHeader *H = R->H;
+  int next_sig = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&R->lock);
+    while (!R->stop && R->filled - R->consumed == R->n_slots) {
+      pthread_cond_wait(&R->slot_free, &R->lock);
+    }
+    int stop = R->stop;
+    SigReaderSlot *slot = &R->slots[R->filled % R->n_slots];
+    pthread_mutex_unlock(&R->lock);
+    if (stop) break;
+
+    // Hint that the block after this one is needed next so the kernel can
+    // fetch it while this one is copied out
+    int after = next_sig + R->block_capacity;
+    if (after >= H->num_signatures) after = 0;
+    SigFileAdviseBlock(H, R->fp, after, R->block_capacity);
+
+    SigFileReadBlock(H, R->fp, next_sig, R->block_capacity, slot->buffer, &slot->block);
+    next_sig += slot->block.count;
+    if (next_sig >= H->num_signatures || slot->block.count == 0) {
+      next_sig = 0;
+    }
+
+    pthread_mutex_lock(&R->lock);
+    R->filled++;
+    pthread_cond_signal(&R->slot_ready);
+    pthread_mutex_unlock(&R->lock);
+  }
+  return NULL;
+}
+
+SigReader *SigReaderStart(const SigFileHeader *H, FILE *fp, int buffers, size_t buffer_bytes)
+{
+  SigReader *R = malloc(sizeof(SigReader));
+  R->H = H;
+  R->fp = fp;
+  R->block_capacity = SigFileBlockCapacity(H, buffer_bytes);
+  if (R->block_capacity <= 0) {
+    fprintf(stderr, "Signature read-ahead buffers are too small to hold a signature\n");
+    exit(1);
+  }
+
+  R->n_slots = buffers;
+  R->slots = malloc(sizeof(SigReaderSlot) * buffers);
+  for (int i = 0; i < buffers; i++) {
+    R->slots[i].buffer = malloc(SigFileBlockSize(H, R->block_capacity));
+    if (!R->slots[i].buffer) {
+      fprintf(stderr, "Unable to allocate signature cache\n");
+      exit(1);
+    }
+  }
+  R->filled = 0;
+  R->consumed = 0;
+  R->stop = 0;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  pthread_mutex_init(&R->lock, NULL);
+  pthread_cond_init(&R->slot_ready, NULL);
+  pthread_cond_init(&R->slot_free, NULL);
+  pthread_create(&R->thread, NULL, reader_thread, R);
+  return R;
+}
+
+int SigReaderBlockCapacity(const SigReader *R)
+{
+  return R->block_capacity;
+}
+
+const SigBlock *SigReaderNext(SigReader *R)
+{
+  pthread_mutex_lock(&R->lock);
+  while (R->filled == R->consumed) {
+    pthread_cond_wait(&R->slot_ready, &R->lock);
+  }
+  SigReaderSlot *slot = &R->slots[R->consumed % R->n_slots];
+  pthread_mutex_unlock(&R->lock);
+  return &slot->block;
+}
+
+void SigReaderRelease(SigReader *R)
+{
+  pthread_mutex_lock(&R->lock);
+  R->consumed++;
+  pthread_cond_signal(&R->slot_free);
+  pthread_mutex_unlock(&R->lock);
+}
+
+void SigReaderStop(SigReader *R)
+{
+  pthread_mutex_lock(&R->lock);
+  R->stop = 1;
+  pthread_cond_signal(&R->slot_free);
+  pthread_mutex_unlock(&R->lock);
+  pthread_join(R->thread, NULL);
+
+  pthread_mutex_destroy(&R->lock);
+  pthread_cond_destroy(&R->slot_ready);
+  pthread_cond_destroy(&R->slot_free);
+  for (int i = 0; i < R->n_slots; i++) {
+    free(R->slots[i].buffer);
+  }
+  free(R->slots);
+  free(R);
+}
@@ -0,0 +1,29 @@
+#ifndef TOPSIG_READAHEAD_H
+#define TOPSIG_READAHEAD_H
+
+#include <stdio.h>
+#include "topsig-sigfile.h"
+
+// Streams a signature file that does not fit in memory through a ring of
+// buffers. A dedicated I/O thread fills the next buffers while the caller
+// works on the current one, wrapping back to the first signature after
+// the last so that the start of the next pass is also fetched early.
+
+struct SigReader;
+typedef struct SigReader SigReader;
+
+// Starts the I/O thread. fp must not be used by anyone else until
+// SigReaderStop is called.
+SigReader *SigReaderStart(const SigFileHeader *H, FILE *fp, int buffers, size_t buffer_bytes);
+
+// Number of signatures held by each buffer
+int SigReaderBlockCapacity(const SigReader *R);
+
+// Waits for the next block in file order. The block remains valid until
+// SigReaderRelease is called.
+const SigBlock *SigReaderNext(SigReader *R);
+void SigReaderRelease(SigReader *R);
+
+void SigReaderStop(SigReader *R);
+
+#endif
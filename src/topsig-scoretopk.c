@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "topsig-scoretopk.h"
+
+void ScoreTopKInit(ScoreTopK *T, int k, int max_score)
+{
+  T->k = k;
+  T->max_score = max_score;
+  T->floor = k > 0 ? 1 : max_score + 1;
+  T->floor_docid = INT_MAX;
+  T->n = 0;
+  // Each compaction scans the histogram, so the buffer is made large
+  // enough for that to be paid for by the candidates it removes
+  T->capacity = k + (k > max_score + 1 ? k : max_score + 1);
+  T->docids = malloc(sizeof(int) * T->capacity);
+  T->scores = malloc(sizeof(int) * T->capacity);
+  T->counts = malloc(sizeof(int) * (max_score + 1));
+  T->ties = malloc(sizeof(int) * T->capacity);
+  if (!T->docids || !T->scores || !T->counts || !T->ties) {
+    fprintf(stderr, "Ran out of memory selecting top results.\n");
+    exit(1);
+  }
+  memset(T->counts, 0, sizeof(int) * (max_score + 1));
+}
+
+void ScoreTopKFree(ScoreTopK *T)
+{
+  free(T->docids);
+  free(T->scores);
+  free(T->counts);
+  free(T->ties);
+}
+
+// Moves the k smallest of a[0..n) to the front, in no particular order
+static void select_smallest(int *a, int n, int k)
+{
+  int lo = 0;
+  int hi = n - 1;
+  while (lo < hi) {
+    int pivot = a[lo + (hi - lo) / 2];
+    int i = lo;
+    int j = hi;
+    while (i <= j) {
+      while (a[i] < pivot) i++;
+      while (a[j] > pivot) j--;
+      if (i <= j) {
+        int t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+        i++;
+        j--;
+      }
+    }
+    if (k - 1 <= j) hi = j;
+    else if (k - 1 >= i) lo = i;
+    else break;
+  }
+}
+
+void ScoreTopKCompact(ScoreTopK *T)
+{
+  if (T->n <= T->k) return;
+  
+  // Find the score of the k-th best and how many candidates with that
+  // score are among the best k
+  int cutoff = T->max_score;
+  int better = 0;
+  while (better + T->counts[cutoff] < T->k) {
+    better += T->counts[cutoff];
+    cutoff--;
+  }
+  int take_at_cutoff = T->k - better;
+  
+  // Keep everything above the cutoff and the lowest docids at it
+  int n = 0;
+  int ties = 0;
+  for (int i = 0; i < T->n; i++) {
+    int score = T->scores[i];
+    if (score > cutoff) {
+      T->docids[n] = T->docids[i];
+      T->scores[n] = score;
+      n++;
+    } else if (score == cutoff) {
+      T->ties[ties++] = T->docids[i];
+    }
+    T->counts[score] -= score <= cutoff;
+  }
+  select_smallest(T->ties, ties, take_at_cutoff);
+  int floor_docid = -1;
+  for (int i = 0; i < take_at_cutoff; i++) {
+    T->docids[n] = T->ties[i];
+    T->scores[n] = cutoff;
+    n++;
+    if (T->ties[i] > floor_docid) floor_docid = T->ties[i];
+  }
+  T->counts[cutoff] = take_at_cutoff;
+  T->n = n;
+  T->floor = cutoff;
+  T->floor_docid = floor_docid;
+}
+
+static int docid_compar(const void *A, const void *B)
+{
+  int a = *(const int *)A;
+  int b = *(const int *)B;
+  return (a > b) - (a < b);
+}
+
+int ScoreTopKKth(const ScoreTopK *T, int k)
+{
+  // Candidates below the floor were only ever dropped from beyond the best
+  // k of T->k, so the histogram still counts the best k
+  int better = 0;
+  for (int s = T->max_score; s >= 0; s--) {
+    better += T->counts[s];
+    if (better >= k) return s;
+  }
+  return -1;
+}
+
+int ScoreTopKFinish(ScoreTopK *T, int *docids, int *scores)
+{
+  ScoreTopKCompact(T);
+  
+  // Counting sort, best first, then each run of equal scores by docid
+  int pos = 0;
+  for (int s = T->max_score; s >= 0; s--) {
+    int c = T->counts[s];
+    T->counts[s] = pos;
+    pos += c;
+  }
+  for (int i = 0; i < T->n; i++) {
+    int j = T->counts[T->scores[i]]++;
+    docids[j] = T->docids[i];
+    scores[j] = T->scores[i];
+  }
+  for (int i = 0; i < T->n;) {
+    int j = i + 1;
+    while (j < T->n && scores[j] == scores[i]) j++;
+    qsort(docids + i, j - i, sizeof(int), docid_compar);
+    i = j;
+  }
+  
+  int n = T->n;
+  ScoreTopKClear(T);
+  return n;
+}
+
+void ScoreTopKClear(ScoreTopK *T)
+{
+  memset(T->counts, 0, sizeof(int) * (T->max_score + 1));
+  T->n = 0;
+  T->floor = T->k > 0 ? 1 : T->max_score + 1;
+  T->floor_docid = INT_MAX;
+}
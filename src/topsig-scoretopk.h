@@ -0,0 +1,65 @@
+#ifndef TOPSIG_SCORETOPK_H
+#define TOPSIG_SCORETOPK_H
+
+// Selection of the k highest-scoring docids from a stream of scores
+// between 0 and a known maximum, such as ISSL scores or sig_width less the
+// Hamming distance. This module does not depend on the configuration
+// system.
+//
+// Candidates are kept in a buffer along with a histogram of their scores.
+// When the buffer fills, the histogram gives the score of the k-th best
+// and the buffer is cut down to the best k, after which only candidates
+// that would beat the k-th are accepted. Of docids with equal scores, the
+// lowest are kept, so the result does not depend on the order candidates
+// are added in.
+
+typedef struct {
+  int k;
+  int max_score;
+  int floor; // lowest score that can still enter
+  int floor_docid; // at the floor score, only docids up to this can enter
+  int n;
+  int capacity;
+  int *docids;
+  int *scores;
+  int *counts; // [max_score + 1], scores of the buffered candidates
+  int *ties; // [capacity], compaction workspace
+} ScoreTopK;
+
+// Scores of 0 are never selected
+void ScoreTopKInit(ScoreTopK *T, int k, int max_score);
+void ScoreTopKFree(ScoreTopK *T);
+
+void ScoreTopKCompact(ScoreTopK *T);
+
+// Discards the candidates added so far
+void ScoreTopKClear(ScoreTopK *T);
+
+static inline int ScoreTopKEnters(const ScoreTopK *T, int docid, int score)
+{
+  return score > T->floor || (score == T->floor && docid <= T->floor_docid);
+}
+
+static inline void ScoreTopKAdd(ScoreTopK *T, int docid, int score)
+{
+  if (!ScoreTopKEnters(T, docid, score)) return;
+  if (T->n == T->capacity) {
+    ScoreTopKCompact(T);
+    if (!ScoreTopKEnters(T, docid, score)) return;
+  }
+  T->docids[T->n] = docid;
+  T->scores[T->n] = score;
+  T->counts[score]++;
+  T->n++;
+}
+
+// The score of the k-th best candidate added so far, or -1 if there have
+// been fewer than k
+int ScoreTopKKth(const ScoreTopK *T, int k);
+
+// Writes out the best min(k, candidates) docids and their scores, best
+// first and then by docid, returns how many there were and resets T for
+// the next search
+int ScoreTopKFinish(ScoreTopK *T, int *docids, int *scores);
+
+#endif
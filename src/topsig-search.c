@@ -10,14 +10,36 @@
 #include "topsig-stem.h"
 #include "topsig-stop.h"
 #include "topsig-thread.h"
+#include "topsig-sigfile.h"
+#include "topsig-readahead.h"
+#include "topsig-atomic.h"
+#include "topsig-semaphore.h"
 #include "superfasthash.h"
 
+// Number of records whose distances are computed at once by the linear scan
+#define SEARCH_DISTANCE_BATCH 256
+// Bytes of signatures scored against every query of a batch before moving on
+#define SEARCH_BATCH_TILE_BYTES (128 * 1024)
+// Work is divided into about this many chunks per search thread, each of
+// at least SEARCH_MIN_CHUNK signatures
+#define SEARCH_CHUNKS_PER_THREAD 8
+#define SEARCH_MIN_CHUNK 1024
+
 struct Search {
   FILE *sig;
+  SigFileHeader sigfile;
   int cache_size;
   unsigned char *cache;
+  SigBlock block;
+  int next_sig;
+  void *map;
+  size_t map_size;
+  SigReader *reader;
+  TBPHandle *pool;
+  int *pool_ids;
   int entire_file_cached;
   int sigs_cached;
+  int scan_width; // bits of each signature compared by the linear scan
 
   SignatureCache *sigcache;
   
@@ -26,7 +48,6 @@ struct Search {
     int length;
     int density;
     int docnamelen;
-    int headersize;
     int seed;
     
     int charmask[256];
@@ -36,6 +57,10 @@ struct Search {
     
     int pseudofeedback;
     int dinesha;
+    int early_abandon;
+    int prefix_bits;
+    int prefix_candidates;
+    int prefix_recall;
   } cfg;
 };
 
@@ -51,6 +76,9 @@ struct Result {
 
 struct Results {
   int k;
+  // Signature words examined by the linear scan, out of words_total
+  long long words_evaluated;
+  long long words_total;
   struct Result res[1];
 };
 
@@ -67,17 +95,33 @@ Search *InitSearch()
     exit(1);
   }
   
-  char *C = Config("SIGNATURE-CACHE-SIZE");
-  if (C == NULL) {
+  int use_mmap = 0;
+  char *C = Config("SIGNATURE-ACCESS");
+  if (C) {
+    if (lc_strcmp(C, "mmap") == 0) {
+      use_mmap = 1;
+    } else if (lc_strcmp(C, "read") != 0) {
+      fprintf(stderr, "Invalid SIGNATURE-ACCESS value\n");
+      exit(1);
+    }
+  }
+  
+  // The cache is not needed when the signature file is mapped
+  C = Config("SIGNATURE-CACHE-SIZE");
+  if (C == NULL && !use_mmap) {
     fprintf(stderr, "SIGNATURE-CACHE-SIZE unspecified\n");
     exit(1);
   }
-  S->cache_size = atoi(C);
+  S->cache_size = C ? atoi(C) : 0;
   
-  S->cache = malloc((size_t)S->cache_size * 1024 * 1024);
-  if (!S->cache) {
-    fprintf(stderr, "Unable to allocate signature cache\n");
-    exit(1);
+  int read_buffers = 2;
+  C = Config("SIGNATURE-READ-BUFFERS");
+  if (C) {
+    read_buffers = atoi(C);
+    if (read_buffers <= 0) {
+      fprintf(stderr, "Invalid SIGNATURE-READ-BUFFERS value\n");
+      exit(1);
+    }
   }
   
   if (lc_strcmp(Config("SEARCH-THREADING"), "multi") == 0) {
@@ -101,18 +145,72 @@ Search *InitSearch()
   S->cfg.dinesha = 0;
   if (lc_strcmp(Config("DINESHA-TERMWEIGHTS"),"true")==0) S->cfg.dinesha = 1;
   
+  S->cfg.early_abandon = 0;
+  C = Config("SEARCH-EARLY-ABANDON");
+  if (C && lc_strcmp(C, "true") == 0) S->cfg.early_abandon = 1;
+  
+  S->cfg.prefix_bits = 0;
+  C = Config("SEARCH-PREFIX-BITS");
+  if (C) S->cfg.prefix_bits = atoi(C);
+  S->cfg.prefix_candidates = 10;
+  C = Config("SEARCH-PREFIX-CANDIDATES");
+  if (C) {
+    S->cfg.prefix_candidates = atoi(C);
+    if (S->cfg.prefix_candidates < 1) {
+      fprintf(stderr, "Invalid SEARCH-PREFIX-CANDIDATES value\n");
+      exit(1);
+    }
+  }
+  S->cfg.prefix_recall = 0;
+  C = Config("SEARCH-PREFIX-RECALL");
+  if (C && lc_strcmp(C, "true") == 0) S->cfg.prefix_recall = 1;
+  
   // Read config info
   
-  S->cfg.headersize = file_read32(S->sig); // header-size
-  int version = file_read32(S->sig); // version
-  S->cfg.docnamelen = file_read32(S->sig); // maxnamelen
-  S->cfg.length = file_read32(S->sig); // sig_width
-  S->cfg.density = file_read32(S->sig); // sig_density
-  S->cfg.seed = 0;
-  if (version >= 2) {
-    S->cfg.seed = file_read32(S->sig); // sig_seed
+  S->sigfile = SigFileReadHeader(S->sig);
+  S->cfg.docnamelen = S->sigfile.max_name_len;
+  S->cfg.length = S->sigfile.sig_width;
+  S->cfg.density = S->sigfile.sig_density;
+  S->cfg.seed = S->sigfile.sig_seed;
+  strcpy(S->cfg.method, S->sigfile.sig_method);
+  
+  if (S->cfg.prefix_bits < 0 || S->cfg.prefix_bits % 64 != 0 || S->cfg.prefix_bits > S->cfg.length) {
+    fprintf(stderr, "Invalid SEARCH-PREFIX-BITS value (must be a multiple of 64 no greater than %d)\n", S->cfg.length);
+    exit(1);
+  }
+  if (S->cfg.prefix_bits == S->cfg.length) S->cfg.prefix_bits = 0;
+  S->scan_width = S->cfg.prefix_bits ? S->cfg.prefix_bits : S->cfg.length;
+  S->next_sig = 0;
+  S->map = NULL;
+  S->cache = NULL;
+  S->reader = NULL;
+  
+  if (use_mmap) {
+    // Search the mapped file in place. The kernel's page cache then holds
+    // the signatures and is shared with any other process searching them.
+    S->map = SigFileMap(&S->sigfile, S->sig, &S->block, &S->map_size);
+    if (!S->map) {
+      fprintf(stderr, "Unable to memory-map signature file, reading it instead\n");
+    }
+  }
+  if (!S->map) {
+    if (S->cache_size <= 0) {
+      fprintf(stderr, "SIGNATURE-CACHE-SIZE unspecified\n");
+      exit(1);
+    }
+    size_t cache_bytes = (size_t)S->cache_size * 1024 * 1024;
+    if (read_buffers > 1 && SigFileBlockCapacity(&S->sigfile, cache_bytes) < S->sigfile.num_signatures) {
+      // The file does not fit in the cache, so split the cache between
+      // several buffers and stream the file through them
+      S->reader = SigReaderStart(&S->sigfile, S->sig, read_buffers, cache_bytes / read_buffers);
+    } else {
+      S->cache = malloc(cache_bytes);
+      if (!S->cache) {
+        fprintf(stderr, "Unable to allocate signature cache\n");
+        exit(1);
+      }
+    }
   }
-  fread(S->cfg.method, 1, 64, S->sig); // sig_method
   
   // Override the config file settings with the new values
   
@@ -141,6 +239,23 @@ Search *InitSearch()
     for (int i = 0; i < 256; i++) S->cfg.charmask[i] = isgraph(i);
     
   S->entire_file_cached = -1;
+  if (S->map) {
+    S->entire_file_cached = 1;
+    S->sigs_cached = S->block.count;
+  }
+  
+  // The search threads are started once and reused for every query
+  S->pool = NULL;
+  S->pool_ids = NULL;
+  if (S->cfg.multithreading) {
+    S->pool_ids = malloc(sizeof(int) * S->cfg.threads);
+    void *threaddata[S->cfg.threads];
+    for (int i = 0; i < S->cfg.threads; i++) {
+      S->pool_ids[i] = i;
+      threaddata[i] = &S->pool_ids[i];
+    }
+    S->pool = TBPInit(S->cfg.threads, threaddata);
+  }
   
   return S;
 }
@@ -177,220 +292,18 @@ Signature *CreateQuerySignature(Search *S, const char *query)
   return sig;
 }
 
-/*
-int DocumentDistance_bitwise(int sigwidth, unsigned char *in_bsig, unsigned char *in_bmask, unsigned char *in_dsig)
-{
-  unsigned char bsig[sigwidth / 8]; memcpy(bsig, in_bsig, sigwidth / 8);
-  unsigned char bmask[sigwidth / 8]; memcpy(bmask, in_bmask, sigwidth / 8);
-  unsigned char dsig[sigwidth / 8]; memcpy(dsig, in_dsig, sigwidth / 8);
-  
-  unsigned int c = 0;
-  // 64-bit optimised version, only available if unsigned long int is 64 bits and if the signature is a
-  // multiple of 64 bits
-  unsigned long long *query_sig = (unsigned long int *)bsig;
-  unsigned long long *mask_sig = (unsigned long int *)bmask;
-  unsigned long long *doc_sig = (unsigned long int *)dsig;
-  unsigned long long v;
-  for (int i = 0; i < sigwidth / 64; i++) {
-    v = (doc_sig[i] ^ query_sig[i]) & mask_sig[i];
-    v = v - ((v >> 1) & 0x5555555555555555);
-    v = (v & 0x3333333333333333) + ((v >> 2) & 0x3333333333333333);
-    c += (((v + (v >> 4)) & 0x0f0f0f0f0f0f0f0f) * 0x0101010101010101) >> 56;
-  }
-  
-  return c;
-}
-
-int DocumentDistance_popcnt(int sigwidth, unsigned char *in_bsig, unsigned char *in_bmask, unsigned char *in_dsig)
-{
-  unsigned char bsig[sigwidth / 8]; memcpy(bsig, in_bsig, sigwidth / 8);
-  unsigned char bmask[sigwidth / 8]; memcpy(bmask, in_bmask, sigwidth / 8);
-  unsigned char dsig[sigwidth / 8]; memcpy(dsig, in_dsig, sigwidth / 8);
-  
-  unsigned int c = 0;
-  // 64-bit optimised version, only available if unsigned long int is 64 bits and if the signature is a
-  // multiple of 64 bits
-  unsigned long long *query_sig = (unsigned long int *)bsig;
-  unsigned long long *mask_sig = (unsigned long int *)bmask;
-  unsigned long long *doc_sig = (unsigned long int *)dsig;
-  unsigned long long v;
-  for (int i = 0; i < sigwidth / 64; i++) {
-    v = (doc_sig[i] ^ query_sig[i]) & mask_sig[i];
-    c += __builtin_popcountll(v);
-  }
-  
-  return c;
-}
-
-int DocumentDistance_popcnt2(int sigwidth, unsigned char *in_bsig, unsigned char *in_bmask, unsigned char *in_dsig)
-{
-  unsigned long long c = 0;
-  unsigned long long *query_sig = (unsigned long int *)in_bsig;
-  unsigned long long *mask_sig = (unsigned long int *)in_bmask;
-  unsigned long long *doc_sig = (unsigned long int *)in_dsig;
-  unsigned long long buf[sigwidth/64];
-
-  // 64-bit optimised version, only available if unsigned long int is 64 bits and if the signature is a
-  // multiple of 64 bits
-  unsigned long long v;
-  for (int i = 0; i < sigwidth / 64; i++) {
-    c += __builtin_popcountll((doc_sig[i] ^ query_sig[i]) & mask_sig[i]);
-  }
-  //for (int i = 0; i < sigwidth / 64; i++) {
-  //   c += __builtin_popcountll(buf[i]);
-  //}
-
-  return c;
-}
-*/
-int DocumentDistance_popcnt3(int sigwidth, const unsigned char *in_bsig, const unsigned char *in_bmask, const unsigned char *in_dsig)
-{
-  int c = 0;
-  
-  #ifdef IS64BIT
-  const unsigned long long *query_sig = (const unsigned long long *)in_bsig;
-  const unsigned long long *mask_sig = (const unsigned long long *)in_bmask;
-  const unsigned long long *doc_sig = (const unsigned long long *)in_dsig;
-  for (unsigned int i = 0; i < sigwidth / 8 / sizeof(unsigned long long); i++) {
-    c += __builtin_popcountll((doc_sig[i] ^ query_sig[i]) & mask_sig[i]);
-  }
-  #else
-  const unsigned int *query_sig = (const unsigned int *)in_bsig;
-  const unsigned int *mask_sig = (const unsigned int *)in_bmask;
-  const unsigned int *doc_sig = (const unsigned int *)in_dsig;
-  for (unsigned int i = 0; i < sigwidth / 8 / sizeof(unsigned int); i++) {
-    c += __builtin_popcount((doc_sig[i] ^ query_sig[i]) & mask_sig[i]);
-  }
-  #endif
-  
-  return c;
-}
-/*
-int DocumentDistance_ssse3_unrl(int sigwidth, unsigned char *in_bsig, unsigned char *in_bmask, unsigned char *in_dsig)
-{
-  unsigned long long bsig[sigwidth / 64]; memcpy(bsig, in_bsig, sigwidth / 64);
-  unsigned long long bmask[sigwidth / 64]; memcpy(bmask, in_bmask, sigwidth / 64);
-  unsigned long long dsig[sigwidth / 64]; memcpy(dsig, in_dsig, sigwidth / 64);
-  
-  unsigned long long c = 0;
-  // 64-bit optimised version, only available if unsigned long int is 64 bits and if the signature is a
-  // multiple of 64 bits
-  
-  unsigned long long *query_sig = (unsigned long int *)bsig;
-  unsigned long long *mask_sig = (unsigned long int *)bmask;
-  unsigned long long *doc_sig = (unsigned long int *)dsig;
-  unsigned long long v;
-  for (int i = 0; i < sigwidth / 64; i++) {
-    query_sig[i] = (doc_sig[i] ^ query_sig[i]) & mask_sig[i];
-  }
-  
-  return ssse3_popcount3(query_sig, sigwidth / 128);
-}
-
-
-int DocumentDistance_ssse3_unrl2(int sigwidth, unsigned char *in_bsig, unsigned char *in_bmask, unsigned char *in_dsig)
-{
-  unsigned long long c = 0;
-  // 64-bit optimised version, only available if unsigned long int is 64 bits and if the signature is a
-  // multiple of 64 bits
-  
-  unsigned long long *query_sig = (unsigned long int *)in_bsig;
-  unsigned long long *mask_sig = (unsigned long int *)in_bmask;
-  unsigned long long *doc_sig = (unsigned long int *)in_dsig;
-  unsigned long long v;
-  unsigned long long data[sigwidth / 64];
-  for (int i = 0; i < sigwidth / 64; i++) {
-    data[i] = (doc_sig[i] ^ query_sig[i]) & mask_sig[i];
-  }
-  
-  return ssse3_popcount3(data, sigwidth / 128);
-}
-
-int DocumentDistance_ssse3_unrl3(int sigwidth, unsigned char *in_bsig, unsigned char *in_bmask, unsigned char *in_dsig)
-{
-  // 64-bit optimised version, only available if unsigned long int is 64 bits and if the signature is a
-  // multiple of 64 bits
-  
-  unsigned long long *query_sig = (unsigned long int *)in_bsig;
-  unsigned long long *mask_sig = (unsigned long int *)in_bmask;
-  unsigned long long *doc_sig = (unsigned long int *)in_dsig;
-  unsigned long long v;
-  unsigned long long data[sigwidth / 64];
-  for (int i = 0; i < sigwidth / 64; i++) {
-    data[i] = (doc_sig[i] ^ query_sig[i]) & mask_sig[i];
-  }
-  
-  return ssse3_popcount3(data, sigwidth / 128);
-}
-*/
-/*
-int DocumentDistance_old(int sigwidth, unsigned char *in_bsig, unsigned char *in_bmask, unsigned char *in_dsig)
-{
-  unsigned char bsig[sigwidth / 8]; memcpy(bsig, in_bsig, sigwidth / 8);
-  unsigned char bmask[sigwidth / 8]; memcpy(bmask, in_bmask, sigwidth / 8);
-  unsigned char dsig[sigwidth / 8]; memcpy(dsig, in_dsig, sigwidth / 8);
-  
-  unsigned int c = 0;
-  #ifdef IS64BIT
-  if ((sizeof(unsigned long long) == 8) && (sigwidth % 64 == 0)) {
-    // 64-bit optimised version, only available if unsigned long int is 64 bits and if the signature is a
-    // multiple of 64 bits
-    unsigned long long *query_sig = (unsigned long int *)bsig;
-    unsigned long long *mask_sig = (unsigned long int *)bmask;
-    unsigned long long *doc_sig = (unsigned long int *)dsig;
-    unsigned long long v;
-    for (int i = 0; i < sigwidth / 64; i++) {
-      v = (doc_sig[i] ^ query_sig[i]) & mask_sig[i];
-      v = v - ((v >> 1) & 0x5555555555555555);
-      v = (v & 0x3333333333333333) + ((v >> 2) & 0x3333333333333333);
-      c += (((v + (v >> 4)) & 0x0f0f0f0f0f0f0f0f) * 0x0101010101010101) >> 56;
-    }
-  } else
-  #endif
-  if ((sizeof(unsigned int) == 4) && (sigwidth % 32 == 0)) {
-    // 32-bit optimised version, only available if unsigned int is 32 bits and if the signature is a multiple
-    // of 32 bits
-    unsigned int *query_sig = (unsigned int *)bsig;
-    unsigned int *mask_sig = (unsigned int *)bmask;
-    unsigned int *doc_sig = (unsigned int *)dsig;
-    unsigned int v;
-    
-    //fprintf(stderr, "Address of query_sig = %p\n", query_sig);
-    //fprintf(stderr, "Address of mask_sig = %p\n", mask_sig);
-    //fprintf(stderr, "Address of doc_sig = %p\n", doc_sig);
-    
-    for (int i = 0; i < sigwidth / 32; i++) {
-      v = (doc_sig[i] ^ query_sig[i]) & mask_sig[i];
-      v = v - ((v >> 1) & 0x55555555);
-      v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-      c += (((v + (v >> 4)) & 0xF0F0F0F) * 0x1010101) >> 24;
-      
-    }
-  } else {
-    fprintf(stderr, "UNIMPLEMENTED\n");
-    exit(1);
-  }
-  
-  return c;
-}
-*/
-int DocumentDistance(int sigwidth, const unsigned char *in_bsig, const unsigned char *in_bmask, const unsigned char *in_dsig) {
-  return DocumentDistance_popcnt3(sigwidth,in_bsig, in_bmask,in_dsig);
-}
-
-
-static int get_document_quality(unsigned char *signature_header_vals)
+static int get_document_quality(const unsigned char *signature_header_vals)
 {
   // the 'quality' field is the 4th field in the header
   return mem_read32(signature_header_vals + (3 * 4));
 }
 
-static int get_document_offset_begin(unsigned char *signature_header_vals)
+static int get_document_offset_begin(const unsigned char *signature_header_vals)
 {
   // the 'offset_begin' field is the 5th field in the header
   return mem_read32(signature_header_vals + (4 * 4));
 }
-static int get_document_offset_end(unsigned char *signature_header_vals)
+static int get_document_offset_end(const unsigned char *signature_header_vals)
 {
   // the 'offset_end' field is the 6th field in the header
   return mem_read32(signature_header_vals + (5 * 4));
@@ -492,6 +405,8 @@ void MergeResults(Results *base, Results *add)
     free(res[i].docid);
     free(res[i].signature);
   }
+  base->words_evaluated += add->words_evaluated;
+  base->words_total += add->words_total;
   free(add);
   
   for (int i = 0; i < base->k; i++) {
@@ -499,107 +414,467 @@ void MergeResults(Results *base, Results *add)
   }
 }
 
-Results *FindHighestScoring(Search *S, const int start, const int count, const int topk, unsigned char *bsig, unsigned char *bmask)
+// The top-k results of a scan are kept in a binary heap of slot numbers
+// ordered by result_compar, with the worst result at the root. When
+// duplicates are suppressed, an open-addressing set maps docid hashes to
+// the slots holding them.
+//
+// With SEARCH-EARLY-ABANDON, once the heap is full each signature's distance
+// is accumulated over the query's words in order (most heavily masked
+// first) and abandoned as soon as it exceeds the current worst distance.
+
+typedef struct {
+  Results *R;
+  struct Result *res;
+  int k;
+  int *heap; // heap position -> slot
+  int *pos; // slot -> heap position
+  int *set; // docid set (slot numbers, -1 = empty)
+  unsigned int set_mask;
+  int *order; // word order for early abandon, or NULL
+  int n_order;
+  long long words_evaluated;
+  long long words_total;
+} TopK;
+
+static void topk_swap(TopK *T, int a, int b)
+{
+  int t = T->heap[a];
+  T->heap[a] = T->heap[b];
+  T->heap[b] = t;
+  T->pos[T->heap[a]] = a;
+  T->pos[T->heap[b]] = b;
+}
+
+// Moves the entry at heap position p towards the leaves after it improved
+static void topk_sift_down(TopK *T, int p)
+{
+  for (;;) {
+    int l = p * 2 + 1;
+    int r = l + 1;
+    int worst = p;
+    if (l < T->k && result_compar(&T->res[T->heap[l]], &T->res[T->heap[worst]]) > 0) worst = l;
+    if (r < T->k && result_compar(&T->res[T->heap[r]], &T->res[T->heap[worst]]) > 0) worst = r;
+    if (worst == p) return;
+    topk_swap(T, p, worst);
+    p = worst;
+  }
+}
+
+static int topk_set_find(const TopK *T, unsigned int hash, const char *docid, int docnamelen)
+{
+  for (unsigned int i = hash & T->set_mask; T->set[i] != -1; i = (i + 1) & T->set_mask) {
+    const struct Result *E = &T->res[T->set[i]];
+    if (E->docid_hash == hash && strncmp(E->docid, docid, docnamelen) == 0) {
+      return T->set[i];
+    }
+  }
+  return -1;
+}
+
+static void topk_set_insert(TopK *T, int slot)
+{
+  unsigned int i = T->res[slot].docid_hash & T->set_mask;
+  while (T->set[i] != -1) i = (i + 1) & T->set_mask;
+  T->set[i] = slot;
+}
+
+static void topk_set_remove(TopK *T, int slot)
+{
+  unsigned int i = T->res[slot].docid_hash & T->set_mask;
+  while (T->set[i] != slot) i = (i + 1) & T->set_mask;
+  
+  // Shift later entries of the probe sequence back so lookups stay correct
+  unsigned int j = i;
+  for (;;) {
+    T->set[i] = -1;
+    for (;;) {
+      j = (j + 1) & T->set_mask;
+      if (T->set[j] == -1) return;
+      unsigned int home = T->res[T->set[j]].docid_hash & T->set_mask;
+      // Move set[j] into the gap unless its home lies cyclically in (i, j]
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) break;
+    }
+    T->set[i] = T->set[j];
+    i = j;
+  }
+}
+
+static void freeresult(struct Result *R)
+{
+  free(R->docid);
+  free(R->signature);
+}
+
+static Results *new_results(Search *S, const int topk)
 {
-  //printf("FindHighestScoring()\n");
-  //printf("S\n");fflush(stdout);
   Results *R = malloc(sizeof(Results) - sizeof(struct Result) + sizeof(struct Result)*topk);
   R->k = topk;
+  R->words_evaluated = 0;
+  R->words_total = 0;
   for (int i = 0; i < topk; i++) {
     R->res[i].docid = malloc(S->cfg.docnamelen + 1);
     R->res[i].signature = malloc(S->cfg.length / 8);
     R->res[i].dist = INT_MAX;
+    R->res[i].qual = 0;
+    R->res[i].docid_hash = 0;
     R->res[i].docid[0] = '_';
     R->res[i].docid[1] = '\0';
   }
-  
-  // Calculate the size of each signature record and the offsets to the docid and signature strings
-  size_t sig_record_size = S->cfg.docnamelen + 1;
-  sig_record_size += 8 * 4; // 8 32-bit ints
-  size_t docid_offset = 0;
-  size_t sig_offset = sig_record_size;
-  int sig_length_bytes = S->cfg.length / 8;
-  sig_record_size += sig_length_bytes;
-  
-  int last_lowest_dist = INT_MAX;
-  int last_lowest_qual = -1;
-  int i;
-  int duplicates_ok = 0;
-  if (Config("DUPLICATES_OK"))
-    duplicates_ok = atoi(Config("DUPLICATES_OK"));
-  for (i = start; i < start+count; i++) {
-    unsigned char *signature_header = S->cache + sig_record_size * i;
-    unsigned char *signature_header_vals = signature_header + S->cfg.docnamelen + 1;
-    unsigned char *signature = S->cache + sig_record_size * i + sig_offset;
+  return R;
+}
+
+static void topk_init(Search *S, TopK *T, Results *R, int duplicates_ok, const unsigned char *bmask)
+{
+  int topk = R->k;
+  T->R = R;
+  T->res = R->res;
+  T->k = topk;
+  T->heap = malloc(sizeof(int) * topk);
+  T->pos = malloc(sizeof(int) * topk);
+  for (int i = 0; i < topk; i++) {
+    T->heap[i] = i;
+    T->pos[i] = i;
+  }
+  T->set = NULL;
+  if (!duplicates_ok) {
+    unsigned int set_size = 16;
+    while (set_size < (unsigned int)topk * 2) set_size *= 2;
+    T->set = malloc(sizeof(int) * set_size);
+    for (unsigned int i = 0; i < set_size; i++) T->set[i] = -1;
+    T->set_mask = set_size - 1;
+  }
+  T->order = NULL;
+  T->n_order = 0;
+  if (S->cfg.early_abandon) {
+    T->order = malloc(sizeof(int) * (S->scan_width / 64));
+    T->n_order = DistanceWordOrder(S->scan_width, bmask, T->order);
+  }
+  T->words_evaluated = 0;
+  T->words_total = 0;
+}
+
+static void topk_free(TopK *T)
+{
+  T->R->words_evaluated += T->words_evaluated;
+  T->R->words_total += T->words_total;
+  free(T->order);
+  free(T->heap);
+  free(T->pos);
+  free(T->set);
+}
+
+// Offers signatures start..start+count-1 of S->block to the top-k in T
+static void topk_scan(Search *S, TopK *T, const int start, const int count, const unsigned char *bsig, const unsigned char *bmask)
+{
+  struct Result *res = T->res;
+  const int words = S->scan_width / 64;
+  int dists[SEARCH_DISTANCE_BATCH];
+  T->words_total += (long long)count * words;
+  for (int i = start; i < start+count; i++) {
+    if ((i - start) % SEARCH_DISTANCE_BATCH == 0) {
+      int batch_n = start + count - i;
+      if (batch_n > SEARCH_DISTANCE_BATCH) batch_n = SEARCH_DISTANCE_BATCH;
+      // Distances can only be abandoned once there is a worst result to
+      // compare against. The worst distance only falls during the batch,
+      // so the one at its start is a safe bound for all of it.
+      int bound = res[T->heap[0]].dist;
+      if (T->order && bound != INT_MAX) {
+        T->words_evaluated += DocumentDistanceBoundedBatch(bsig, bmask, SigBlockSignature(&S->block, i), S->block.sig_stride, batch_n, T->order, T->n_order, bound, dists);
+      } else {
+        DocumentDistanceBatch(S->scan_width, bsig, bmask, SigBlockSignature(&S->block, i), S->block.sig_stride, batch_n, dists);
+        T->words_evaluated += (long long)batch_n * words;
+      }
+    }
+    int dist = dists[(i - start) % SEARCH_DISTANCE_BATCH];
+    
+    // Only results strictly better than the current worst are of interest
+    struct Result *worst = &res[T->heap[0]];
+    if (dist > worst->dist) continue;
     
-    int dist = DocumentDistance(S->cfg.length, bsig, bmask, signature);
+    const unsigned char *signature_header_vals = SigBlockHeader(&S->block, i);
     int qual = get_document_quality(signature_header_vals);
-    int offset_begin = get_document_offset_begin(signature_header_vals);
-    int offset_end = get_document_offset_end(signature_header_vals);
+    if (dist == worst->dist && qual <= worst->qual) continue;
     
-    const char *docid = (const char *)(signature_header + docid_offset);
-    unsigned int docid_hash = SuperFastHash(docid, strlen(docid));
+    const char *docid = SigBlockDocid(&S->block, i);
+    unsigned int docid_hash = mem_read32(signature_header_vals + SIGFILE_FIELD_DOCID_HASH * 4);
+    if (docid_hash == 0) {
+      docid_hash = DocidHash(docid, strlen(docid));
+    }
     
-    int lowest_j = 0;
-    int duplicate_found = -1;
-    if ((dist < last_lowest_dist) || ((dist == last_lowest_dist) && (qual > last_lowest_qual))) {
-      for (int j = 0; j < topk; j++) {
-        if (R->res[j].docid_hash == docid_hash && strncmp(R->res[j].docid, docid, S->cfg.docnamelen) == 0 && !duplicates_ok) {
-          duplicate_found = j;
-          break;
-        }
-        if (j != lowest_j && result_compar(&R->res[j], &R->res[lowest_j])==1) {
-          last_lowest_dist = R->res[j].dist;
-          last_lowest_qual = R->res[j].qual;
-          lowest_j = j;
+    if (T->set) {
+      int duplicate = topk_set_find(T, docid_hash, docid, S->cfg.docnamelen);
+      if (duplicate != -1) {
+        struct Result *D = &res[duplicate];
+        if ((dist < D->dist) || ((dist == D->dist) && (qual > D->qual))) {
+          D->dist = dist;
+          D->qual = qual;
+          topk_sift_down(T, T->pos[duplicate]);
         }
+        continue;
       }
     }
-    if (duplicate_found == -1) {
-      if ((dist < R->res[lowest_j].dist) || ((dist == R->res[lowest_j].dist) && (qual > R->res[lowest_j].qual))) {
-        R->res[lowest_j].docid_hash = docid_hash;
-        R->res[lowest_j].dist = dist;
-        R->res[lowest_j].qual = qual;
-        R->res[lowest_j].offset_begin = offset_begin;
-        R->res[lowest_j].offset_end = offset_end;
-        strncpy(R->res[lowest_j].docid, docid, S->cfg.docnamelen + 1);
-        memcpy(R->res[lowest_j].signature, signature, S->cfg.length / 8);
+    
+    // Replace the worst result
+    int slot = T->heap[0];
+    if (T->set && worst->docid_hash != 0) {
+      topk_set_remove(T, slot);
+    }
+    worst->docid_hash = docid_hash;
+    worst->dist = dist;
+    worst->qual = qual;
+    worst->offset_begin = get_document_offset_begin(signature_header_vals);
+    worst->offset_end = get_document_offset_end(signature_header_vals);
+    strncpy(worst->docid, docid, S->cfg.docnamelen + 1);
+    memcpy(worst->signature, SigBlockSignature(&S->block, i), S->cfg.length / 8);
+    if (T->set) {
+      topk_set_insert(T, slot);
+    }
+    topk_sift_down(T, 0);
+  }
+}
+
+static int duplicates_ok_cfg()
+{
+  int duplicates_ok = 0;
+  if (Config("DUPLICATES_OK"))
+    duplicates_ok = atoi(Config("DUPLICATES_OK"));
+  return duplicates_ok;
+}
+
+Results *FindHighestScoring(Search *S, const int start, const int count, const int topk, unsigned char *bsig, unsigned char *bmask)
+{
+  Results *R = new_results(S, topk);
+  if (topk <= 0) return R;
+  
+  TopK T;
+  topk_init(S, &T, R, duplicates_ok_cfg(), bmask);
+  topk_scan(S, &T, start, count, bsig, bmask);
+  topk_free(&T);
+  return R;
+}
+
+// Merges the partial results of the pool threads pairwise in a tree, so that
+// the merging is spread over the threads and finishes in log2(threads)
+// steps. Thread tid absorbs the results of threads tid+1, tid+2, tid+4...
+// and partial[0] ends up holding the results of every thread. Each thread
+// posts merged[tid] once its results are complete.
+static void tree_merge(Results **partial, TSemaphore *merged, int tid, int threads)
+{
+  for (int step = 1; tid % (2 * step) == 0 && tid + step < threads; step *= 2) {
+    tsem_wait(&merged[tid + step]);
+    MergeResults(partial[tid], partial[tid + step]);
+  }
+  tsem_post(&merged[tid]);
+}
+
+typedef struct {
+  Search *S;
+  int start;
+  int count;
+  int topk;
+  unsigned char *bsig;
+  unsigned char *bmask;
+  int chunk;
+  volatile int next_chunk;
+  Results **partial;
+  TSemaphore *merged;
+} ScanJob;
+
+static void *scan_chunks_job(void *threaddata, void *input)
+{
+  int tid = *(int *)threaddata;
+  ScanJob *J = input;
+  Search *S = J->S;
+  
+  Results *R = new_results(S, J->topk);
+  if (J->topk > 0) {
+    TopK T;
+    topk_init(S, &T, R, duplicates_ok_cfg(), J->bmask);
+    // Chunks are handed out dynamically so faster threads take more of them
+    for (;;) {
+      int first = J->start + atomic_add(&J->next_chunk, 1) * J->chunk;
+      if (first >= J->start + J->count) break;
+      int n = J->start + J->count - first;
+      if (n > J->chunk) n = J->chunk;
+      topk_scan(S, &T, first, n, J->bsig, J->bmask);
+    }
+    topk_free(&T);
+  }
+  J->partial[tid] = R;
+  
+  tree_merge(J->partial, J->merged, tid, S->cfg.threads);
+  return NULL;
+}
+
+// Scores the signatures currently described by S->block and merges them into R
+static Results *scan_block(Search *S, Results *R, const int topk, unsigned char *bsig, unsigned char *bmask)
+{
+  Results *result;
+  if (S->cfg.multithreading == 0) {
+    result = FindHighestScoring(S, 0, S->sigs_cached, topk, bsig, bmask);
+  } else {
+    int threads = S->cfg.threads;
+    Results *partial[threads];
+    TSemaphore merged[threads];
+    for (int i = 0; i < threads; i++) tsem_init(&merged[i], 0, 0);
+    
+    ScanJob J;
+    J.S = S;
+    J.start = 0;
+    J.count = S->sigs_cached;
+    J.topk = topk;
+    J.bsig = bsig;
+    J.bmask = bmask;
+    J.chunk = S->sigs_cached / (threads * SEARCH_CHUNKS_PER_THREAD);
+    if (J.chunk < SEARCH_MIN_CHUNK) J.chunk = SEARCH_MIN_CHUNK;
+    J.next_chunk = 0;
+    J.partial = partial;
+    J.merged = merged;
+    TBPDivideWork(S->pool, &J, scan_chunks_job);
+    result = partial[0];
+    for (int i = 0; i < threads; i++) tsem_destroy(&merged[i]);
+  }
+  
+  if (R) {
+    MergeResults(R, result);
+    return R;
+  }
+  return result;
+}
+
+// Scores the signatures currently described by S->block against queries
+// q_first..q_end-1 and merges them into their result lists
+static void scan_query_range(Search *S, Results **R, int q_first, int q_end, const int topk, unsigned char **bsigs, unsigned char **bmasks)
+{
+  int n = q_end - q_first;
+  if (n <= 0) return;
+  
+  Results *result[n];
+  TopK T[n];
+  for (int q = 0; q < n; q++) {
+    result[q] = new_results(S, topk);
+  }
+  if (topk > 0) {
+    int duplicates_ok = duplicates_ok_cfg();
+    for (int q = 0; q < n; q++) {
+      topk_init(S, &T[q], result[q], duplicates_ok, bmasks[q_first + q]);
+    }
+    
+    // Each tile of signatures stays in cache while every query is scored against it
+    int tile = SEARCH_BATCH_TILE_BYTES / S->block.sig_stride;
+    if (tile < 1) tile = 1;
+    for (int start = 0; start < S->sigs_cached; start += tile) {
+      int count = S->sigs_cached - start;
+      if (count > tile) count = tile;
+      for (int q = 0; q < n; q++) {
+        topk_scan(S, &T[q], start, count, bsigs[q_first + q], bmasks[q_first + q]);
       }
+    }
+    for (int q = 0; q < n; q++) {
+      topk_free(&T[q]);
+    }
+  }
+  
+  for (int q = 0; q < n; q++) {
+    if (R[q_first + q]) {
+      MergeResults(R[q_first + q], result[q]);
     } else {
-      if ((dist < R->res[duplicate_found].dist) || ((dist == R->res[duplicate_found].dist) && (qual > R->res[duplicate_found].qual))) {
-        R->res[duplicate_found].docid_hash = docid_hash;
-        R->res[duplicate_found].dist = dist;
-        R->res[duplicate_found].qual = qual;
-      }
+      R[q_first + q] = result[q];
     }
   }
-  //printf("E\n");fflush(stdout);
-  return R;
 }
 
-Results *SearchCollection(Search *S, Signature *sig, const int topk)
+typedef struct {
+  Search *S;
+  int n;
+  int group;
+  volatile int next_group;
+  unsigned char **bsigs;
+  unsigned char **bmasks;
+  Results **R;
+  int topk;
+} BatchScanJob;
+
+static void *scan_block_batch_job(void *threaddata, void *input)
 {
-  Results *R = NULL;
+  (void)threaddata;
+  BatchScanJob *J = input;
+  for (;;) {
+    int q_first = atomic_add(&J->next_group, 1) * J->group;
+    if (q_first >= J->n) break;
+    int q_end = q_first + J->group;
+    if (q_end > J->n) q_end = J->n;
+    scan_query_range(J->S, J->R, q_first, q_end, J->topk, J->bsigs, J->bmasks);
+  }
+  return NULL;
+}
 
-  unsigned char bsig[S->cfg.length / 8];
-  unsigned char bmask[S->cfg.length / 8];
+// Scores the signatures currently described by S->block against n queries at
+// once and merges them into R[0..n-1]. With multithreading, groups of
+// queries are handed out to the pool threads.
+static void scan_block_batch(Search *S, Results **R, int n, const int topk, unsigned char **bsigs, unsigned char **bmasks)
+{
+  if (S->cfg.multithreading == 0) {
+    scan_query_range(S, R, 0, n, topk, bsigs, bmasks);
+    return;
+  }
   
-  FlattenSignature(sig, bsig, bmask);
+  BatchScanJob J;
+  J.S = S;
+  J.n = n;
+  J.group = n / (S->cfg.threads * SEARCH_CHUNKS_PER_THREAD);
+  if (J.group < 1) J.group = 1;
+  J.next_group = 0;
+  J.bsigs = bsigs;
+  J.bmasks = bmasks;
+  J.R = R;
+  J.topk = topk;
+  TBPDivideWork(S->pool, &J, scan_block_batch_job);
+}
+
+static void scan_current_block(Search *S, Results **R, int n, const int topk, unsigned char **bsigs, unsigned char **bmasks)
+{
+  // A single query is scored on its own, with the block divided between
+  // threads when multithreading
+  if (n == 1) {
+    R[0] = scan_block(S, R[0], topk, bsigs[0], bmasks[0]);
+  } else {
+    scan_block_batch(S, R, n, topk, bsigs, bmasks);
+  }
+}
+
+// Scans every signature in the collection for each of the n queries and
+// returns their unsorted top-k results
+static Results **scan_collection(Search *S, int n, const int topk, unsigned char **bsigs, unsigned char **bmasks)
+{
+  Results **R = malloc(sizeof(Results *) * n);
+  for (int q = 0; q < n; q++) {
+    R[q] = NULL;
+  }
   
-  // Calculate the size of each signature record
-  size_t sig_record_size = S->cfg.docnamelen + 1;
-  sig_record_size += 8 * 4; // 8 32-bit ints
-  sig_record_size += S->cfg.length / 8;
+  if (S->reader) {
+    // Score each block while the reader thread fetches the following ones
+    int sigs_scanned = 0;
+    do {
+      S->block = *SigReaderNext(S->reader);
+      S->sigs_cached = S->block.count;
+      scan_current_block(S, R, n, topk, bsigs, bmasks);
+      SigReaderRelease(S->reader);
+      sigs_scanned += S->sigs_cached;
+    } while (sigs_scanned < S->sigfile.num_signatures && S->sigs_cached > 0);
+  }
   
   // Determine the maximum number of signatures that can fit in the allocated cache
-  size_t max_cached_sigs = S->cache_size * 1024 * 1024 / sig_record_size;
+  size_t max_cached_sigs = SigFileBlockCapacity(&S->sigfile, (size_t)S->cache_size * 1024 * 1024);
   
-  int reached_end = 0;
+  int reached_end = (S->reader != NULL);
   while (!reached_end) {
     if (S->entire_file_cached != 1) {
       // Read as many signatures from the file as possible
       fprintf(stderr, "Reading from signature file... ");fflush(stderr);
-      size_t sigs_read = fread(S->cache, sig_record_size, max_cached_sigs, S->sig);
+      size_t sigs_read = SigFileReadBlock(&S->sigfile, S->sig, S->next_sig, max_cached_sigs, S->cache, &S->block);
+      S->next_sig += sigs_read;
       fprintf(stderr, "done\n");fflush(stderr);      
       if (S->entire_file_cached == -1) {
         if (sigs_read < max_cached_sigs) {
@@ -616,7 +891,7 @@ Results *SearchCollection(Search *S, Signature *sig, const int topk)
         if (S->entire_file_cached == 0) {
           if (sigs_read < max_cached_sigs) {
             // The end of the file has been reached so rewind for the next read
-            fseek(S->sig, S->cfg.headersize, SEEK_SET);
+            S->next_sig = 0;
             reached_end = 1;
           }
         }
@@ -626,26 +901,101 @@ Results *SearchCollection(Search *S, Signature *sig, const int topk)
       reached_end = 1;
     }
     
-    Results *result;
-    if (S->cfg.multithreading == 0) {
-      result = FindHighestScoring(S, 0, S->sigs_cached, topk, bsig, bmask);
-    } else {
-      result = FindHighestScoring_Threaded(S, 0, S->sigs_cached, topk, bsig, bmask, S->cfg.threads);
+    scan_current_block(S, R, n, topk, bsigs, bmasks);
+  }
+  
+  return R;
+}
+
+// Reranks the candidates found by a prefix scan at full width and cuts
+// them down to the top k
+static void rerank_prefix_candidates(Search *S, Results *R, const int topk, const unsigned char *bsig, const unsigned char *bmask)
+{
+  for (int i = 0; i < R->k; i++) {
+    if (R->res[i].dist != INT_MAX) {
+      R->res[i].dist = DocumentDistance(S->cfg.length, bsig, bmask, R->res[i].signature);
     }
-    
-    if (R) {
-      MergeResults(R, result);
-    } else {
-      R = result;
+  }
+  qsort(R->res, R->k, sizeof(R->res[0]), result_compar);
+  for (int i = topk; i < R->k; i++) {
+    freeresult(&R->res[i]);
+  }
+  R->k = topk;
+}
+
+// Fraction of the full-width top k that the prefix search also found
+static double prefix_recall(const Results *prefix, const Results *full)
+{
+  int found = 0, total = 0;
+  for (int i = 0; i < full->k; i++) {
+    if (full->res[i].dist == INT_MAX) continue;
+    total++;
+    for (int j = 0; j < prefix->k; j++) {
+      if (strcmp(full->res[i].docid, prefix->res[j].docid) == 0) {
+        found++;
+        break;
+      }
     }
   }
+  return total ? (double)found / total : 1.0;
+}
+
+Results **SearchCollectionBatch(Search *S, Signature **sigs, int n, const int topk)
+{
+  unsigned char *bsigs[n];
+  unsigned char *bmasks[n];
+  for (int q = 0; q < n; q++) {
+    bsigs[q] = malloc(S->cfg.length / 8);
+    bmasks[q] = malloc(S->cfg.length / 8);
+    FlattenSignature(sigs[q], bsigs[q], bmasks[q]);
+  }
   
-  qsort(R->res, topk, sizeof(R->res[0]), result_compar);
+  // A prefix search gathers a larger pool of candidates by the first
+  // SEARCH-PREFIX-BITS bits of each signature to be reranked afterwards
+  int scan_k = topk;
+  if (S->cfg.prefix_bits) scan_k = topk * S->cfg.prefix_candidates;
+  Results **R = scan_collection(S, n, scan_k, bsigs, bmasks);
   
-  if (S->cfg.pseudofeedback > 0) {
-    ApplyBlindFeedback(S, R, S->cfg.pseudofeedback);
+  Results **full = NULL;
+  if (S->cfg.prefix_bits && S->cfg.prefix_recall) {
+    S->scan_width = S->cfg.length;
+    full = scan_collection(S, n, topk, bsigs, bmasks);
+    S->scan_width = S->cfg.prefix_bits;
   }
+  
+  for (int q = 0; q < n; q++) {
+    qsort(R[q]->res, scan_k, sizeof(R[q]->res[0]), result_compar);
+    
+    if (S->cfg.early_abandon && R[q]->words_total > 0) {
+      fprintf(stderr, "Early abandon: %lld of %lld signature words evaluated (%.1f%% saved)\n", R[q]->words_evaluated, R[q]->words_total, 100.0 * (R[q]->words_total - R[q]->words_evaluated) / R[q]->words_total);
+    }
+    
+    if (S->cfg.prefix_bits) {
+      rerank_prefix_candidates(S, R[q], topk, bsigs[q], bmasks[q]);
+      if (full) {
+        qsort(full[q]->res, topk, sizeof(full[q]->res[0]), result_compar);
+        fprintf(stderr, "Prefix search: recall %.3f of the full-width top %d\n", prefix_recall(R[q], full[q]), topk);
+        FreeResults(full[q]);
+      }
+    }
     
+    if (S->cfg.pseudofeedback > 0) {
+      ApplyBlindFeedback(S, R[q], S->cfg.pseudofeedback);
+    }
+    free(bsigs[q]);
+    free(bmasks[q]);
+  }
+  
+  free(full);
+  
+  return R;
+}
+
+Results *SearchCollection(Search *S, Signature *sig, const int topk)
+{
+  Results **batch = SearchCollectionBatch(S, &sig, 1, topk);
+  Results *R = batch[0];
+  free(batch);
   return R;
 }
 
@@ -673,11 +1023,6 @@ void Writer_trec(FILE *out, const char *topic_id, Results *R)
   }
 }
 
-static void freeresult(struct Result *R)
-{
-  free(R->docid);
-  free(R->signature);
-}
 void FreeResults(Results *R)
 {
   for (int i = 0; i < R->k; i++) {
@@ -688,6 +1033,16 @@ void FreeResults(Results *R)
 
 void FreeSearch(Search *S)
 {
+  if (S->map) {
+    SigFileUnmap(S->map, S->map_size);
+  }
+  if (S->reader) {
+    SigReaderStop(S->reader);
+  }
+  if (S->pool) {
+    TBPClose(S->pool);
+    free(S->pool_ids);
+  }
   fclose(S->sig);
   DestroySignatureCache(S->sigcache);
   free(S->cache);
@@ -2,6 +2,7 @@
 #define TOPSIG_SEARCH_H
 
 #include "topsig-signature.h"
+#include "topsig-hamming.h"
 
 struct Search;
 typedef struct Search Search;
@@ -12,14 +13,15 @@ typedef struct Results Results;
 Search *InitSearch();
 Results *SearchCollection(Search *, Signature *sig, const int topk);
 Results *SearchCollectionQuery(Search *S, const char *query, const int topk);
+// Searches for n queries in a single pass over the collection, returning an
+// array of n result lists
+Results **SearchCollectionBatch(Search *S, Signature **sigs, int n, const int topk);
 void PrintResults(Results *, int topk);
 void FreeResults(Results *);
 void FreeSearch(Search *);
 
 Signature *CreateQuerySignature(Search *S, const char *query);
 
-int DocumentDistance(int sigwidth, const unsigned char *bsig, const unsigned char *bmask, const unsigned char *dsig);
-
 Results *FindHighestScoring(Search *S, const int start, const int count, const int topk, unsigned char *bsig, unsigned char *bmask);
 
 void MergeResults(Results *, Results *);
@@ -2,35 +2,90 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <sched.h>
+#include <unistd.h>
 #include <assert.h>
 #include "topsig-semaphore.h"
 #include "topsig-atomic.h"
 #include "topsig-thread.h"
 
+#define TSEM_MIN_SPIN 16
+#define TSEM_MAX_SPIN 2000
+
+static int blocking = 1;
+static int max_spin = -1;
+
+void tsem_set_blocking(int b)
+{
+  blocking = b;
+}
+
 void tsem_init(TSemaphore *S, int compat, int val)
 {
   assert(compat==0);
+  if (max_spin == -1) {
+    // Spinning only helps when the poster can run at the same time
+    max_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TSEM_MAX_SPIN : 0;
+  }
   S->val = val;
+  S->sleepers = 0;
+  S->spin = 0;
+  pthread_mutex_init(&S->lock, NULL);
+  pthread_cond_init(&S->posted, NULL);
+}
+
+void tsem_destroy(TSemaphore *S)
+{
+  pthread_mutex_destroy(&S->lock);
+  pthread_cond_destroy(&S->posted);
+}
+
+static inline void cpu_relax()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#endif
 }
 
 void tsem_wait(TSemaphore *S)
 {
-  for (;;) {
-    if (S->val > 0) {
-      int r = atomic_sub(&S->val, 1);
-      if (r > 0) break;
-      atomic_add(&S->val, 1);
+  if (!blocking) {
+    while (tsem_trywait(S) != 0) {
+      ThreadYield();
     }
-    ThreadYield();
+    return;
   }
+  
+  // Spin for up to twice as long as it has recently taken, moving the
+  // estimate an eighth of the way towards this time
+  int limit = 2 * S->spin + TSEM_MIN_SPIN;
+  if (limit > max_spin) limit = max_spin;
+  for (int i = 0; i < limit; i++) {
+    if (tsem_trywait(S) == 0) {
+      S->spin += (i - S->spin) / 8;
+      return;
+    }
+    cpu_relax();
+  }
+  S->spin += (limit - S->spin) / 8;
+  
+  // The sleeper count is raised before checking the value again, so a
+  // post either leaves a value to take or sees the sleeper and signals
+  pthread_mutex_lock(&S->lock);
+  atomic_add(&S->sleepers, 1);
+  while (tsem_trywait(S) != 0) {
+    pthread_cond_wait(&S->posted, &S->lock);
+  }
+  atomic_sub(&S->sleepers, 1);
+  pthread_mutex_unlock(&S->lock);
 }
 
+// The value never drops below zero, even briefly, or a waiter about to
+// sleep could miss a post
 int tsem_trywait(TSemaphore *S)
 {
-  if (S->val > 0) {
-    int r = atomic_sub(&S->val, 1);
-    if (r > 0) return 0;
-    atomic_add(&S->val, 1);
+  int v;
+  while ((v = S->val) > 0) {
+    if (atomic_cas(&S->val, v, v - 1)) return 0;
   }
   return -1;
 }
@@ -38,6 +93,11 @@ int tsem_trywait(TSemaphore *S)
 void tsem_post(TSemaphore *S)
 {
   atomic_add(&S->val, 1);
+  if (atomic_add(&S->sleepers, 0) > 0) {
+    pthread_mutex_lock(&S->lock);
+    pthread_cond_signal(&S->posted);
+    pthread_mutex_unlock(&S->lock);
+  }
 }
 
 void tsem_getvalue(TSemaphore *S, int *out)
@@ -1,14 +1,30 @@
 #ifndef TOPSIG_SEMAPHORE_H
 #define TOPSIG_SEMAPHORE_H
 
+#include <pthread.h>
+
+// A counting semaphore. tsem_wait spins briefly in case the semaphore is
+// posted soon, then sleeps until it is posted. The length of the spin
+// adapts to how long the semaphore has recently taken to become available.
+
 typedef struct {
   volatile int val;
+  volatile int sleepers;
+  int spin; // recent spins needed to take the semaphore
+  pthread_mutex_t lock;
+  pthread_cond_t posted;
 } TSemaphore;
 
 void tsem_init(TSemaphore *S, int compat, int val);
+void tsem_destroy(TSemaphore *S);
 void tsem_wait(TSemaphore *S);
 int tsem_trywait(TSemaphore *S);
 void tsem_post(TSemaphore *S);
 void tsem_getvalue(TSemaphore *S, int *out);
 
+// With blocking off, tsem_wait never sleeps and yields the processor
+// between attempts instead. Only used by benchmark-threading to compare
+// against this.
+void tsem_set_blocking(int blocking);
+
 #endif
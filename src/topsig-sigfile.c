@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#if !(defined(WINDOWS) || defined(_WIN32) || defined(_WIN64))
+#include <fcntl.h>
+#include <sys/mman.h>
+#define SIGFILE_HAVE_MMAP
+#endif
+#include "topsig-sigfile.h"
+#include "topsig-global.h"
+
+static size_t align_up(size_t n)
+{
+  return (n + SIGFILE_ALIGNMENT - 1) / SIGFILE_ALIGNMENT * SIGFILE_ALIGNMENT;
+}
+
+// Fills in B for n signatures whose sections start at the given pointers
+static void describe_block(const SigFileHeader *H, const unsigned char *base, const unsigned char *headers, const unsigned char *offsets, const unsigned char *strings, int n, SigBlock *B)
+{
+  B->first = 0;
+  B->count = n;
+  if (H->version < 3) {
+    B->sigs = base + H->sig_offset;
+    B->sig_stride = H->record_size;
+    B->headers = base + H->max_name_len + 1;
+    B->header_stride = H->record_size;
+    B->docids = (const char *)base;
+    B->docid_stride = H->record_size;
+    B->docid_offsets = NULL;
+  } else {
+    B->sigs = base;
+    B->sig_stride = H->sig_bytes;
+    B->headers = headers;
+    B->header_stride = SIGFILE_HEADER_FIELDS_SIZE;
+    B->docids = (const char *)strings;
+    B->docid_stride = 0;
+    B->docid_offsets = offsets;
+  }
+}
+
+SigFileHeader SigFileReadHeader(FILE *fp)
+{
+  SigFileHeader H;
+  memset(&H, 0, sizeof(H));
+
+  H.header_size = file_read32(fp); // header-size
+  H.version = file_read32(fp); // version
+  H.max_name_len = file_read32(fp); // maxnamelen
+  H.sig_width = file_read32(fp); // sig-width
+  H.sig_density = file_read32(fp); // sig-density
+  if (H.version >= 2) {
+    H.sig_seed = file_read32(fp); // sig-seed
+  }
+  fread(H.sig_method, 1, 64, fp); // sig-method
+  H.sig_method[63] = '\0';
+
+  if (H.version > 3) {
+    fprintf(stderr, "Error: signature file version %d not supported.\n", H.version);
+    exit(1);
+  }
+
+  H.sig_bytes = H.sig_width / 8;
+  H.sig_offset = H.max_name_len + 1;
+  H.sig_offset += SIGFILE_HEADER_FIELDS_SIZE;
+  H.record_size = H.sig_offset + H.sig_bytes;
+
+  if (H.version >= 3) {
+    H.num_signatures = file_read32(fp); // signature-count
+    if (file_read32(fp) != SIGFILE_HEADER_FIELDS) { // header-fields
+      fprintf(stderr, "Error: unexpected number of signature header fields.\n");
+      exit(1);
+    }
+    H.sigs_offset = file_read64(fp);
+    H.headers_offset = file_read64(fp);
+    H.docid_offsets_offset = file_read64(fp);
+    H.docid_strings_offset = file_read64(fp);
+    H.docid_strings_size = file_read64(fp);
+    fseeko(fp, H.sigs_offset, SEEK_SET);
+  } else {
+    fseeko(fp, 0, SEEK_END);
+    H.num_signatures = (ftello(fp) - H.header_size) / H.record_size;
+    fseeko(fp, H.header_size, SEEK_SET);
+  }
+
+  return H;
+}
+
+size_t SigFileBlockSize(const SigFileHeader *H, int n)
+{
+  if (H->version < 3) {
+    return H->record_size * n;
+  }
+  size_t sz = align_up(H->sig_bytes * n);
+  sz += align_up((size_t)SIGFILE_HEADER_FIELDS_SIZE * n);
+  sz += align_up(sizeof(long long) * (n + 1));
+  sz += (size_t)(H->max_name_len + 1) * n;
+  return sz;
+}
+
+int SigFileBlockCapacity(const SigFileHeader *H, size_t bytes)
+{
+  if (H->version < 3) {
+    return bytes / H->record_size;
+  }
+  int n = bytes / (H->sig_bytes + SIGFILE_HEADER_FIELDS_SIZE + sizeof(long long) + H->max_name_len + 1);
+  while (n > 0 && SigFileBlockSize(H, n) > bytes) n--;
+  return n;
+}
+
+int SigFileReadBlock(const SigFileHeader *H, FILE *fp, int first, int n, unsigned char *buffer, SigBlock *B)
+{
+  if (first + n > H->num_signatures) n = H->num_signatures - first;
+  if (n < 0) n = 0;
+
+  if (H->version < 3) {
+    fseeko(fp, H->header_size + (off_t)H->record_size * first, SEEK_SET);
+    n = fread(buffer, H->record_size, n, fp);
+    describe_block(H, buffer, NULL, NULL, NULL, n, B);
+    B->first = first;
+    return n;
+  }
+
+  unsigned char *sigs = buffer;
+  unsigned char *headers = sigs + align_up(H->sig_bytes * n);
+  unsigned char *offsets = headers + align_up((size_t)SIGFILE_HEADER_FIELDS_SIZE * n);
+  unsigned char *strings = offsets + align_up(sizeof(long long) * (n + 1));
+
+  fseeko(fp, H->sigs_offset + (off_t)H->sig_bytes * first, SEEK_SET);
+  n = fread(sigs, H->sig_bytes, n, fp);
+  fseeko(fp, H->headers_offset + (off_t)SIGFILE_HEADER_FIELDS_SIZE * first, SEEK_SET);
+  fread(headers, SIGFILE_HEADER_FIELDS_SIZE, n, fp);
+  fseeko(fp, H->docid_offsets_offset + (off_t)sizeof(long long) * first, SEEK_SET);
+  fread(offsets, sizeof(long long), n + 1, fp);
+  long long strings_begin = mem_read64(offsets);
+  long long strings_end = mem_read64(offsets + sizeof(long long) * n);
+  fseeko(fp, H->docid_strings_offset + strings_begin, SEEK_SET);
+  fread(strings, 1, strings_end - strings_begin, fp);
+
+  describe_block(H, sigs, headers, offsets, strings, n, B);
+  B->first = first;
+  return n;
+}
+
+void SigFileAdviseBlock(const SigFileHeader *H, FILE *fp, int first, int n)
+{
+#if defined(SIGFILE_HAVE_MMAP) && defined(POSIX_FADV_WILLNEED)
+  if (first + n > H->num_signatures) n = H->num_signatures - first;
+  if (n <= 0) return;
+  int fd = fileno(fp);
+  if (H->version < 3) {
+    posix_fadvise(fd, H->header_size + (off_t)H->record_size * first, (off_t)H->record_size * n, POSIX_FADV_WILLNEED);
+  } else {
+    posix_fadvise(fd, H->sigs_offset + (off_t)H->sig_bytes * first, (off_t)H->sig_bytes * n, POSIX_FADV_WILLNEED);
+    posix_fadvise(fd, H->headers_offset + (off_t)SIGFILE_HEADER_FIELDS_SIZE * first, (off_t)SIGFILE_HEADER_FIELDS_SIZE * n, POSIX_FADV_WILLNEED);
+  }
+#else
+  (void)H;
+  (void)fp;
+  (void)first;
+  (void)n;
+#endif
+}
+
+unsigned char *SigFileLoad(const SigFileHeader *H, FILE *fp, SigBlock *B)
+{
+  size_t sz = SigFileBlockSize(H, H->num_signatures);
+  unsigned char *buffer = malloc(sz);
+  if (!buffer) {
+    double mb = (double)sz / 1048576.0;
+    fprintf(stderr, "Error: unable to allocate memory to store signature file (%.2f MB)\n", mb);
+    exit(1);
+  }
+  SigFileReadBlock(H, fp, 0, H->num_signatures, buffer, B);
+  return buffer;
+}
+
+void *SigFileMap(const SigFileHeader *H, FILE *fp, SigBlock *B, size_t *map_size)
+{
+#ifdef SIGFILE_HAVE_MMAP
+  fseeko(fp, 0, SEEK_END);
+  size_t sz = ftello(fp);
+  if (sz == 0) return NULL;
+
+  unsigned char *map = mmap(NULL, sz, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  if (map == MAP_FAILED) return NULL;
+
+  // Searches scan the file from start to end, so ask for aggressive
+  // read-ahead and start paging it in now
+  madvise(map, sz, MADV_SEQUENTIAL);
+  madvise(map, sz, MADV_WILLNEED);
+
+  if (H->version < 3) {
+    describe_block(H, map + H->header_size, NULL, NULL, NULL, H->num_signatures, B);
+  } else {
+    describe_block(H, map + H->sigs_offset, map + H->headers_offset, map + H->docid_offsets_offset, map + H->docid_strings_offset, H->num_signatures, B);
+  }
+  *map_size = sz;
+  return map;
+#else
+  (void)H;
+  (void)fp;
+  (void)B;
+  (void)map_size;
+  return NULL;
+#endif
+}
+
+void SigFileUnmap(void *map, size_t map_size)
+{
+#ifdef SIGFILE_HAVE_MMAP
+  munmap(map, map_size);
+#else
+  (void)map;
+  (void)map_size;
+#endif
+}
+
+struct SigFileWriter {
+  FILE *fp;
+  SigFileHeader H;
+
+  // Version 3 sections are staged in temporary files until SigFileClose
+  FILE *headers_tmp;
+  FILE *offsets_tmp;
+  FILE *strings_tmp;
+};
+
+static void write_header(SigFileWriter *W)
+{
+  // SIGNATURE FILE FORMAT is:
+  // (int = 32-bit little endian, int64 = 64-bit little endian)
+  // int header-size (in bytes, including this)
+  // int version
+  // int maxnamelen
+  // int sig-width
+  // int sig-density
+  // int sig-seed
+  // char[64] sig-method (null-terminated)
+  // Version 3 continues with:
+  // int signature-count
+  // int header-fields
+  // int64 sigs-offset
+  // int64 headers-offset
+  // int64 docid-offsets-offset
+  // int64 docid-strings-offset
+  // int64 docid-strings-size
+  SigFileHeader *H = &W->H;
+
+  file_write32(H->header_size, W->fp);
+  file_write32(H->version, W->fp);
+  file_write32(H->max_name_len, W->fp);
+  file_write32(H->sig_width, W->fp);
+  file_write32(H->sig_density, W->fp);
+  file_write32(H->sig_seed, W->fp);
+  fwrite(H->sig_method, 1, 64, W->fp);
+  if (H->version >= 3) {
+    file_write32(H->num_signatures, W->fp);
+    file_write32(SIGFILE_HEADER_FIELDS, W->fp);
+    file_write64(H->sigs_offset, W->fp);
+    file_write64(H->headers_offset, W->fp);
+    file_write64(H->docid_offsets_offset, W->fp);
+    file_write64(H->docid_strings_offset, W->fp);
+    file_write64(H->docid_strings_size, W->fp);
+  }
+}
+
+static void pad_to_alignment(FILE *fp)
+{
+  while (ftello(fp) % SIGFILE_ALIGNMENT != 0) {
+    fputc(0, fp);
+  }
+}
+
+static void append_file(FILE *dest, FILE *src)
+{
+  char buf[65536];
+  size_t len;
+  rewind(src);
+  while ((len = fread(buf, 1, sizeof(buf), src)) > 0) {
+    fwrite(buf, 1, len, dest);
+  }
+}
+
+SigFileWriter *SigFileCreate(const char *path, const SigFileHeader *H)
+{
+  SigFileWriter *W = malloc(sizeof(SigFileWriter));
+  W->H = *H;
+  W->H.num_signatures = 0;
+  W->H.sig_bytes = H->sig_width / 8;
+  W->headers_tmp = NULL;
+  W->offsets_tmp = NULL;
+  W->strings_tmp = NULL;
+
+  if (W->H.version != 2 && W->H.version != 3) {
+    fprintf(stderr, "Error: signature files can only be written as version 2 or 3.\n");
+    exit(1);
+  }
+
+  W->fp = fopen(path, "wb");
+  if (!W->fp) {
+    fprintf(stderr, "Unable to open signature file %s for writing.\n", path);
+    exit(1);
+  }
+
+  if (W->H.version == 2) {
+    W->H.header_size = 6 * 4 + 64;
+  } else {
+    W->H.header_size = 8 * 4 + 64 + 5 * 8;
+    W->H.sigs_offset = align_up(W->H.header_size);
+    W->H.docid_strings_size = 0;
+    W->headers_tmp = tmpfile();
+    W->offsets_tmp = tmpfile();
+    W->strings_tmp = tmpfile();
+    if (!W->headers_tmp || !W->offsets_tmp || !W->strings_tmp) {
+      fprintf(stderr, "Unable to create temporary files for signature file.\n");
+      exit(1);
+    }
+  }
+  write_header(W);
+  if (W->H.version >= 3) {
+    pad_to_alignment(W->fp);
+  }
+
+  return W;
+}
+
+void SigFileWrite(SigFileWriter *W, const char *docid, const int *header_fields, const unsigned char *bsig)
+{
+  SigFileHeader *H = &W->H;
+
+  // Document ids longer than maxnamelen are clipped
+  int docid_len = strlen(docid);
+  if (docid_len > H->max_name_len) docid_len = H->max_name_len;
+
+  if (H->version == 2) {
+    char sigheader[H->max_name_len + 1];
+    memset(sigheader, 0, H->max_name_len + 1);
+    memcpy(sigheader, docid, docid_len);
+    fwrite(sigheader, 1, sizeof(sigheader), W->fp);
+    for (int i = 0; i < SIGFILE_HEADER_FIELDS; i++) {
+      file_write32(header_fields[i], W->fp);
+    }
+    fwrite(bsig, 1, H->sig_bytes, W->fp);
+  } else {
+    fwrite(bsig, 1, H->sig_bytes, W->fp);
+    for (int i = 0; i < SIGFILE_HEADER_FIELDS; i++) {
+      file_write32(header_fields[i], W->headers_tmp);
+    }
+    file_write64(H->docid_strings_size, W->offsets_tmp);
+    fwrite(docid, 1, docid_len, W->strings_tmp);
+    fputc('\0', W->strings_tmp);
+    H->docid_strings_size += docid_len + 1;
+  }
+  H->num_signatures++;
+}
+
+void SigFileClose(SigFileWriter *W)
+{
+  SigFileHeader *H = &W->H;
+  if (H->version >= 3) {
+    file_write64(H->docid_strings_size, W->offsets_tmp);
+
+    pad_to_alignment(W->fp);
+    H->headers_offset = ftello(W->fp);
+    append_file(W->fp, W->headers_tmp);
+    pad_to_alignment(W->fp);
+    H->docid_offsets_offset = ftello(W->fp);
+    append_file(W->fp, W->offsets_tmp);
+    pad_to_alignment(W->fp);
+    H->docid_strings_offset = ftello(W->fp);
+    append_file(W->fp, W->strings_tmp);
+
+    fclose(W->headers_tmp);
+    fclose(W->offsets_tmp);
+    fclose(W->strings_tmp);
+
+    fseeko(W->fp, 0, SEEK_SET);
+    write_header(W);
+  }
+  fclose(W->fp);
+  free(W);
+}
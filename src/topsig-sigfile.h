@@ -0,0 +1,121 @@
+#ifndef TOPSIG_SIGFILE_H
+#define TOPSIG_SIGFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "topsig-global.h"
+
+// Reading and writing of signature files. This module does not depend on
+// the configuration system so that the tools in src/tools can use it too.
+//
+// Version 2 files store one record per signature: the docid (zero-padded to
+// maxnamelen+1 bytes), 8 32-bit header fields and the signature bits.
+//
+// Version 3 files are columnar. After the file header come three sections,
+// each starting on a 64-byte boundary:
+//   the bit matrix (signature i at sigs_offset + i * sig-width/8)
+//   the packed header fields (8 32-bit ints per signature)
+//   the docid table: signature-count+1 64-bit offsets into a block of
+//     null-terminated docid strings that follows them
+
+#define SIGFILE_HEADER_FIELDS 8
+#define SIGFILE_HEADER_FIELDS_SIZE (SIGFILE_HEADER_FIELDS * 4)
+#define SIGFILE_ALIGNMENT 64
+
+// Header field 7 holds a hash of the docid (see DocidHash), or 0 in files
+// written before it was recorded
+#define SIGFILE_FIELD_DOCID_HASH 6
+
+typedef struct {
+  int header_size;
+  int version;
+  int max_name_len;
+  int sig_width;
+  int sig_density;
+  int sig_seed;
+  char sig_method[64];
+
+  int num_signatures;
+  size_t sig_bytes; // sig_width / 8
+
+  // Version 2 record layout
+  size_t sig_offset;
+  size_t record_size;
+
+  // Version 3 section offsets
+  long long sigs_offset;
+  long long headers_offset;
+  long long docid_offsets_offset;
+  long long docid_strings_offset;
+  long long docid_strings_size;
+} SigFileHeader;
+
+// A run of consecutive signatures held in memory, in either layout
+typedef struct {
+  int first;
+  int count;
+  const unsigned char *sigs;
+  size_t sig_stride;
+  const unsigned char *headers;
+  size_t header_stride;
+  const char *docids;
+  size_t docid_stride; // version 2: fixed-width docids
+  const unsigned char *docid_offsets; // version 3: count+1 offsets into docids
+} SigBlock;
+
+static inline const unsigned char *SigBlockSignature(const SigBlock *B, int i)
+{
+  return B->sigs + B->sig_stride * i;
+}
+
+static inline const unsigned char *SigBlockHeader(const SigBlock *B, int i)
+{
+  return B->headers + B->header_stride * i;
+}
+
+static inline int SigBlockHeaderField(const SigBlock *B, int i, int field)
+{
+  return mem_read32(SigBlockHeader(B, i) + field * 4);
+}
+
+static inline const char *SigBlockDocid(const SigBlock *B, int i)
+{
+  if (B->docid_offsets) {
+    return B->docids + (mem_read64(B->docid_offsets + 8 * i) - mem_read64(B->docid_offsets));
+  }
+  return B->docids + B->docid_stride * i;
+}
+
+// Reads the file header and positions fp at the first signature
+SigFileHeader SigFileReadHeader(FILE *fp);
+
+// Bytes of buffer needed to hold n signatures, and the inverse
+size_t SigFileBlockSize(const SigFileHeader *H, int n);
+int SigFileBlockCapacity(const SigFileHeader *H, size_t bytes);
+
+// Reads up to n signatures starting from signature 'first' into buffer and
+// describes them in B. Returns the number of signatures read.
+int SigFileReadBlock(const SigFileHeader *H, FILE *fp, int first, int n, unsigned char *buffer, SigBlock *B);
+
+// Tells the OS that signatures first..first+n-1 will be read soon
+void SigFileAdviseBlock(const SigFileHeader *H, FILE *fp, int first, int n);
+
+// Reads every signature in the file into a newly allocated buffer
+unsigned char *SigFileLoad(const SigFileHeader *H, FILE *fp, SigBlock *B);
+
+// Maps the whole file read-only and describes every signature in B without
+// copying. The mapping is returned and must be released with SigFileUnmap.
+// Returns NULL if the file could not be mapped.
+void *SigFileMap(const SigFileHeader *H, FILE *fp, SigBlock *B, size_t *map_size);
+void SigFileUnmap(void *map, size_t map_size);
+
+struct SigFileWriter;
+typedef struct SigFileWriter SigFileWriter;
+
+// Creates a signature file with the version, name length and signature
+// parameters given in H.
+SigFileWriter *SigFileCreate(const char *path, const SigFileHeader *H);
+void SigFileWrite(SigFileWriter *W, const char *docid, const int *header_fields, const unsigned char *bsig);
+void SigFileClose(SigFileWriter *W);
+
+#endif /* TOPSIG_SIGFILE_H */
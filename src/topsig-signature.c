@@ -13,6 +13,8 @@
 #include "uthash.h"
 #include "topsig-semaphore.h"
 #include "topsig-stats.h"
+#include "topsig-sigfile.h"
+#include "superfasthash.h"
 
 struct cacheterm {
   UT_hash_handle hh;
@@ -39,7 +41,6 @@ struct Signature {
   int quality;
   int offset_begin;
   int offset_end;
-  int unused_7;
   int unused_8;
   
   int S[1];
@@ -52,6 +53,7 @@ static struct {
   int docnamelen;
   int termcachesize;
   int thread_mode;
+  int file_version;
   
   enum {
     TRADITIONAL,
@@ -83,12 +85,13 @@ SignatureCache *NewSignatureCache(int iswriter, int iscached)
 void DestroySignatureCache(SignatureCache *C)
 {
   if (C->cache_list) {
+    // The hash table is reached through its first term, so it goes first
+    HASH_CLEAR(hh, C->cache_map);
+    
     for (int i = 0; i < cfg.termcachesize; i++) {
       if (C->cache_list[i]) free(C->cache_list[i]);
     }
     free(C->cache_list);
-    
-    HASH_CLEAR(hh, C->cache_map);
   }
   free(C);
 }
@@ -163,7 +166,6 @@ void SignatureSetValues(Signature *sig, Document *doc) {
   sig->quality = DocumentQuality(doc);
   // offset_begin and offset_end not touched here
   
-  sig->unused_7 = 0;
   sig->unused_8 = 0;
 }
 
@@ -327,94 +329,71 @@ static void sig_SKIP_add(int *sig, randctx *R) {
 #define SIGCACHESIZE 4096
 static volatile struct {
   Signature *sigs[SIGCACHESIZE];
-  FILE *fp;
+  SigFileWriter *writer;
   struct {
     int available;
     int complete;
     int written;
+    int stalls; // writes that found the cache full
   } state;
 } cache;
 TSemaphore sem_cachefree;
 TSemaphore sem_cacheused[SIGCACHESIZE];
+// Posted once for each signature left for a separate writer thread, and
+// once more to stop it
+TSemaphore sem_writerwake;
+static volatile int writer_stopping;
 
 static void initcache()
 {
-  cache.fp = fopen(Config("SIGNATURE-PATH"), "wb");
   tsem_init(&sem_cachefree, 0, SIGCACHESIZE);
   for (int i = 0; i < SIGCACHESIZE; i++) {
     tsem_init(&sem_cacheused[i], 0, 0);
   }
+  tsem_init(&sem_writerwake, 0, 0);
+  writer_stopping = 0;
   
-  // Write out the signature file header
-  // SIGNATURE FILE FORMAT is:
-  // (int = 32-bit little endian)
-  // int header-size (in bytes, including this)
-  // int version
-  // int maxnamelen
-  // int sig-width
-  // int sig-density
-  // int sig-seed
-  // char[64] sig-method (null-terminated)
-  
-  int header_size = 6 * 4 + 64;
-  int version = 2;
-  int maxnamelen = cfg.docnamelen;
-  int sig_width = cfg.length;
-  int sig_density = cfg.density;
-  int sig_seed = cfg.seed;
-  char sig_method[64] = {0};
+  // Create the signature file. The layouts of versions 2 and 3 are
+  // described in topsig-sigfile.h
+  SigFileHeader H;
+  memset(&H, 0, sizeof(H));
+  H.version = cfg.file_version;
+  H.max_name_len = cfg.docnamelen;
+  H.sig_width = cfg.length;
+  H.sig_density = cfg.density;
+  H.sig_seed = cfg.seed;
+  strncpy(H.sig_method, Config("SIGNATURE-METHOD"), 63);
   
-  strncpy(sig_method, Config("SIGNATURE-METHOD"), 64);
-  
-  file_write32(header_size, cache.fp);
-  file_write32(version, cache.fp);
-  file_write32(maxnamelen, cache.fp);
-  file_write32(sig_width, cache.fp);
-  file_write32(sig_density, cache.fp);
-  file_write32(sig_seed, cache.fp);
-  fwrite(sig_method, 1, 64, cache.fp);
+  cache.writer = SigFileCreate(Config("SIGNATURE-PATH"), &H);
+}
+
+unsigned int DocidHash(const char *docid, int len)
+{
+  // The low bit is always set so that a zero header field identifies
+  // signature files written without stored hashes
+  return SuperFastHash(docid, len) | 1;
 }
 
 static void dumpsignature(Signature *sig)
 {
-  // Write out the signature header
-  
   // Each signature has a header consisting of the document id (as a null-terminated string of maximum length defined in config)
   // and 8 signed 32-bit little-endian integer values (to allow room for expansion)
-  //int unique_terms;
-  //int document_char_length;
-  //int total_terms;
-  //int quality;
-  //int unused_5;
-  //int unused_6;
-  //int unused_7;
-  //int unused_8;
-  int docnamelen = cfg.docnamelen;
-  //printf("Testing printf\n");
-  //printf("Testing printf with val %d\n", 166);
-  //printf("docnamelen: %d\n", docnamelen);
-  char sigheader[cfg.docnamelen+1];
-  memset(sigheader, 0, cfg.docnamelen+1);
-  //printf("Sizeof %d\n", sizeof(sigheader));
-  
-  //strncpy((char *)sigheader, sig->id, cfg.docnamelen);
-  strcpy(sigheader, sig->id);
-  sigheader[cfg.docnamelen] = '\0'; // clip
-  
-  fwrite(sigheader, 1, sizeof(sigheader), cache.fp);
-
-  file_write32(sig->unique_terms, cache.fp);
-  file_write32(sig->document_char_length, cache.fp);
-  file_write32(sig->total_terms, cache.fp);
-  file_write32(sig->quality, cache.fp);
-  file_write32(sig->offset_begin, cache.fp);
-  file_write32(sig->offset_end, cache.fp);
-  file_write32(sig->unused_7, cache.fp);
-  file_write32(sig->unused_8, cache.fp);
+  int docid_len = strlen(sig->id);
+  if (docid_len > cfg.docnamelen) docid_len = cfg.docnamelen;
+  int header_fields[SIGFILE_HEADER_FIELDS] = {
+    sig->unique_terms,
+    sig->document_char_length,
+    sig->total_terms,
+    sig->quality,
+    sig->offset_begin,
+    sig->offset_end,
+    DocidHash(sig->id, docid_len),
+    sig->unused_8
+  };
   
   unsigned char bsig[cfg.length / 8];
   FlattenSignature(sig, bsig, NULL);
-  fwrite(bsig, 1, cfg.length / 8, cache.fp);
+  SigFileWrite(cache.writer, sig->id, header_fields, bsig);
 }
 
 void SignatureWrite(SignatureCache *C, Signature *sig, const char *docid)
@@ -424,7 +403,10 @@ void SignatureWrite(SignatureCache *C, Signature *sig, const char *docid)
   // will be called at the end to write out any remaining
   // signatures
   
-  tsem_wait(&sem_cachefree);
+  if (tsem_trywait(&sem_cachefree) != 0) {
+    atomic_add(&cache.state.stalls, 1);
+    tsem_wait(&sem_cachefree);
+  }
 
   int available = atomic_add(&cache.state.available, 1);
 
@@ -433,6 +415,8 @@ void SignatureWrite(SignatureCache *C, Signature *sig, const char *docid)
   tsem_post(&sem_cacheused[available % SIGCACHESIZE]);
   if (C->iswriter) {
     SignatureFlush();
+  } else {
+    tsem_post(&sem_writerwake);
   }
 }
 
@@ -446,6 +430,44 @@ void SignatureFlush()
   };
 }
 
+// A signature finishing out of order wakes the writer without anything to
+// write, but the signature before it wakes the writer again when it is done
+void SignatureWriterRun()
+{
+  for (;;) {
+    tsem_wait(&sem_writerwake);
+    SignatureFlush();
+    // A signature may have been handed over after the flush looked for
+    // it. Every worker has finished once stopping is set, so one more
+    // flush writes whatever is left.
+    if (writer_stopping) {
+      SignatureFlush();
+      break;
+    }
+  }
+}
+
+void SignatureWriterStop()
+{
+  writer_stopping = 1;
+  tsem_post(&sem_writerwake);
+}
+
+void SignatureCacheStats(int *written, int *stalls)
+{
+  *written = cache.state.written;
+  *stalls = cache.state.stalls;
+}
+
+// Finish writing the signature file once indexing is complete
+void SignatureClose()
+{
+  if (cache.writer) {
+    SigFileClose(cache.writer);
+    cache.writer = NULL;
+  }
+}
+
 void Signature_InitCfg()
 {
   char *C = Config("SIGNATURE-WIDTH");
@@ -482,6 +504,16 @@ void Signature_InitCfg()
     cfg.termcachesize = 0;
   }
   
+  cfg.file_version = 2;
+  C = Config("SIGNATURE-FILE-VERSION");
+  if (C) {
+    cfg.file_version = atoi(C);
+    if (cfg.file_version != 2 && cfg.file_version != 3) {
+      fprintf(stderr, "Invalid SIGNATURE-FILE-VERSION value\n");
+      exit(1);
+    }
+  }
+  
   C = Config("INDEX-THREADING");
   if (C && strcmp(C, "multi") == 0) {
     cfg.thread_mode = 1;
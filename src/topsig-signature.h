@@ -23,9 +23,21 @@ void SignatureAddOffset(SignatureCache *, Signature *, const char *term, int cou
 void SignatureSetValues(Signature *sig, Document *doc);
 void SignatureWrite(SignatureCache *, Signature *, const char *docid);
 void SignatureFlush();
+// Run by a writer thread: writes out signatures as non-writer caches
+// produce them, sleeping in between, until SignatureWriterStop is called
+void SignatureWriterRun();
+void SignatureWriterStop();
+// The number of signatures written out, and of writes that had to wait for
+// the writer because its cache was full
+void SignatureCacheStats(int *written, int *stalls);
+void SignatureClose();
 void SignaturePrint(Signature *);
 void FlattenSignature(Signature *, void *, void *);
 
+// Hash of a (clipped) document id, as stored in the signature file header
+// fields. Never 0.
+unsigned int DocidHash(const char *docid, int len);
+
 SignatureCache *NewSignatureCache(int iswriter, int iscached);
 void DestroySignatureCache(SignatureCache *);
 
@@ -8,21 +8,8 @@
 
 #ifdef NO_THREADING
 
-void ProcessFile_Threaded(char *arg_filename, char *arg_filedat)
-{
-  fprintf(stderr, "Error: Threading disabled. Change INDEX-THREADING to single or compile in threading support.\n");
-  exit(1);
-}
-void Flush_Threaded() { SignatureFlush(); }
 void ThreadYield(){}
 
-Results *FindHighestScoring_Threaded(Search *S, const int start, const int count, const int topk, unsigned char *bsig, unsigned char *bmask)
-{
-  fprintf(stderr, "Error: Threading disabled. Change SEARCH-THREADING to single or compile in threading support.\n");
-  exit(1);
-  return NULL;
-}
-
 void DivideWork(void **job_inputs, void *(*start_routine)(void*), int jobs)
 {
   fprintf(stderr, "Error: Threading disabled. Change SEARCH-THREADING to single or compile in threading support.\n");
@@ -63,192 +50,11 @@ void CallOnce(void (*func)())
 #include "topsig-semaphore.h"
 #include "topsig-document.h"
 
-#define JOB_POOL 512
-
-TSemaphore sem_jobs_ready;
-TSemaphore sem_job_avail[JOB_POOL];
-
-struct thread_job {
-  enum {EMPTY, READY, TAKEN} state;
-  int owner;
-  Document *doc;
-};
-
-volatile int jobs_start = -1;
-volatile int jobs_end;
-volatile int current_jobs;
-volatile int jobs_complete;
-volatile int threads_running;
-volatile int finishup;
-volatile struct thread_job jobs[JOB_POOL];
-
-int threadpool_size = 0;
-pthread_t *threadpool;
-SignatureCache **threadcache;
-
 void ThreadYield()
 {
   sched_yield();
 }
 
-void *start_work_writer(void *sigcache_ptr)
-{
-  assert(sigcache_ptr);
-  for (;;) {
-    if (finishup) break;
-    SignatureFlush();
-    ThreadYield();
-  }
-  return NULL;
-}
-
-void *start_work(void *sigcache_ptr)
-{
-  SignatureCache *C = sigcache_ptr;
-  int threadID = atomic_add(&threads_running, 1);
-  
-  for (;;) {
-    tsem_wait(&sem_jobs_ready);
-    if (finishup) break;
-    
-    int currjob = atomic_add(&jobs_start, 1) % JOB_POOL;
-
-    jobs[currjob].state = TAKEN;
-    jobs[currjob].owner = threadID;
-    ProcessFile(C, jobs[currjob].doc);
-    
-    jobs[currjob].state = EMPTY;
-  
-    atomic_add(&jobs_complete, 1);
-    atomic_sub(&current_jobs, 1);
-    tsem_post(&sem_job_avail[currjob]);
-  }
-  
-  //printf("%d> __DONE__\n", my_tid);
-  
-  atomic_sub(&threads_running, 1);
-  //pthread_exit(NULL);
-  return NULL;
-}
-
-void ProcessFile_Threaded(Document *doc)
-{
-  if (jobs_start == -1) {
-    threads_running = 0;
-    memset((void *)jobs, 0, sizeof(jobs));
-    
-    tsem_init(&sem_jobs_ready, 0, 0);
-    for (int i = 0; i < JOB_POOL; i++) {
-      tsem_init(&sem_job_avail[i], 0, 1);
-    }
-
-    threadpool_size = atoi(Config("INDEX-THREADS"))+1;
-    threadpool = malloc(sizeof(pthread_t) * threadpool_size);
-    threadcache = malloc(sizeof(SignatureCache *) * threadpool_size);
-
-    jobs_start = 0;
-    jobs_end = 0;
-    current_jobs = 0;
-    jobs_complete = 0;
-    finishup = 0;
-
-    threadcache[0] = NewSignatureCache(2, 0);
-    pthread_create(threadpool+0, NULL, start_work_writer, threadcache[0]);
-    for (int i = 1; i < threadpool_size; i++) {
-      threadcache[i] = NewSignatureCache(0, 1);
-      pthread_create(threadpool+i, NULL, start_work, threadcache[i]);
-    }
-  }
-  int currjob = atomic_add(&jobs_end, 1) % JOB_POOL;
-
-  tsem_wait(&sem_job_avail[currjob]);
-
-  jobs[currjob].doc = doc;
-  jobs[currjob].state = READY;
-
-  atomic_add(&current_jobs, 1);
-  tsem_post(&sem_jobs_ready);
-  //printf("Job %d ready.\n", currjob);
-  
-}
-
-void Flush_Threaded()
-{
-  if (jobs_start == -1) { // single-threaded
-    SignatureFlush();
-    return;
-  } else {
-    int jobs_ready = 1;
-    while (jobs_ready > 0) {
-      tsem_getvalue(&sem_jobs_ready, &jobs_ready);
-      ThreadYield();
-    }
-    if (jobs_start != -1) {
-      finishup = 1;
-      
-      for (int i = 0; i < threadpool_size; i++) {
-        tsem_post(&sem_jobs_ready);
-      }
-      for (int i = 0; i < threadpool_size; i++) {
-        pthread_join(threadpool[i], NULL);
-      }
-      SignatureFlush();
-    }
-    return;
-  }
-}
-
-struct searchthread_params {
-  Search *S;
-  int start;
-  int count;
-  int topk;
-  unsigned char *bsig;
-  unsigned char *bmask;
-};
-
-void *FindHighestScoring_work(void *param)
-{
-  struct searchthread_params *P = param;
-  
-  return FindHighestScoring(P->S, P->start, P->count, P->topk, P->bsig, P->bmask);
-}
-
-
-Results *FindHighestScoring_Threaded(Search *S, const int start, const int count, const int topk, unsigned char *bsig, unsigned char *bmask, int threadcount)
-{
-  pthread_t searchthreads[threadcount];
-  struct searchthread_params params[threadcount];
-  for (int i = 0; i < threadcount; i++) {
-    params[i].S = S;
-    params[i].topk = topk;
-    params[i].bsig = bsig;
-    params[i].bmask = bmask;
-    
-    params[i].start = (count / threadcount * i) + start;
-    params[i].count = count / threadcount;
-    if (i == (threadcount - 1)) {
-      // Add remaining to the last thread
-      params[i].count += count - (count / threadcount * threadcount);
-    }
-    pthread_create(searchthreads+i, NULL, FindHighestScoring_work, params+i);
-  }
-  
-  Results *R = NULL;
-  Results *newR = NULL;
-  for (int i = 0; i < threadcount; i++) {
-    void *newR_void = newR;
-    pthread_join(searchthreads[i], &newR_void);
-    newR = newR_void;
-    if (R) {
-      MergeResults(R, newR);
-    } else {
-      R = newR;
-    }
-  }
-  return R;
-}
-
 // Generic job-splitting routine
 void DivideWork(void **job_inputs, void *(*start_routine)(void*), int jobs)
 {
@@ -264,12 +70,14 @@ void DivideWork(void **job_inputs, void *(*start_routine)(void*), int jobs)
 }
 
 // Thread broadcast pool. Gives each job to every thread in the pool when used.
-// This assumes threads will divide up the work themselves.
+// This assumes threads will divide up the work themselves. Idle threads
+// sleep on their semaphores rather than polling for the next job.
 
 typedef struct {
   void *threaddata;
   TBPHandle *H;
   void *result;
+  TSemaphore job_ready;
 } TBPDaemon;
 
 struct TBPHandle {
@@ -278,10 +86,10 @@ struct TBPHandle {
   
   TBPDaemon **daemons;
   
-  int current_task;
+  volatile int closing;
   void *current_task_data;
   void *(*current_task_start_routine)(void*, void*);
-  int jobs_complete;
+  TSemaphore jobs_complete;
   
   void **results;
 };
@@ -291,24 +99,14 @@ struct TBPHandle {
 void *tbp_thread_daemon(void *threaddata_vp) {
   TBPDaemon *D = threaddata_vp;
   
-  int mytask = 0;
-  
   for (;;) {
-    // Wait for a new task
-    int newtask;
-    while (atomic_cas(&D->H->current_task, mytask+1, mytask+1) == 0) {
-      ThreadYield();
-    }
-    newtask = D->H->current_task;
-    if (newtask == -1) { // Terminate
+    // Wait for a new task, or to be told to finish
+    tsem_wait(&D->job_ready);
+    if (D->H->closing) { // Terminate
       break;
     }
-    // new task
-    mytask = newtask;
     D->result = D->H->current_task_start_routine(D->threaddata, D->H->current_task_data);
-    atomic_add(&D->H->jobs_complete, 1);
-    
-    // and wait for a new task.
+    tsem_post(&D->H->jobs_complete);
   }
   return NULL;
 }
@@ -318,13 +116,15 @@ TBPHandle *TBPInit(int threads, void **threaddata)
   TBPHandle *H = malloc(sizeof(TBPHandle));
   H->threads = threads;
   H->workthreads = malloc(sizeof(pthread_t) * threads);
-  H->current_task = 0;
+  H->closing = 0;
+  tsem_init(&H->jobs_complete, 0, 0);
   H->daemons = malloc(sizeof(TBPDaemon *) * threads);
   H->results = malloc(sizeof(void *) * threads);
   for (int i = 0; i < threads; i++) {
     TBPDaemon *D = malloc(sizeof(TBPDaemon));
     D->threaddata = threaddata[i];
     D->H = H;
+    tsem_init(&D->job_ready, 0, 0);
     pthread_create(H->workthreads+i, NULL, tbp_thread_daemon, D);
     H->daemons[i] = D;
   }
@@ -333,14 +133,13 @@ TBPHandle *TBPInit(int threads, void **threaddata)
 
 void **TBPDivideWork(TBPHandle *H, void *job_input, void *(*start_routine)(void*, void*))
 {
-  H->jobs_complete = 0;
   H->current_task_data = job_input;
   H->current_task_start_routine = start_routine;
-  atomic_add(&H->current_task, 1);
-  
-  while (!atomic_cas(&H->jobs_complete, H->threads, 0)) {
-    //fprintf(stderr, "[%d %d]\n", H->jobs_complete, cmp);
-    ThreadYield();
+  for (int i = 0; i < H->threads; i++) {
+    tsem_post(&H->daemons[i]->job_ready);
+  }
+  for (int i = 0; i < H->threads; i++) {
+    tsem_wait(&H->jobs_complete);
   }
   
   for (int i = 0; i < H->threads; i++) {
@@ -353,13 +152,18 @@ void **TBPDivideWork(TBPHandle *H, void *job_input, void *(*start_routine)(void*
 
 void TBPClose(TBPHandle *H)
 {
-  atomic_cas(&H->current_task, H->current_task, -1);
+  H->closing = 1;
+  for (int i = 0; i < H->threads; i++) {
+    tsem_post(&H->daemons[i]->job_ready);
+  }
   
   for (int i = 0; i < H->threads; i++) {
     pthread_join(H->workthreads[i], NULL);
     
+    tsem_destroy(&H->daemons[i]->job_ready);
     free(H->daemons[i]);
   }
+  tsem_destroy(&H->jobs_complete);
   free(H->daemons);
   free(H->results);
   free(H->workthreads);
@@ -427,3 +231,110 @@ void DivideWorkTP(void **job_inputs, void **thread_inputs, void *(*start_routine
   free(dwtp.job_statuses);
   free(dwtp.lock);
 }
+
+// Work-stealing range pool. Each thread's range is one 64-bit word, its
+// first item in the low half and its end in the high half, so that the
+// thread taking items from the front and others stealing from the back
+// only need to compare and swap it. Ranges are kept on separate cache
+// lines.
+
+typedef struct {
+  volatile long long range;
+  char pad[64 - sizeof(long long)];
+} WSRange;
+
+typedef struct {
+  WSRange *ranges;
+  int threads;
+  int self;
+  int grain;
+  void *thread_input;
+  void (*start_routine)(int, int, void *);
+} WSWorker;
+
+static inline long long ws_pack(int begin, int end)
+{
+  return (long long)(unsigned int)begin | ((long long)end << 32);
+}
+
+static inline int ws_begin(long long range)
+{
+  return (int)(range & 0xFFFFFFFF);
+}
+
+static inline int ws_end(long long range)
+{
+  return (int)(range >> 32);
+}
+
+// Moves the back half of the largest range left to this thread's (empty)
+// range. Returns 0 if there is nothing left to take.
+static int ws_steal(WSWorker *W)
+{
+  for (;;) {
+    int victim = -1;
+    int most = 0;
+    long long victim_range = 0;
+    for (int i = 0; i < W->threads; i++) {
+      long long r = W->ranges[i].range;
+      if (ws_end(r) - ws_begin(r) > most) {
+        most = ws_end(r) - ws_begin(r);
+        victim = i;
+        victim_range = r;
+      }
+    }
+    if (victim == -1) return 0;
+    int begin = ws_begin(victim_range);
+    int end = ws_end(victim_range);
+    int mid = end - (end - begin + 1) / 2;
+    if (atomic_cas64(&W->ranges[victim].range, victim_range, ws_pack(begin, mid))) {
+      // Nobody else changes an empty range
+      W->ranges[W->self].range = ws_pack(mid, end);
+      return 1;
+    }
+  }
+}
+
+static void *ws_worker(void *in)
+{
+  WSWorker *W = in;
+  volatile long long *own = &W->ranges[W->self].range;
+  for (;;) {
+    long long r = *own;
+    int begin = ws_begin(r);
+    int end = ws_end(r);
+    if (begin >= end) {
+      if (!ws_steal(W)) break;
+      continue;
+    }
+    int take = end - begin <= W->grain ? end : begin + W->grain;
+    if (atomic_cas64(own, r, ws_pack(take, end))) {
+      W->start_routine(begin, take, W->thread_input);
+    }
+  }
+  return NULL;
+}
+
+void DivideRangeWS(int n, int grain, void **thread_inputs, void (*start_routine)(int begin, int end, void *thread_input), int threads)
+{
+  if (grain < 1) grain = 1;
+  pthread_t workthreads[threads];
+  WSWorker workers[threads];
+  WSRange *ranges = malloc(sizeof(WSRange) * threads);
+  for (int i = 0; i < threads; i++) {
+    ranges[i].range = ws_pack((long long)n * i / threads, (long long)n * (i + 1) / threads);
+  }
+  for (int i = 0; i < threads; i++) {
+    workers[i].ranges = ranges;
+    workers[i].threads = threads;
+    workers[i].self = i;
+    workers[i].grain = grain;
+    workers[i].thread_input = thread_inputs[i];
+    workers[i].start_routine = start_routine;
+    pthread_create(workthreads+i, NULL, ws_worker, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workthreads[i], NULL);
+  }
+  free(ranges);
+}
@@ -6,13 +6,6 @@
 
 void ThreadYield();
 
-// Threaded indexing
-void ProcessFile_Threaded(Document *);
-void Flush_Threaded();
-
-// Threaded searching
-Results *FindHighestScoring_Threaded(Search *, const int, const int, const int, unsigned char *, unsigned char *, int);
-
 void DivideWork(void **job_inputs, void *(*start_routine)(void*), int jobs);
 
 // Thread broadcast pool
@@ -27,4 +20,12 @@ void TBPClose(TBPHandle *H);
 // Traditional thread pool
 void DivideWorkTP(void **job_inputs, void **thread_inputs, void *(*start_routine)(void*, void*), int jobs, int threads);
 
+// Work-stealing range pool. Calls start_routine on consecutive ranges of
+// the items 0 to n-1, at most grain at a time, on each of the threads with
+// that thread's input. The items start out divided evenly among the
+// threads. A thread that runs out takes the back half of the largest range
+// another thread has left, so threads with cheap items help those with
+// expensive ones instead of finishing early.
+void DivideRangeWS(int n, int grain, void **thread_inputs, void (*start_routine)(int begin, int end, void *thread_input), int threads);
+
 #endif
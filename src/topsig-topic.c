@@ -6,30 +6,73 @@
 #include "topsig-config.h"
 #include "topsig-search.h"
 
-void run_topic(Search *S, const char *topic_id, const char *topic_txt, const char *topic_refine, FILE *fp)
+// Topics are queued and searched TOPIC-BATCH-SIZE at a time, so that each
+// pass over the collection serves a whole batch
+static struct {
+  int size;
+  int n;
+  char **ids;
+  char **txts;
+  char **refines;
+} batch;
+
+static void run_topics(Search *S, FILE *fp)
 {
   static void (*outputwriter)(FILE *fp, const char *, Results *) = NULL;
   
   outputwriter = Writer_trec;
   int num = atoi(Config("TOPIC-OUTPUT-K"));
-    
-  Results *R = NULL;
-  if (lc_strcmp(Config("TOPIC-REFINE-INVERT"), "true")!=0) {
-    R = SearchCollectionQuery(S, topic_txt, num);
-    if (topic_refine && atoi(Config("TOPIC-REFINE-K"))>0) {
-      ApplyFeedback(S, R, topic_refine, atoi(Config("TOPIC-REFINE-K")));
-    }
-  } else {
-    R = SearchCollectionQuery(S, topic_refine, num);
-    if (topic_txt && atoi(Config("TOPIC-REFINE-K"))>0) {
-      ApplyFeedback(S, R, topic_txt, atoi(Config("TOPIC-REFINE-K")));
+  int refine_k = Config("TOPIC-REFINE-K") ? atoi(Config("TOPIC-REFINE-K")) : 0;
+  int invert = lc_strcmp(Config("TOPIC-REFINE-INVERT"), "true")==0;
+  
+  Signature *sigs[batch.n];
+  for (int i = 0; i < batch.n; i++) {
+    sigs[i] = CreateQuerySignature(S, invert ? batch.refines[i] : batch.txts[i]);
+  }
+  Results **R = SearchCollectionBatch(S, sigs, batch.n, num);
+  
+  for (int i = 0; i < batch.n; i++) {
+    SignatureDestroy(sigs[i]);
+    const char *feedback = invert ? batch.txts[i] : batch.refines[i];
+    if (feedback && refine_k > 0) {
+      ApplyFeedback(S, R[i], feedback, refine_k);
     }
+    
+    outputwriter(fp, batch.ids[i], R[i]);
+    
+    FreeResults(R[i]);
+    free(batch.ids[i]);
+    free(batch.txts[i]);
+    free(batch.refines[i]);
   }
+  free(R);
+  batch.n = 0;
+}
 
+void run_topic(Search *S, const char *topic_id, const char *topic_txt, const char *topic_refine, FILE *fp)
+{
+  if (batch.size == 0) {
+    batch.size = 1;
+    if (Config("TOPIC-BATCH-SIZE")) {
+      batch.size = atoi(Config("TOPIC-BATCH-SIZE"));
+      if (batch.size <= 0) {
+        fprintf(stderr, "Invalid TOPIC-BATCH-SIZE value\n");
+        exit(1);
+      }
+    }
+    batch.ids = malloc(sizeof(char *) * batch.size);
+    batch.txts = malloc(sizeof(char *) * batch.size);
+    batch.refines = malloc(sizeof(char *) * batch.size);
+  }
   
-  outputwriter(fp, topic_id, R);
+  batch.ids[batch.n] = strdup(topic_id);
+  batch.txts[batch.n] = topic_txt ? strdup(topic_txt) : NULL;
+  batch.refines[batch.n] = topic_refine ? strdup(topic_refine) : NULL;
+  batch.n++;
   
-  FreeResults(R);
+  if (batch.n == batch.size) {
+    run_topics(S, fp);
+  }
 }
 
 void reader_filelist_rf(Search *S, FILE *in, FILE *out)
@@ -144,6 +187,9 @@ void RunTopic()
   Search *S = InitSearch();
   
   topicreader(S, fp, fo);
+  if (batch.n > 0) {
+    run_topics(S, fo);
+  }
   
   FreeSearch(S);
   fclose(fp);